@@ -0,0 +1,70 @@
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "klib/http.h"
+#include "klib/http_server.h"
+#include "klib/log.h"
+#include "klib/util.h"
+
+TEST_CASE("HTTP GET", "[http]") {
+  const std::string small(1024, 'a');
+  const std::string large(1024 * 1024, 'a');
+
+  klib::HttpServer server;
+  server.route(klib::HttpMethod::HTTP_METHOD_GET, "/small",
+               [&](const klib::ServerRequest &,
+                   klib::ServerResponse &response) { response.body = small; });
+  server.route(klib::HttpMethod::HTTP_METHOD_GET, "/large",
+               [&](const klib::ServerRequest &,
+                   klib::ServerResponse &response) { response.body = large; });
+  server.start();
+
+  klib::Request request;
+  request.set_no_proxy();
+
+  const auto url = "http://127.0.0.1:" + std::to_string(server.port());
+
+  BENCHMARK("GET 1 KiB") { return request.get(url + "/small"); };
+  BENCHMARK("GET 1 MiB") { return request.get(url + "/large"); };
+}
+
+// Needs libcurl built with HTTP/3 and a local QUIC server that also listens
+// on TCP and advertises h3 via Alt-Svc, e.g. nghttpx with
+// --frontend='127.0.0.1,8443' --frontend='127.0.0.1,8443;quic'. Emulate a
+// lossy mobile network with e.g.
+// tc qdisc add dev lo root netem delay 20ms loss 2%
+// and remove it afterwards with tc qdisc del dev lo root
+TEST_CASE("HTTP/3 under packet loss", "[http]") {
+  auto url = klib::get_env("KLIB_BENCH_HTTP3_URL");
+  if (!url || !klib::Request::http3_supported()) {
+    klib::warn(
+        "Set KLIB_BENCH_HTTP3_URL and use libcurl with HTTP/3 support to run "
+        "the HTTP/3 benchmark");
+    return;
+  }
+
+  auto tcp_metrics = std::make_shared<klib::HttpMetrics>();
+  klib::Request tcp;
+  tcp.set_no_proxy();
+  tcp.set_metrics(tcp_metrics);
+
+  auto quic_metrics = std::make_shared<klib::HttpMetrics>();
+  klib::Request quic;
+  quic.set_no_proxy();
+  quic.enable_http3(true);
+  // The first response carries Alt-Svc
+  REQUIRE(quic.get(*url).ok());
+  quic.set_metrics(quic_metrics);
+
+  BENCHMARK("HTTP/1.1 or HTTP/2") { return tcp.get(*url); };
+  BENCHMARK("HTTP/3") { return quic.get(*url); };
+
+  REQUIRE(quic_metrics->requests(klib::HttpVersion::Http3) ==
+          quic_metrics->requests());
+  klib::info("TCP:\n{}", tcp_metrics->report());
+  klib::info("QUIC:\n{}", quic_metrics->report());
+}
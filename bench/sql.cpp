@@ -0,0 +1,291 @@
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "klib/sql.h"
+
+namespace {
+
+const std::string db_name = "bench.db";
+const std::string password = "6K4VpQY5&b*WRR^Y";
+constexpr std::int64_t row_count = 10000;
+
+struct Config {
+  std::string name;
+  bool encrypted;
+  // Issued right after opening, before the first access
+  std::vector<std::string> pragmas;
+};
+
+std::unique_ptr<klib::SqlDatabase> open_database(const Config &config) {
+  auto db = config.encrypted
+                ? std::make_unique<klib::SqlDatabase>(
+                      db_name, klib::SqlDatabase::ReadWrite, password)
+                : std::make_unique<klib::SqlDatabase>(
+                      db_name, klib::SqlDatabase::ReadWrite);
+  for (const auto &pragma : config.pragmas) {
+    db->exec(pragma);
+  }
+  return db;
+}
+
+void fill_table(klib::SqlDatabase &db) {
+  db.drop_table_if_exists("Bench");
+  db.exec("CREATE TABLE Bench(Id INTEGER PRIMARY KEY, Name TEXT, Price REAL);");
+
+  klib::BulkInserter<std::int64_t, std::string, double> inserter(
+      db, "Bench", {"Id", "Name", "Price"});
+  for (std::int64_t i = 0; i < row_count; ++i) {
+    inserter.insert({i, "name" + std::to_string(i), i * 0.5});
+  }
+  inserter.finish();
+}
+
+std::vector<std::int64_t> random_ids(std::size_t count) {
+  std::mt19937_64 engine(42);
+  std::uniform_int_distribution<std::int64_t> distribution(0, row_count - 1);
+
+  std::vector<std::int64_t> ids;
+  ids.reserve(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    ids.push_back(distribution(engine));
+  }
+  return ids;
+}
+
+// Point lookups, range scans and full scans of one configuration
+void bench_reads(const Config &config) {
+  std::filesystem::remove(db_name);
+  {
+    auto db = open_database(config);
+    fill_table(*db);
+  }
+
+  auto db = open_database(config);
+  // Keep the page cache small so that pages are read, and decrypted, again
+  db->exec("PRAGMA cache_size=16");
+  const auto ids = random_ids(1000);
+
+  klib::SqlQuery query(*db);
+  BENCHMARK(config.name + " point lookup") {
+    std::size_t sum = 0;
+    for (auto id : ids) {
+      query.prepare("SELECT Name FROM Bench WHERE Id = ?");
+      query.bind(1, id);
+      for (auto [name] : query.rows<std::string_view>()) {
+        sum += std::size(name);
+      }
+    }
+    return sum;
+  };
+
+  BENCHMARK(config.name + " range scan") {
+    query.prepare("SELECT Id, Price FROM Bench WHERE Id BETWEEN ? AND ?");
+    query.bind_all(row_count / 2, row_count / 2 + 999);
+    double sum = 0;
+    for (auto [id, price] : query.rows<std::int64_t, double>()) {
+      sum += price;
+    }
+    return sum;
+  };
+
+  BENCHMARK(config.name + " full scan") {
+    query.prepare("SELECT Id, Name, Price FROM Bench");
+    std::size_t sum = 0;
+    for (auto [id, name, price] :
+         query.rows<std::int64_t, std::string_view, double>()) {
+      sum += std::size(name);
+    }
+    return sum;
+  };
+
+  query.finalize();
+  db.reset();
+  std::filesystem::remove(db_name);
+}
+
+const Config plain = {"plain", false, {}};
+const Config encrypted = {"encrypted", true, {}};
+
+}  // namespace
+
+TEST_CASE("SQL read rows", "[sql]") {
+  std::filesystem::remove(db_name);
+  klib::SqlDatabase db(db_name, klib::SqlDatabase::ReadWrite, password);
+  fill_table(db);
+
+  klib::SqlQuery query(db);
+  query.prepare("SELECT Id, Name, Price FROM Bench");
+
+  BENCHMARK("column") {
+    std::int64_t sum = 0;
+    while (query.next()) {
+      sum += query.get_column(0).as_int64();
+      sum += std::size(query.get_column(1).as_text());
+      sum += static_cast<std::int64_t>(query.get_column(2).as_double());
+    }
+    return sum;
+  };
+
+  BENCHMARK("column view") {
+    std::int64_t sum = 0;
+    while (query.next()) {
+      sum += query.get_column(0).as_int64();
+      sum += std::size(query.get_column(1).as_text_view());
+      sum += static_cast<std::int64_t>(query.get_column(2).as_double());
+    }
+    return sum;
+  };
+
+  BENCHMARK("rows") {
+    std::int64_t sum = 0;
+    for (const auto &[id, name, price] :
+         query.rows<std::int64_t, std::string, double>()) {
+      sum += id + std::size(name) + static_cast<std::int64_t>(price);
+    }
+    return sum;
+  };
+
+  BENCHMARK("rows view") {
+    std::int64_t sum = 0;
+    for (const auto &[id, name, price] :
+         query.rows<std::int64_t, std::string_view, double>()) {
+      sum += id + std::size(name) + static_cast<std::int64_t>(price);
+    }
+    return sum;
+  };
+
+  query.finalize();
+  std::filesystem::remove(db_name);
+}
+
+TEST_CASE("SQL encryption", "[sql]") {
+  bench_reads(plain);
+  bench_reads(encrypted);
+}
+
+TEST_CASE("SQL page size", "[sql]") {
+  for (auto page_size : {1024, 4096, 16384, 65536}) {
+    const auto size = std::to_string(page_size);
+    bench_reads({"plain " + size, false, {"PRAGMA page_size=" + size}});
+    bench_reads(
+        {"encrypted " + size, true, {"PRAGMA cipher_page_size=" + size}});
+  }
+}
+
+TEST_CASE("SQL cipher", "[sql]") {
+  for (std::string algorithm : {"HMAC_SHA1", "HMAC_SHA256", "HMAC_SHA512"}) {
+    bench_reads(
+        {algorithm, true, {"PRAGMA cipher_hmac_algorithm=" + algorithm}});
+  }
+  bench_reads({"no HMAC", true, {"PRAGMA cipher_use_hmac=OFF"}});
+
+  // Key derivation runs on the first access after opening
+  for (auto kdf_iter : {4000, 64000, 256000}) {
+    const Config config = {"kdf_iter " + std::to_string(kdf_iter),
+                           true,
+                           {"PRAGMA kdf_iter=" + std::to_string(kdf_iter)}};
+    std::filesystem::remove(db_name);
+    fill_table(*open_database(config));
+
+    BENCHMARK(config.name + " open") {
+      auto db = open_database(config);
+      return db->table_line_count("Bench");
+    };
+    std::filesystem::remove(db_name);
+  }
+
+  klib::CipherOptions options;
+  options.raw_key = true;
+  const std::string key(32, '\x5a');
+  std::filesystem::remove(db_name);
+  {
+    klib::SqlDatabase db(db_name, klib::SqlDatabase::ReadWrite, key, options);
+    fill_table(db);
+  }
+
+  BENCHMARK("raw key open") {
+    klib::SqlDatabase db(db_name, klib::SqlDatabase::ReadWrite, key, options);
+    return db.table_line_count("Bench");
+  };
+  std::filesystem::remove(db_name);
+}
+
+TEST_CASE("SQL bulk insert", "[sql]") {
+  for (const auto &config : {plain, encrypted}) {
+    std::filesystem::remove(db_name);
+    auto db = open_database(config);
+    fill_table(*db);
+
+    BENCHMARK(config.name + " row by row") {
+      db->exec("DELETE FROM Bench");
+      klib::SqlQuery query(*db);
+      query.prepare("INSERT INTO Bench(Id, Name, Price) VALUES(?, ?, ?)");
+      db->transaction();
+      for (std::int64_t i = 0; i < row_count; ++i) {
+        query.bind_all(i, "name" + std::to_string(i), i * 0.5);
+        query.exec();
+      }
+      db->commit();
+    };
+
+    BENCHMARK(config.name + " BulkInserter") { fill_table(*db); };
+
+    db.reset();
+    std::filesystem::remove(db_name);
+  }
+}
+
+TEST_CASE("SQL blob", "[sql]") {
+  std::string text;
+  for (std::int32_t i = 0; std::size(text) < 64 * 1024; ++i) {
+    text += R"({"id": )" + std::to_string(i) + R"(, "name": "user)" +
+            std::to_string(i * 7) + R"(", "active": true}, )";
+  }
+  std::string random(64 * 1024, '\0');
+  std::mt19937 engine(42);
+  for (auto &c : random) {
+    c = static_cast<char>(engine());
+  }
+
+  std::filesystem::remove(db_name);
+  klib::SqlDatabase db(db_name, klib::SqlDatabase::ReadWrite, password);
+  db.exec("CREATE TABLE Blob(Id INTEGER PRIMARY KEY, Data BLOB);");
+  klib::SqlQuery query(db);
+
+  for (const auto &[name, blob] : {std::pair{"text", &text},
+                                   std::pair{"random", &random}}) {
+    for (auto compression :
+         {klib::BlobCompression::None, klib::BlobCompression::Zstd}) {
+      const std::string prefix =
+          std::string(name) +
+          (compression == klib::BlobCompression::None ? " none" : " zstd");
+
+      BENCHMARK(prefix + " write") {
+        query.prepare("INSERT OR REPLACE INTO Blob(Id, Data) VALUES(1, ?)");
+        query.bind(1, std::data(*blob), std::size(*blob), compression);
+        return query.exec();
+      };
+
+      BENCHMARK(prefix + " read") {
+        query.prepare("SELECT Data FROM Blob WHERE Id = 1");
+        REQUIRE(query.next());
+        auto result = query.get_column(0).as_blob(compression);
+        query.finalize();
+        return result;
+      };
+    }
+  }
+
+  query.finalize();
+  std::filesystem::remove(db_name);
+}
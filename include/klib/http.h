@@ -5,10 +5,16 @@
 
 #pragma once
 
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <experimental/propagate_const>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include <parallel_hashmap/phmap.h>
 
@@ -74,8 +80,366 @@ inline std::string http_method_str(HttpMethod http_method) {
 
 #undef KLIB_HTTP_METHOD_MAP
 
+/**
+ * @brief Content encoding of the request content
+ */
+enum class ContentEncoding { Identity, Gzip, Zstd, Brotli };
+
 class Response;
 
+/**
+ * @brief Receives the response content chunk by chunk
+ * @note Return false to abort the transfer, an exception thrown by the
+ * callback also aborts it and is rethrown to the caller
+ */
+using WriteCallback = std::function<bool(std::string_view data)>;
+
+/**
+ * @brief Fills the request content chunk by chunk
+ * @note Return the number of bytes written to the buffer, 0 means the end of
+ * the content, an exception thrown by the callback aborts the transfer and is
+ * rethrown to the caller
+ */
+using ReadCallback = std::function<std::size_t(char *buffer, std::size_t size)>;
+
+/**
+ * @brief Statistics of the cache shared between Request instances
+ */
+struct ShareStatistics {
+  /**
+   * @brief The number of transfers performed with the shared cache
+   */
+  std::uint64_t transfers = 0;
+
+  /**
+   * @brief The number of new connections that had to be created
+   */
+  std::uint64_t connects = 0;
+
+  /**
+   * @brief The number of TLS handshakes performed
+   */
+  std::uint64_t tls_handshakes = 0;
+};
+
+/**
+ * @brief Policy of retrying failed requests
+ * @note Only idempotent requests are retried by default, and a request is never
+ * retried once part of the response content has been passed to a callback or
+ * the request content has been read from a callback
+ */
+struct RetryPolicy {
+  /**
+   * @brief The maximum number of retries
+   */
+  std::int32_t max_retries = 3;
+
+  /**
+   * @brief The upper bound of the first delay, doubled for each further retry,
+   * the actual delay is chosen uniformly at random below it(full jitter)
+   */
+  std::chrono::milliseconds base_delay{100};
+
+  /**
+   * @brief The upper bound of all delays, a longer Retry-After is not waited
+   * for and the response is returned as is
+   */
+  std::chrono::milliseconds max_delay{10000};
+
+  /**
+   * @brief Whether to retry transient transport errors, such as connection
+   * failures and timeouts
+   */
+  bool retry_on_error = true;
+
+  /**
+   * @brief Status codes that are retried, Retry-After is honored
+   */
+  std::vector<HttpStatus> retry_status = {
+      HttpStatus::HTTP_STATUS_TOO_MANY_REQUESTS,
+      HttpStatus::HTTP_STATUS_SERVICE_UNAVAILABLE};
+
+  /**
+   * @brief Whether to retry non-idempotent requests, such as POST
+   */
+  bool retry_non_idempotent = false;
+};
+
+/**
+ * @brief Negotiated HTTP version
+ */
+enum class HttpVersion { Unknown, Http10, Http11, Http2, Http3 };
+
+/**
+ * @brief Timing breakdown and transfer information of a request
+ * @note All times are measured from the start of the request, of the last one
+ * if it was retried
+ * @see https://curl.se/libcurl/c/curl_easy_getinfo.html#TIMES
+ */
+struct TransferInfo {
+  /**
+   * @brief Time until the name resolving was completed
+   */
+  std::chrono::microseconds namelookup{0};
+
+  /**
+   * @brief Time until the connection to the remote host(or proxy) was completed
+   */
+  std::chrono::microseconds connect{0};
+
+  /**
+   * @brief Time until the TLS handshake was completed, 0 if TLS was not used
+   */
+  std::chrono::microseconds appconnect{0};
+
+  /**
+   * @brief Time until the transfer was just about to begin
+   */
+  std::chrono::microseconds pretransfer{0};
+
+  /**
+   * @brief Time until the first byte of the response was received
+   */
+  std::chrono::microseconds starttransfer{0};
+
+  /**
+   * @brief Total time of the request, including redirects
+   */
+  std::chrono::microseconds total{0};
+
+  /**
+   * @brief The number of bytes of the request content sent
+   */
+  std::int64_t bytes_uploaded = 0;
+
+  /**
+   * @brief The number of bytes of the response content received
+   */
+  std::int64_t bytes_downloaded = 0;
+
+  /**
+   * @brief Negotiated HTTP version
+   */
+  HttpVersion http_version = HttpVersion::Unknown;
+
+  /**
+   * @brief Whether an existing connection was reused
+   */
+  bool connection_reused = false;
+
+  /**
+   * @brief The number of retries performed before this request
+   */
+  std::int32_t retries = 0;
+};
+
+/**
+ * @brief Timing phases recorded by HttpMetrics
+ */
+enum class TimingPhase {
+  NameLookup,
+  Connect,
+  AppConnect,
+  PreTransfer,
+  StartTransfer,
+  Total
+};
+
+/**
+ * @brief A bucket of the latency histogram
+ */
+struct HistogramBucket {
+  /**
+   * @brief Exclusive upper bound of the bucket
+   */
+  std::chrono::microseconds upper_bound{0};
+
+  /**
+   * @brief The number of samples in the bucket
+   */
+  std::uint64_t count = 0;
+};
+
+/**
+ * @brief Aggregates the transfer information of requests into histograms
+ * @note Thread safe, can be shared by several Request instances. The buckets
+ * are log-linear(8 per power of two), so the relative error of percentiles is
+ * at most 12.5%
+ */
+class HttpMetrics {
+ public:
+  /**
+   * @brief Default constructor
+   */
+  HttpMetrics();
+
+  HttpMetrics(const HttpMetrics &) = delete;
+  HttpMetrics(HttpMetrics &&) = delete;
+  HttpMetrics &operator=(const HttpMetrics &) = delete;
+  HttpMetrics &operator=(HttpMetrics &&) = delete;
+
+  /**
+   * @brief Destructor
+   */
+  ~HttpMetrics();
+
+  /**
+   * @brief Record the transfer information of a request
+   * @param info: Transfer information
+   */
+  void record(const TransferInfo &info);
+
+  /**
+   * @brief Get the number of requests recorded
+   * @return The number of requests
+   */
+  [[nodiscard]] std::uint64_t requests() const;
+
+  /**
+   * @brief Get the number of requests recorded with the HTTP version
+   * @param version: HTTP version
+   * @return The number of requests
+   */
+  [[nodiscard]] std::uint64_t requests(HttpVersion version) const;
+
+  /**
+   * @brief Get the number of requests that reused an existing connection
+   * @return The number of requests
+   */
+  [[nodiscard]] std::uint64_t reused_connections() const;
+
+  /**
+   * @brief Get the number of retries of all requests
+   * @return The number of retries
+   */
+  [[nodiscard]] std::uint64_t retries() const;
+
+  /**
+   * @brief Get the total number of bytes of the request content sent
+   * @return The number of bytes
+   */
+  [[nodiscard]] std::int64_t bytes_uploaded() const;
+
+  /**
+   * @brief Get the total number of bytes of the response content received
+   * @return The number of bytes
+   */
+  [[nodiscard]] std::int64_t bytes_downloaded() const;
+
+  /**
+   * @brief Get the percentile of the timing phase
+   * @param phase: Timing phase
+   * @param percentile: Percentile in [0, 100]
+   * @return The upper bound of the bucket containing the percentile, 0 if no
+   * request has been recorded
+   */
+  [[nodiscard]] std::chrono::microseconds percentile(TimingPhase phase,
+                                                     double percentile) const;
+
+  /**
+   * @brief Get the maximum of the timing phase
+   * @param phase: Timing phase
+   * @return The maximum time
+   */
+  [[nodiscard]] std::chrono::microseconds max(TimingPhase phase) const;
+
+  /**
+   * @brief Get the histogram of the timing phase
+   * @param phase: Timing phase
+   * @return Non-empty buckets in ascending order
+   */
+  [[nodiscard]] std::vector<HistogramBucket> histogram(
+      TimingPhase phase) const;
+
+  /**
+   * @brief Get a human readable summary of the metrics
+   * @return Summary with the percentiles of all timing phases
+   */
+  [[nodiscard]] std::string report() const;
+
+  /**
+   * @brief Clear all recorded data
+   */
+  void reset();
+
+ private:
+  class HttpMetricsImpl;
+  std::experimental::propagate_const<std::unique_ptr<HttpMetricsImpl>> impl_;
+};
+
+/**
+ * @brief Limits the request rate per host and the bandwidth of all requests
+ * @note Thread safe, can be shared by several Request instances. Both limits
+ * are token buckets, waiting requests to the same host are served in the order
+ * they arrived, the lock of a host is never held while waiting
+ */
+class RateLimiter {
+ public:
+  /**
+   * @brief Constructor
+   * @param qps: Default number of requests per second to each host, 0 means
+   * unlimited
+   * @param burst: Default number of requests to each host that can be sent at
+   * once after being idle
+   * @param bandwidth: Bytes per second received and sent by all requests, 0
+   * means unlimited
+   */
+  explicit RateLimiter(double qps = 0, std::int32_t burst = 1,
+                       std::int64_t bandwidth = 0);
+
+  RateLimiter(const RateLimiter &) = delete;
+  RateLimiter(RateLimiter &&) = delete;
+  RateLimiter &operator=(const RateLimiter &) = delete;
+  RateLimiter &operator=(RateLimiter &&) = delete;
+
+  /**
+   * @brief Destructor
+   */
+  ~RateLimiter();
+
+  /**
+   * @brief Set the request rate of a host, overriding the default
+   * @param host: Host name, case insensitive
+   * @param qps: The number of requests per second, 0 means unlimited
+   * @param burst: The number of requests that can be sent at once after being
+   * idle
+   */
+  void set_host_rate(const std::string &host, double qps,
+                     std::int32_t burst = 1);
+
+  /**
+   * @brief Set the bandwidth of all requests
+   * @param bytes_per_second: Bytes per second, 0 means unlimited
+   * @note Up to one second worth of bytes can be transferred at once after
+   * being idle
+   */
+  void set_bandwidth(std::int64_t bytes_per_second);
+
+  /**
+   * @brief Wait until a request to the host is allowed
+   * @param host: Host name, case insensitive
+   * @return The time waited
+   */
+  std::chrono::nanoseconds acquire(std::string_view host);
+
+  /**
+   * @brief Take a request to the host if it is allowed now, without waiting
+   * @param host: Host name, case insensitive
+   * @return True if the request is allowed
+   */
+  bool try_acquire(std::string_view host);
+
+  /**
+   * @brief Account for transferred bytes, wait if the bandwidth is exceeded
+   * @param bytes: The number of bytes transferred
+   */
+  void throttle(std::int64_t bytes);
+
+ private:
+  class RateLimiterImpl;
+  std::experimental::propagate_const<std::unique_ptr<RateLimiterImpl>> impl_;
+};
+
 /**
  * @brief Constructs and sends a Request
  */
@@ -104,6 +468,39 @@ class Request {
    */
   void verbose(bool flag);
 
+  /**
+   * @brief Whether to share the DNS cache, TLS sessions, connections and
+   * cookies with other Request instances(The default is false)
+   * @param flag: True to use the shared cache
+   * @note The shared cache is thread safe, so Request instances in different
+   * threads can reuse each other's warm connections
+   */
+  void use_share_cache(bool flag);
+
+  /**
+   * @brief Get statistics of the shared cache
+   * @return Statistics of the shared cache
+   */
+  [[nodiscard]] static ShareStatistics share_statistics();
+
+  /**
+   * @brief Whether libcurl is built with HTTP/3 support
+   * @return True if HTTP/3 is supported
+   */
+  [[nodiscard]] static bool http3_supported();
+
+  /**
+   * @brief Whether to upgrade to HTTP/3 when the server advertises it via
+   * Alt-Svc(The default is false)
+   * @param flag: True to enable HTTP/3
+   * @note The first request to a host uses HTTP/1.1 or HTTP/2, the Alt-Svc
+   * header is cached, so that later requests connect over QUIC. If the QUIC
+   * connection fails, the request is sent again without HTTP/3, except for
+   * hedged requests. If HTTP/3 is not supported, a warning is reported and
+   * HTTP/1.1 and HTTP/2 are used
+   */
+  void enable_http3(bool flag);
+
   /**
    * @brief Set up proxy
    * @param proxy: String representing proxy
@@ -160,6 +557,41 @@ class Request {
   void set_cookie(
       const phmap::flat_hash_map<std::string, std::string> &cookies);
 
+  /**
+   * @brief Compress the content of POST requests and set Content-Encoding(The
+   * default is not compressed)
+   * @param encoding: Content encoding
+   * @param threshold: Content smaller than the threshold is not compressed
+   * @note Only applies to url-encoded form and json content, make sure the
+   * server supports the encoding
+   */
+  void set_request_compression(ContentEncoding encoding,
+                               std::size_t threshold = 1024);
+
+  /**
+   * @brief Set the policy of retrying failed requests(The default is not to
+   * retry)
+   * @param policy: Retry policy
+   */
+  void set_retry_policy(const RetryPolicy &policy);
+
+  /**
+   * @brief Record the transfer information of every completed request(The
+   * default is not to record)
+   * @param metrics: Metrics sink, nullptr to stop recording
+   */
+  void set_metrics(std::shared_ptr<HttpMetrics> metrics);
+
+  /**
+   * @brief Limit the request rate and bandwidth(The default is unlimited)
+   * @param limiter: Rate limiter, nullptr to remove the limits
+   * @note Every attempt, including retries, hedged requests and segments of
+   * segmented downloads, takes a request from the host of the requested url,
+   * hosts reached through redirects are not limited. A hedged request is not
+   * sent if it is not allowed right away
+   */
+  void set_rate_limiter(std::shared_ptr<RateLimiter> limiter);
+
   /**
    * @brief Enable HTTP basic authentication
    * @param user_name: User name
@@ -177,6 +609,120 @@ class Request {
       const std::string &url,
       const phmap::flat_hash_map<std::string, std::string> &headers = {});
 
+  /**
+   * @brief Sends a GET request, if it has not completed after the delay, sends
+   * an identical second request, whichever completes first wins
+   * @param url: Requested url
+   * @param headers: HTTP headers
+   * @param delay: Delay before sending the second request, 0 means the 95th
+   * percentile of the latencies of previous hedged requests
+   * @return Response content
+   * @note Cuts tail latency at the cost of about 5% extra requests, with an
+   * adaptive delay, the first requests are not hedged until enough latencies
+   * have been observed, hedged requests are not retried
+   */
+  Response get_hedged(
+      const std::string &url,
+      const phmap::flat_hash_map<std::string, std::string> &headers = {},
+      std::chrono::milliseconds delay = std::chrono::milliseconds(0));
+
+  /**
+   * @brief Sends a GET request, the response content is passed to the callback
+   * as it arrives instead of being buffered
+   * @param url: Requested url
+   * @param callback: Receives the response content chunk by chunk
+   * @param headers: HTTP headers
+   * @return Response content, whose text is empty
+   */
+  Response get_stream(
+      const std::string &url, const WriteCallback &callback,
+      const phmap::flat_hash_map<std::string, std::string> &headers = {});
+
+  /**
+   * @brief Sends a GET request, the response content is written directly to
+   * the file instead of being buffered
+   * @param url: Requested url
+   * @param path: File path
+   * @param headers: HTTP headers
+   * @return Response content, whose text is empty
+   */
+  Response download(
+      const std::string &url, const std::string &path,
+      const phmap::flat_hash_map<std::string, std::string> &headers = {});
+
+  /**
+   * @brief Downloads the content using several concurrent range requests, each
+   * segment is written directly to its position in the file
+   * @param url: Requested url
+   * @param path: File path
+   * @param segments: The number of concurrent connections
+   * @param sha256: Expected SHA-256 of the content in hexadecimal
+   * representation, not verified if empty
+   * @param headers: HTTP headers
+   * @return Response content of the HEAD request, whose text is empty
+   * @note Fall back to a single connection if the server does not support
+   * range requests or does not report the content length. The content is
+   * requested without content coding, and the file is removed if the download
+   * fails
+   */
+  Response download_segmented(
+      const std::string &url, const std::string &path,
+      std::int32_t segments = 4, const std::string &sha256 = "",
+      const phmap::flat_hash_map<std::string, std::string> &headers = {});
+
+  /**
+   * @brief Sends a GET request with If-None-Match header
+   * @param url: Requested url
+   * @param etag: The ETag of the cached content
+   * @param headers: HTTP headers
+   * @return Response content, the status code is 304 if the content has not
+   * changed
+   */
+  Response get_if_none_match(
+      const std::string &url, const std::string &etag,
+      const phmap::flat_hash_map<std::string, std::string> &headers = {});
+
+  /**
+   * @brief Sends a GET request with If-Modified-Since header
+   * @param url: Requested url
+   * @param last_modified: The Last-Modified of the cached content
+   * @param headers: HTTP headers
+   * @return Response content, the status code is 304 if the content has not
+   * changed
+   */
+  Response get_if_modified_since(
+      const std::string &url, const std::string &last_modified,
+      const phmap::flat_hash_map<std::string, std::string> &headers = {});
+
+  /**
+   * @brief Sends a GET request for part of the content
+   * @param url: Requested url
+   * @param begin: Offset of the first byte
+   * @param end: Offset of the last byte(inclusive), negative means until the
+   * end
+   * @param headers: HTTP headers
+   * @return Response content, the status code is 206 if the server honors the
+   * range
+   * @note Content coding is not requested, so the bytes are those of the
+   * identity representation
+   */
+  Response get_range(
+      const std::string &url, std::int64_t begin, std::int64_t end = -1,
+      const phmap::flat_hash_map<std::string, std::string> &headers = {});
+
+  /**
+   * @brief Sends a GET request and appends the rest of the content to the
+   * partially downloaded file
+   * @param url: Requested url
+   * @param path: File path
+   * @param headers: HTTP headers
+   * @return Response content, whose text is empty
+   * @note If the server ignores the range, the file is rewritten from scratch
+   */
+  Response resume_download(
+      const std::string &url, const std::string &path,
+      const phmap::flat_hash_map<std::string, std::string> &headers = {});
+
   /**
    * @brief Sends a POST request
    * @param url: Requested url
@@ -200,6 +746,33 @@ class Request {
       const std::string &url, const std::string &json,
       const phmap::flat_hash_map<std::string, std::string> &headers = {});
 
+  /**
+   * @brief Sends a POST request, the request content is read from the callback
+   * instead of being buffered
+   * @param url: Requested url
+   * @param callback: Fills the request content chunk by chunk
+   * @param size: The size of the request content, negative means unknown, in
+   * which case chunked transfer encoding is used
+   * @param headers: HTTP headers
+   * @return Response content
+   */
+  Response post_stream(
+      const std::string &url, const ReadCallback &callback,
+      std::int64_t size = -1,
+      const phmap::flat_hash_map<std::string, std::string> &headers = {});
+
+  /**
+   * @brief Sends a POST request, the request content is read directly from the
+   * file
+   * @param url: Requested url
+   * @param path: File path
+   * @param headers: HTTP headers
+   * @return Response content
+   */
+  Response post_file(
+      const std::string &url, const std::string &path,
+      const phmap::flat_hash_map<std::string, std::string> &headers = {});
+
   /**
    * @brief Sends a POST request
    * @param url: Requested url
@@ -243,11 +816,37 @@ class Response {
    */
   [[nodiscard]] bool ok() const;
 
+  /**
+   * @brief Get response headers
+   * @return Response headers, whose names are lowercase
+   */
+  [[nodiscard]] const phmap::flat_hash_map<std::string, std::string> &headers()
+      const;
+
+  /**
+   * @brief Get the value of response header
+   * @param name: Header name, case insensitive
+   * @return The value of response header, or std::nullopt if it does not exist
+   */
+  [[nodiscard]] std::optional<std::string> header(std::string_view name) const;
+
   /**
    * @brief Get response content
    * @return Response content
    */
-  [[nodiscard]] std::string text() const;
+  [[nodiscard]] const std::string &text() const &;
+
+  /**
+   * @brief Get response content, which is moved out of the temporary object
+   * @return Response content
+   */
+  [[nodiscard]] std::string text() &&;
+
+  /**
+   * @brief Get the timing breakdown and transfer information
+   * @return Transfer information
+   */
+  [[nodiscard]] const TransferInfo &transfer_info() const;
 
   /**
    * @brief Save response content to file
@@ -258,7 +857,9 @@ class Response {
 
  private:
   HttpStatus status_;
+  phmap::flat_hash_map<std::string, std::string> headers_;
   std::string text_;
+  TransferInfo transfer_info_;
 };
 
 }  // namespace klib
@@ -0,0 +1,174 @@
+/**
+ * @file http_server.h
+ * @brief Contains embedded HTTP server module
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <experimental/propagate_const>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include <parallel_hashmap/phmap.h>
+
+#include "klib/http.h"
+
+namespace klib {
+
+/**
+ * @brief Request received by HttpServer
+ */
+struct ServerRequest {
+  /**
+   * @brief Request method
+   */
+  HttpMethod method = HttpMethod::HTTP_METHOD_GET;
+
+  /**
+   * @brief Decoded path, without the query string
+   */
+  std::string path;
+
+  /**
+   * @brief Query string, without the leading '?'
+   */
+  std::string query;
+
+  /**
+   * @brief Request headers, the names are in lowercase
+   */
+  phmap::flat_hash_map<std::string, std::string> headers;
+
+  /**
+   * @brief Request content
+   */
+  std::string body;
+
+  /**
+   * @brief Get a request header
+   * @param name: Header name, case insensitive
+   * @return The header value, or std::nullopt if it is not present
+   */
+  [[nodiscard]] std::optional<std::string> header(std::string_view name) const;
+};
+
+/**
+ * @brief Response filled in by the request handler
+ */
+struct ServerResponse {
+  /**
+   * @brief Response status
+   */
+  HttpStatus status = HttpStatus::HTTP_STATUS_OK;
+
+  /**
+   * @brief Response headers, Content-Length is always set by the server
+   */
+  phmap::flat_hash_map<std::string, std::string> headers;
+
+  /**
+   * @brief Response content
+   */
+  std::string body;
+
+  /**
+   * @brief If not empty, the file is sent as the response content instead of
+   * body, without being copied into user space
+   */
+  std::string file;
+};
+
+/**
+ * @brief Handles a request and fills in the response
+ * @note Called concurrently from the worker threads, an exception thrown
+ * results in 500 Internal Server Error
+ */
+using RequestHandler =
+    std::function<void(const ServerRequest &request, ServerResponse &response)>;
+
+/**
+ * @brief Embedded multithreaded HTTP/1.1 and HTTP/2 server
+ * @note Each worker thread has its own epoll instance and listening socket(via
+ * SO_REUSEPORT), HTTP/2 is served over cleartext with prior knowledge(h2c)
+ */
+class HttpServer {
+ public:
+  /**
+   * @brief Constructor
+   * @param host: IPv4 address to bind to
+   * @param port: Port to bind to, 0 means an ephemeral port
+   * @param threads: The number of worker threads, 0 means the number of
+   * hardware threads
+   */
+  explicit HttpServer(const std::string &host = "127.0.0.1",
+                      std::uint16_t port = 0, std::int32_t threads = 0);
+
+  HttpServer(const HttpServer &) = delete;
+  HttpServer(HttpServer &&) = delete;
+  HttpServer &operator=(const HttpServer &) = delete;
+  HttpServer &operator=(HttpServer &&) = delete;
+
+  /**
+   * @brief Destructor, stops the server
+   */
+  ~HttpServer();
+
+  /**
+   * @brief Register a request handler
+   * @param method: Request method
+   * @param path: Exact request path
+   * @param handler: Request handler
+   * @note Must be called before start()
+   */
+  void route(HttpMethod method, const std::string &path,
+             const RequestHandler &handler);
+
+  /**
+   * @brief Serve the files in the directory for GET and HEAD requests
+   * @param prefix: Path prefix, e.g. "/static"
+   * @param dir: Directory path
+   * @note Must be called before start(), routes take precedence over mounts,
+   * the longest matching prefix wins, single byte ranges are supported
+   */
+  void mount(const std::string &prefix, const std::string &dir);
+
+  /**
+   * @brief Set the maximum size of the request content(The default is 64 MiB)
+   * @param size: Maximum size in bytes
+   * @note Larger requests are answered with 413 Payload Too Large
+   */
+  void set_max_body_size(std::size_t size);
+
+  /**
+   * @brief Set the idle timeout of connections(The default is 60 seconds)
+   * @param seconds: Connections without any activity for this long are closed,
+   * 0 means never
+   */
+  void set_idle_timeout(std::int64_t seconds);
+
+  /**
+   * @brief Bind the listening sockets and start the worker threads
+   */
+  void start();
+
+  /**
+   * @brief Stop the worker threads and close all connections
+   */
+  void stop();
+
+  /**
+   * @brief Get the port the server is bound to
+   * @return The port, useful when constructed with port 0
+   */
+  [[nodiscard]] std::uint16_t port() const;
+
+ private:
+  class HttpServerImpl;
+  std::experimental::propagate_const<std::unique_ptr<HttpServerImpl>> impl_;
+};
+
+}  // namespace klib
@@ -5,34 +5,63 @@
 
 #pragma once
 
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <exception>
+#include <iterator>
 #include <experimental/propagate_const>
+#include <functional>
+#include <future>
 #include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+struct sqlite3_stmt;
 
 namespace klib {
 
 class SqlQuery;
 
+template <typename... Ts>
+class SqlRows;
+
+/**
+ * @brief How a blob is compressed when stored in the database
+ * @note The same value must be used to bind and to read a column
+ */
+enum class BlobCompression {
+  /**
+   * @brief Stored as is, for data that is already compressed such as JPEG or
+   * WebP, and for other readers of the database
+   */
+  None,
+  /**
+   * @brief Zstandard, the only option of previous versions
+   */
+  Zstd,
+  /**
+   * @brief Zstandard with the latest dictionary trained by
+   * SqlDatabase::train_dictionary(), for tables of many small similar blobs
+   */
+  ZstdDictionary,
+};
+
 /**
  * @brief Represents a column of data in a row
+ * @note A lightweight view of the current row of a SqlQuery, valid until the
+ * next call to SqlQuery::next() or SqlQuery::exec()
  */
 class Column {
   friend class SqlQuery;
 
  public:
-  Column(const Column &) = delete;
-  Column(Column &&) = delete;
-  Column &operator=(const Column &) = delete;
-  Column &operator=(Column &&) = delete;
-
-  /**
-   * @brief Destructor
-   */
-  ~Column();
-
   /**
    * @brief Determine whether the data is of null type
    * @return Returns true if it is of null type
@@ -63,28 +92,59 @@ class Column {
    */
   [[nodiscard]] std::string as_text() const;
 
+  /**
+   * @brief Return the text value of the column without copying
+   * @return Text value, valid until the next step of the query
+   */
+  [[nodiscard]] std::string_view as_text_view() const;
+
   /**
    * @brief Return the blob value of the column
-   * @return Blob value
-   * @note Automatically use Zstandard algorithm to decompress
+   * @param compression: How the blob was compressed when it was bound
+   * @return Decompressed blob value
    */
-  [[nodiscard]] std::string as_blob() const;
+  [[nodiscard]] std::string as_blob(
+      BlobCompression compression = BlobCompression::None) const;
+
+  /**
+   * @brief Return the blob value of the column as stored, without
+   * decompressing or copying
+   * @return Blob value, valid until the next step of the query
+   */
+  [[nodiscard]] std::string_view as_blob_view() const;
 
  private:
-  Column(SqlQuery &sql_query, std::int32_t index);
+  Column(const SqlQuery *query, sqlite3_stmt *stmt, std::int32_t index)
+      : query_(query), stmt_(stmt), index_(index) {}
+
+  [[nodiscard]] std::int32_t get_type() const;
 
-  class ColumnImpl;
-  std::experimental::propagate_const<std::unique_ptr<ColumnImpl>> impl_;
+  const SqlQuery *query_ = nullptr;
+  sqlite3_stmt *stmt_ = nullptr;
+  std::int32_t index_ = 0;
 };
 
 class SqlDatabase;
 
+/**
+ * @brief Called after each step of SqlDatabase::backup()
+ * @param remaining: The number of pages still to be copied
+ * @param page_count: The number of pages of the source database
+ * @return Whether to continue the backup
+ */
+using BackupCallback =
+    std::function<bool(std::int32_t remaining, std::int32_t page_count)>;
+
 /**
  * @brief Represents a SQL statement
+ * @note May outlive its SqlDatabase, it can then only be finalized or
+ * destroyed
  */
 class SqlQuery {
+  friend class Column;
   friend class SqlDatabase;
-  friend class Column::ColumnImpl;
+  template <typename... Ts>
+  friend class SqlRows;
 
  public:
   /**
@@ -105,6 +165,8 @@ class SqlQuery {
 
   /**
    * @brief Destroy the SQL statement saved in the object
+   * @note The statement is reset and put back into the statement cache of the
+   * database
    * @see SqlDatabase::vacuum()
    */
   void finalize();
@@ -112,6 +174,9 @@ class SqlQuery {
   /**
    * @brief Compile the given SQL statement
    * @param sql: SQL statement
+   * @note A reset statement with the same SQL text is taken from the statement
+   * cache of the database if there is one, the previous statement is put back
+   * into the cache
    */
   void prepare(std::string_view sql);
 
@@ -138,21 +203,57 @@ class SqlQuery {
    */
   void bind(std::int32_t index, double value);
 
+  /**
+   * @brief Bind NULL to a parameter "?" in the SQL prepared statement
+   * @param index: Serial number (starting from 1)
+   */
+  void bind_null(std::int32_t index);
+
   /**
    * @brief Bind a text value to a parameter "?" in the SQL prepared statement
    * @param index: Serial number (starting from 1)
    * @param value: The value to bind
    */
-  void bind(std::int32_t index, const std::string &value);
+  void bind(std::int32_t index, std::string_view value);
 
   /**
    * @brief Bind a blob value to a parameter "?" in the SQL prepared statement
    * @param index: Serial number (starting from 1)
    * @param value: The value to bind
    * @param size: The size of the value to be bound
-   * @note Automatically use Zstandard algorithm to compress
+   * @param compression: How to compress the blob
+   */
+  void bind(std::int32_t index, const char *value, std::size_t size,
+            BlobCompression compression = BlobCompression::None);
+
+  /**
+   * @brief Bind a text value to a parameter "?" in the SQL prepared statement
+   * without copying it
+   * @param index: Serial number (starting from 1)
+   * @param value: The value to bind, must stay valid until it is rebound or
+   * the statement is reset or finalized
+   */
+  void bind_static(std::int32_t index, std::string_view value);
+
+  /**
+   * @brief Bind a blob value to a parameter "?" in the SQL prepared statement
+   * without copying or compressing it
+   * @param index: Serial number (starting from 1)
+   * @param value: The value to bind, must stay valid until it is rebound or
+   * the statement is reset or finalized
+   * @param size: The size of the value to be bound
    */
-  void bind(std::int32_t index, const char *value, std::size_t size);
+  void bind_static(std::int32_t index, const char *value, std::size_t size);
+
+  /**
+   * @brief Bind values to the parameters "?" in the SQL prepared statement,
+   * starting from the first one
+   * @param args: Integers, floating-point numbers, strings, std::nullopt, and
+   * std::optional of them for NULL
+   * @note Text is copied
+   */
+  template <typename... Args>
+  void bind_all(const Args &...args);
 
   /**
    * @brief Execute a one-step query with no expected result and reset the
@@ -183,11 +284,266 @@ class SqlQuery {
    */
   [[nodiscard]] Column get_column(std::int32_t index);
 
+  /**
+   * @brief Iterate over the rows of the prepared query as tuples
+   * @tparam Ts: Types of the leading columns, integers, floating-point
+   * numbers, std::string, std::string_view, and std::optional of them for
+   * nullable columns
+   * @return Input range that steps the query, usable once
+   * @note A std::string_view is valid until the iterator is incremented, values
+   * are converted by SQLite as as_*() of Column does but without type checks
+   * @example for (auto [id, name] : query.rows<std::int64_t, std::string>())
+   */
+  template <typename... Ts>
+  [[nodiscard]] SqlRows<Ts...> rows();
+
  private:
+  [[nodiscard]] sqlite3_stmt *get_row_stmt(std::int32_t column_count) const;
+
   class SqlQueryImpl;
   std::experimental::propagate_const<std::unique_ptr<SqlQueryImpl>> impl_;
 };
 
+namespace detail {
+
+template <typename T>
+struct IsOptional : std::false_type {};
+
+template <typename T>
+struct IsOptional<std::optional<T>> : std::true_type {};
+
+/**
+ * @brief Bind a value by its type
+ * @tparam Static: Whether text is bound without copying
+ */
+template <bool Static, typename T>
+void bind_value(SqlQuery &query, std::int32_t index, const T &value) {
+  if constexpr (IsOptional<T>::value) {
+    if (value) {
+      bind_value<Static>(query, index, *value);
+    } else {
+      query.bind_null(index);
+    }
+  } else if constexpr (std::is_same_v<T, std::nullopt_t> ||
+                       std::is_same_v<T, std::nullptr_t>) {
+    query.bind_null(index);
+  } else if constexpr (std::is_integral_v<T>) {
+    if constexpr (sizeof(T) < sizeof(std::int32_t) ||
+                  (sizeof(T) == sizeof(std::int32_t) && std::is_signed_v<T>)) {
+      query.bind(index, static_cast<std::int32_t>(value));
+    } else {
+      query.bind(index, static_cast<std::int64_t>(value));
+    }
+  } else if constexpr (std::is_floating_point_v<T>) {
+    query.bind(index, static_cast<double>(value));
+  } else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+    if constexpr (Static) {
+      query.bind_static(index, std::string_view(value));
+    } else {
+      query.bind(index, std::string_view(value));
+    }
+  } else {
+    static_assert(sizeof(T) == 0, "Unsupported type");
+  }
+}
+
+[[nodiscard]] bool column_is_null(sqlite3_stmt *stmt, std::int32_t index);
+[[nodiscard]] std::int32_t column_int32(sqlite3_stmt *stmt,
+                                        std::int32_t index);
+[[nodiscard]] std::int64_t column_int64(sqlite3_stmt *stmt,
+                                        std::int32_t index);
+[[nodiscard]] double column_double(sqlite3_stmt *stmt, std::int32_t index);
+[[nodiscard]] std::string_view column_text(sqlite3_stmt *stmt,
+                                           std::int32_t index);
+
+/**
+ * @brief Read a column of the current row by its type
+ */
+template <typename T>
+[[nodiscard]] T column_value(sqlite3_stmt *stmt, std::int32_t index) {
+  if constexpr (IsOptional<T>::value) {
+    if (column_is_null(stmt, index)) {
+      return std::nullopt;
+    }
+    return column_value<typename T::value_type>(stmt, index);
+  } else if constexpr (std::is_same_v<T, bool>) {
+    return column_int32(stmt, index) != 0;
+  } else if constexpr (std::is_integral_v<T>) {
+    if constexpr (sizeof(T) < sizeof(std::int32_t) ||
+                  (sizeof(T) == sizeof(std::int32_t) && std::is_signed_v<T>)) {
+      return static_cast<T>(column_int32(stmt, index));
+    } else {
+      return static_cast<T>(column_int64(stmt, index));
+    }
+  } else if constexpr (std::is_floating_point_v<T>) {
+    return static_cast<T>(column_double(stmt, index));
+  } else if constexpr (std::is_same_v<T, std::string_view>) {
+    return column_text(stmt, index);
+  } else if constexpr (std::is_same_v<T, std::string>) {
+    return std::string(column_text(stmt, index));
+  } else {
+    static_assert(sizeof(T) == 0, "Unsupported type");
+  }
+}
+
+/**
+ * @brief The type a parameter is stored as until a deferred statement runs,
+ * text views and pointers are copied into std::string
+ */
+template <typename T>
+struct OwnedParam {
+  using type =
+      std::conditional_t<!std::is_same_v<T, std::nullptr_t> &&
+                             !std::is_same_v<T, std::string> &&
+                             std::is_convertible_v<const T &, std::string_view>,
+                         std::string, T>;
+};
+
+template <typename T>
+struct OwnedParam<std::optional<T>> {
+  using type = std::optional<typename OwnedParam<T>::type>;
+};
+
+template <typename T>
+using OwnedParamT = typename OwnedParam<T>::type;
+
+std::string insert_sql(std::string_view table_name,
+                       const std::vector<std::string> &columns,
+                       std::size_t column_count, std::size_t row_count);
+
+}  // namespace detail
+
+/**
+ * @brief Input range of the rows of a query as tuples
+ * @see SqlQuery::rows()
+ */
+template <typename... Ts>
+class SqlRows {
+  static_assert(sizeof...(Ts) > 0, "At least one column is required");
+
+ public:
+  /**
+   * @brief Iterator that steps the query
+   */
+  class Iterator {
+   public:
+    using value_type = std::tuple<Ts...>;
+    using difference_type = std::ptrdiff_t;
+
+    Iterator() = default;
+
+    Iterator(SqlQuery *query, sqlite3_stmt *stmt)
+        : query_(query), stmt_(stmt) {
+      advance();
+    }
+
+    [[nodiscard]] const value_type &operator*() const { return row_; }
+
+    Iterator &operator++() {
+      advance();
+      return *this;
+    }
+
+    void operator++(int) { advance(); }
+
+    [[nodiscard]] bool operator==(std::default_sentinel_t) const {
+      return query_ == nullptr;
+    }
+
+   private:
+    void advance() {
+      if (query_->next()) {
+        row_ = read_row(std::index_sequence_for<Ts...>{});
+      } else {
+        query_ = nullptr;
+      }
+    }
+
+    template <std::size_t... Is>
+    [[nodiscard]] value_type read_row(std::index_sequence<Is...>) const {
+      return value_type(
+          detail::column_value<Ts>(stmt_, static_cast<std::int32_t>(Is))...);
+    }
+
+    SqlQuery *query_ = nullptr;
+    sqlite3_stmt *stmt_ = nullptr;
+    value_type row_;
+  };
+
+  /**
+   * @brief Constructor
+   * @param query: A prepared query with at least sizeof...(Ts) columns
+   */
+  explicit SqlRows(SqlQuery &query)
+      : query_(&query),
+        stmt_(query.get_row_stmt(static_cast<std::int32_t>(sizeof...(Ts)))) {}
+
+  /**
+   * @brief Step the query to the first row
+   * @return Iterator of the first row
+   */
+  [[nodiscard]] Iterator begin() const { return Iterator(query_, stmt_); }
+
+  /**
+   * @brief Get the sentinel reached after the last row
+   * @return Sentinel
+   */
+  [[nodiscard]] std::default_sentinel_t end() const { return {}; }
+
+ private:
+  SqlQuery *query_ = nullptr;
+  sqlite3_stmt *stmt_ = nullptr;
+};
+
+template <typename... Args>
+void SqlQuery::bind_all(const Args &...args) {
+  [[maybe_unused]] std::int32_t index = 1;
+  (detail::bind_value<false>(*this, index++, args), ...);
+}
+
+template <typename... Ts>
+SqlRows<Ts...> SqlQuery::rows() {
+  return SqlRows<Ts...>(*this);
+}
+
+/**
+ * @brief HMAC algorithm of SQLCipher, used to authenticate pages
+ */
+enum class CipherHmac { Sha1, Sha256, Sha512 };
+
+/**
+ * @brief Encryption settings of SQLCipher
+ * @note A database must be opened with the settings it was created with. By
+ * default, the key is derived from the password with PBKDF2 on every open,
+ * which takes hundreds of milliseconds
+ * @see https://www.zetetic.net/sqlcipher/sqlcipher-api/
+ */
+struct CipherOptions {
+  /**
+   * @brief Whether the password is a raw 32-byte key, or a 48-byte key
+   * followed by the salt, used without key derivation so that opening takes
+   * microseconds
+   * @note Derive it once, for example with password_hash_raw(), and keep it
+   * secret like the password
+   */
+  bool raw_key = false;
+
+  /**
+   * @brief The number of PBKDF2 iterations, ignored for a raw key
+   */
+  std::optional<std::int32_t> kdf_iter;
+
+  /**
+   * @brief Page size, a power of two between 512 and 65536
+   */
+  std::optional<std::int32_t> cipher_page_size;
+
+  /**
+   * @brief HMAC algorithm
+   */
+  std::optional<CipherHmac> hmac_algorithm;
+};
+
 class SqlDatabase {
   friend SqlQuery::SqlQueryImpl;
 
@@ -203,10 +559,18 @@ class SqlDatabase {
    * @brief Open the database
    * @param db_name: Database name
    * @param open_mode: Database open mode
-   * @param password: Database password
+   * @param password: Database password, must not be empty
+   * @param options: Encryption settings
    */
   SqlDatabase(const std::string &db_name, OpenMode open_mode,
-              const std::string &password);
+              const std::string &password, const CipherOptions &options = {});
+
+  /**
+   * @brief Open an unencrypted database
+   * @param db_name: Database name
+   * @param open_mode: Database open mode
+   */
+  SqlDatabase(const std::string &db_name, OpenMode open_mode);
 
   SqlDatabase(const SqlDatabase &) = delete;
   SqlDatabase(SqlDatabase &&) = delete;
@@ -233,12 +597,49 @@ class SqlDatabase {
    */
   void rollback();
 
+  /**
+   * @brief Whether a transaction is active
+   * @return False outside a transaction, or after SQLite has rolled it back by
+   * itself(e.g. on SQLITE_FULL or SQLITE_IOERR)
+   */
+  [[nodiscard]] bool in_transaction() const;
+
   /**
    * @brief Rebuild the database file, repacking it into a minimal amount of
    * disk space
    */
   void vacuum();
 
+  /**
+   * @brief Copy the database to another file while it is in use
+   * @param dest_name: Destination database name, overwritten
+   * @param pages_per_step: The number of pages copied in one step, -1 to copy
+   * all of them in one step
+   * @param interval: How long to wait between steps, during which other
+   * connections can read and write the database
+   * @param callback: Called after each step, return false to abort the backup
+   * with RuntimeError
+   * @note The destination is keyed like this database. Writes through this
+   * connection are applied to the backup, a write through another connection
+   * restarts it
+   * @see https://www.sqlite.org/backup.html
+   */
+  void backup(const std::string &dest_name, std::int32_t pages_per_step = 256,
+              std::chrono::milliseconds interval = std::chrono::milliseconds(0),
+              const BackupCallback &callback = {});
+
+  /**
+   * @brief Write a compacted snapshot of the database with VACUUM INTO
+   * @param dest_name: Destination file name, must not exist
+   * @param compress: Whether to compress the snapshot with compress_data()
+   * @note Compression only pays off for an unencrypted database, read a
+   * compressed snapshot back with decompress_data()
+   * @note A compressed snapshot is first written to a temporary file next to
+   * dest_name, then read and compressed in memory, so the snapshot and its
+   * compressed copy must both fit in memory
+   */
+  void vacuum_into(const std::string &dest_name, bool compress = false);
+
   /**
    * @brief Determine whether the table exists
    * @param table_name: Table name
@@ -274,9 +675,514 @@ class SqlDatabase {
    */
   std::int32_t exec(std::string_view sql);
 
+  /**
+   * @brief Set the maximum number of prepared statements kept for reuse by
+   * SqlQuery::prepare(), the least recently used ones are finalized first
+   * @param size: Number of statements, 0 to disable the cache, the default is
+   * 32
+   */
+  void set_statement_cache_size(std::size_t size);
+
+  /**
+   * @brief Train a Zstandard dictionary from sample blobs and store it in the
+   * database
+   * @param samples: Typical uncompressed blobs, ideally thousands of them
+   * @param max_size: Maximum size of the dictionary
+   * @return Dictionary ID
+   * @note Used by BlobCompression::ZstdDictionary from now on. Dictionaries
+   * are kept in the klib_zstd_dictionary table, so blobs compressed with older
+   * ones remain readable
+   */
+  std::uint32_t train_dictionary(const std::vector<std::string> &samples,
+                                 std::size_t max_size = 112640);
+
  private:
   class SqlDatabaseImpl;
   std::experimental::propagate_const<std::unique_ptr<SqlDatabaseImpl>> impl_;
 };
 
+/**
+ * @brief Connections to the same database file in WAL mode, one for writing
+ * and several for reading, leased to threads
+ * @note A connection must be used by one thread at a time, which a lease
+ * guarantees. Readers see the last committed data and are not blocked by the
+ * writer. Leases must not outlive the pool. Loading through the writer with
+ * LoaderPragmaGuard must keep the journal mode
+ * @see https://www.sqlite.org/wal.html
+ */
+class SqlDatabasePool {
+ public:
+  /**
+   * @brief Exclusive use of a connection, returned to the pool when destroyed
+   */
+  class Lease {
+    friend class SqlDatabasePool;
+
+   public:
+    Lease(const Lease &) = delete;
+    Lease &operator=(const Lease &) = delete;
+
+    /**
+     * @brief Move constructor
+     * @param other: Lease to be moved, no longer holds a connection
+     */
+    Lease(Lease &&other) noexcept;
+
+    /**
+     * @brief Move assignment, the current connection is returned first
+     * @param other: Lease to be moved, no longer holds a connection
+     * @return This lease
+     */
+    Lease &operator=(Lease &&other) noexcept;
+
+    /**
+     * @brief Return the connection to the pool
+     */
+    ~Lease();
+
+    /**
+     * @brief Get the leased connection
+     * @return Database instance
+     */
+    [[nodiscard]] SqlDatabase &operator*() const { return *db_; }
+
+    /**
+     * @brief Get the leased connection
+     * @return Database instance
+     */
+    [[nodiscard]] SqlDatabase *operator->() const { return db_; }
+
+   private:
+    Lease(SqlDatabasePool *pool, SqlDatabase *db, bool writer)
+        : pool_(pool), db_(db), writer_(writer) {}
+
+    void release() noexcept;
+
+    SqlDatabasePool *pool_ = nullptr;
+    SqlDatabase *db_ = nullptr;
+    bool writer_ = false;
+  };
+
+  /**
+   * @brief Open the connections and enable WAL mode
+   * @param db_name: Database name, created if it does not exist
+   * @param password: Database password, used to key every connection
+   * @param reader_count: The number of read-only connections
+   * @param busy_timeout: How long a connection waits for a lock held by
+   * another process before failing
+   * @param options: Encryption settings, a raw key saves the key derivation
+   * of every connection
+   */
+  SqlDatabasePool(
+      const std::string &db_name, const std::string &password,
+      std::size_t reader_count = 4,
+      std::chrono::milliseconds busy_timeout = std::chrono::seconds(5),
+      const CipherOptions &options = {});
+
+  SqlDatabasePool(const SqlDatabasePool &) = delete;
+  SqlDatabasePool(SqlDatabasePool &&) = delete;
+  SqlDatabasePool &operator=(const SqlDatabasePool &) = delete;
+  SqlDatabasePool &operator=(SqlDatabasePool &&) = delete;
+
+  /**
+   * @brief Destructor
+   */
+  ~SqlDatabasePool();
+
+  /**
+   * @brief Lease a read-only connection, wait until one is available
+   * @return Lease of the connection
+   * @note Writes through it throw RuntimeError
+   */
+  [[nodiscard]] Lease reader();
+
+  /**
+   * @brief Lease the only writable connection, wait until it is available
+   * @return Lease of the connection
+   */
+  [[nodiscard]] Lease writer();
+
+  /**
+   * @brief Get the number of read-only connections
+   * @return The number of read-only connections
+   */
+  [[nodiscard]] std::size_t reader_count() const;
+
+ private:
+  void release(SqlDatabase *db, bool writer) noexcept;
+
+  class SqlDatabasePoolImpl;
+  std::experimental::propagate_const<std::unique_ptr<SqlDatabasePoolImpl>>
+      impl_;
+};
+
+/**
+ * @brief Database whose connection is owned by a worker thread, queries are
+ * queued and their results are returned as futures
+ * @note Tasks run in the order they are submitted. Consecutive writes
+ * submitted with exec() are grouped into one transaction, each in its own
+ * savepoint, so a failed write does not affect the others, and their futures
+ * are ready once the transaction is committed. Queued tasks are finished
+ * before the destructor returns
+ */
+class AsyncSqlDatabase {
+ public:
+  /**
+   * @brief Open the database and start the worker thread
+   * @param db_name: Database name, created if it does not exist
+   * @param password: Database password
+   * @param options: Encryption settings
+   * @param max_batch_size: The maximum number of writes in one transaction
+   */
+  AsyncSqlDatabase(const std::string &db_name, const std::string &password,
+                   const CipherOptions &options = {},
+                   std::size_t max_batch_size = 1024);
+
+  AsyncSqlDatabase(const AsyncSqlDatabase &) = delete;
+  AsyncSqlDatabase(AsyncSqlDatabase &&) = delete;
+  AsyncSqlDatabase &operator=(const AsyncSqlDatabase &) = delete;
+  AsyncSqlDatabase &operator=(AsyncSqlDatabase &&) = delete;
+
+  /**
+   * @brief Finish the queued tasks and stop the worker thread
+   */
+  ~AsyncSqlDatabase();
+
+  /**
+   * @brief Run a function with the connection on the worker thread
+   * @param func: Called with SqlDatabase &, must not keep the reference
+   * @return Future of its result or exception
+   */
+  template <typename F>
+  [[nodiscard]] auto run(F &&func)
+      -> std::future<std::invoke_result_t<std::decay_t<F> &, SqlDatabase &>> {
+    using Result = std::invoke_result_t<std::decay_t<F> &, SqlDatabase &>;
+
+    auto task = std::make_shared<std::packaged_task<Result(SqlDatabase &)>>(
+        std::forward<F>(func));
+    auto future = task->get_future();
+    post([task](SqlDatabase &db) { (*task)(db); });
+    return future;
+  }
+
+  /**
+   * @brief Execute a write statement, batched with other writes
+   * @param sql: SQL statement
+   * @param args: Parameters, see SqlQuery::bind_all(), stored until the
+   * statement is executed, text such as std::string_view or const char * is
+   * copied into std::string
+   * @return Future of the number of rows modified, inserted or deleted
+   */
+  template <typename... Args>
+  [[nodiscard]] std::future<std::int32_t> exec(std::string sql, Args... args) {
+    return post_write(
+        [sql = std::move(sql),
+         ... args = detail::OwnedParamT<Args>(std::move(args))](
+            SqlDatabase &db) {
+          SqlQuery query(db);
+          query.prepare(sql);
+          query.bind_all(args...);
+          return query.exec();
+        });
+  }
+
+  /**
+   * @brief Execute a query and collect all rows
+   * @tparam Ts: Column types, see SqlQuery::rows(), std::string_view is not
+   * allowed because the rows outlive the statement
+   * @param sql: SQL statement
+   * @param args: Parameters, see SqlQuery::bind_all(), stored until the
+   * statement is executed, text such as std::string_view or const char * is
+   * copied into std::string
+   * @return Future of the rows
+   */
+  template <typename... Ts, typename... Args>
+  [[nodiscard]] std::future<std::vector<std::tuple<Ts...>>> query(
+      std::string sql, Args... args) {
+    static_assert((!std::is_same_v<Ts, std::string_view> && ...),
+                  "Use std::string instead of std::string_view");
+
+    return run(
+        [sql = std::move(sql),
+         ... args = detail::OwnedParamT<Args>(std::move(args))](
+            SqlDatabase &db) {
+          SqlQuery query(db);
+          query.prepare(sql);
+          query.bind_all(args...);
+
+          std::vector<std::tuple<Ts...>> rows;
+          for (auto &&row : query.rows<Ts...>()) {
+            rows.push_back(row);
+          }
+          return rows;
+        });
+  }
+
+ private:
+  void post(std::function<void(SqlDatabase &)> task);
+  [[nodiscard]] std::future<std::int32_t> post_write(
+      std::function<std::int32_t(SqlDatabase &)> write);
+
+  class AsyncSqlDatabaseImpl;
+  std::experimental::propagate_const<std::unique_ptr<AsyncSqlDatabaseImpl>>
+      impl_;
+};
+
+/**
+ * @brief Set pragmas that speed up bulk loading, restore the previous values
+ * when destroyed
+ * @note synchronous is set to OFF, a crash during the load may corrupt the
+ * database. Must be created and destroyed outside of a transaction
+ */
+class LoaderPragmaGuard {
+ public:
+  /**
+   * @brief Save the current pragmas and set the loader pragmas
+   * @param db: Database instance
+   * @param journal_mode: Journal mode during the load, empty to keep the
+   * current one
+   * @param cache_size: Page cache size during the load, negative values are
+   * in KiB
+   */
+  explicit LoaderPragmaGuard(SqlDatabase &db,
+                             std::string_view journal_mode = "MEMORY",
+                             std::int64_t cache_size = -262144);
+
+  LoaderPragmaGuard(const LoaderPragmaGuard &) = delete;
+  LoaderPragmaGuard(LoaderPragmaGuard &&) = delete;
+  LoaderPragmaGuard &operator=(const LoaderPragmaGuard &) = delete;
+  LoaderPragmaGuard &operator=(LoaderPragmaGuard &&) = delete;
+
+  /**
+   * @brief Restore the saved pragmas
+   */
+  ~LoaderPragmaGuard();
+
+ private:
+  SqlDatabase &db_;
+  std::int64_t synchronous_ = 0;
+  std::string journal_mode_;
+  std::int64_t cache_size_ = 0;
+};
+
+/**
+ * @brief Options of BulkInserter
+ */
+struct BulkInsertOptions {
+  /**
+   * @brief The number of rows committed in one transaction, rounded up to a
+   * multiple of rows_per_statement, 0 to commit only in BulkInserter::finish()
+   */
+  std::size_t rows_per_transaction = 10000;
+
+  /**
+   * @brief The number of rows in one multi-row INSERT statement, 0 to choose
+   * from the number of columns, up to 128 rows and 999 parameters
+   */
+  std::size_t rows_per_statement = 0;
+
+  /**
+   * @brief Whether to hold a LoaderPragmaGuard during the load
+   */
+  bool loader_pragmas = true;
+
+  /**
+   * @brief Journal mode during the load, see LoaderPragmaGuard
+   */
+  std::string journal_mode = "MEMORY";
+
+  /**
+   * @brief Page cache size during the load, see LoaderPragmaGuard
+   */
+  std::int64_t cache_size = -262144;
+};
+
+/**
+ * @brief Insert rows into a table with multi-row INSERT statements in batched
+ * transactions
+ * @tparam Ts: Column types, integers, floating-point numbers, strings, and
+ * std::optional of them for nullable columns
+ * @note Rows are buffered until a statement is full. Call finish() to write
+ * the remaining rows and see errors, the destructor does the same but ignores
+ * errors, and rolls back the current transaction if an exception is being
+ * thrown. Committed transactions are never rolled back
+ */
+template <typename... Ts>
+class BulkInserter {
+  static_assert(sizeof...(Ts) > 0, "At least one column is required");
+
+ public:
+  /**
+   * @brief Prepare the statements and apply the loader pragmas
+   * @param db: Database instance
+   * @param table_name: Table name
+   * @param columns: Column names, one for each type
+   * @param options: Batching options
+   */
+  BulkInserter(SqlDatabase &db, std::string_view table_name,
+               const std::vector<std::string> &columns,
+               const BulkInsertOptions &options = {})
+      : db_(db),
+        rows_per_transaction_(options.rows_per_transaction),
+        rows_per_statement_(options.rows_per_statement),
+        statement_(db),
+        single_statement_(db) {
+    if (rows_per_statement_ == 0) {
+      rows_per_statement_ =
+          std::clamp<std::size_t>(999 / sizeof...(Ts), 1, 128);
+    }
+    if (options.loader_pragmas) {
+      guard_.emplace(db, options.journal_mode, options.cache_size);
+    }
+
+    statement_.prepare(detail::insert_sql(table_name, columns, sizeof...(Ts),
+                                          rows_per_statement_));
+    single_statement_.prepare(
+        detail::insert_sql(table_name, columns, sizeof...(Ts), 1));
+    rows_.reserve(rows_per_statement_);
+  }
+
+  BulkInserter(const BulkInserter &) = delete;
+  BulkInserter(BulkInserter &&) = delete;
+  BulkInserter &operator=(const BulkInserter &) = delete;
+  BulkInserter &operator=(BulkInserter &&) = delete;
+
+  /**
+   * @brief Finish the load, or roll back the current transaction during stack
+   * unwinding
+   */
+  ~BulkInserter() {
+    try {
+      if (std::uncaught_exceptions() > uncaught_exceptions_) {
+        rollback();
+      } else {
+        finish();
+      }
+    } catch (...) {
+    }
+  }
+
+  /**
+   * @brief Insert a row
+   * @param row: Column values
+   */
+  void insert(std::tuple<Ts...> row) {
+    rows_.push_back(std::move(row));
+    if (std::size(rows_) == rows_per_statement_) {
+      write_rows();
+    }
+  }
+
+  /**
+   * @brief Insert a row constructed in place
+   * @param args: Column values
+   */
+  template <typename... Args>
+  void emplace(Args &&...args) {
+    rows_.emplace_back(std::forward<Args>(args)...);
+    if (std::size(rows_) == rows_per_statement_) {
+      write_rows();
+    }
+  }
+
+  /**
+   * @brief Write the buffered rows, commit the current transaction and restore
+   * the pragmas
+   * @note Further inserts begin a new transaction without the loader pragmas
+   */
+  void finish() {
+    if (!std::empty(rows_)) {
+      write_rows();
+    }
+    commit();
+    guard_.reset();
+  }
+
+  /**
+   * @brief Get the number of rows written to the database
+   * @return The number of rows, including uncommitted ones
+   */
+  [[nodiscard]] std::size_t row_count() const { return row_count_; }
+
+ private:
+  void write_rows() {
+    if (!in_transaction_) {
+      db_.transaction();
+      in_transaction_ = true;
+    }
+
+    try {
+      if (std::size(rows_) == rows_per_statement_) {
+        std::int32_t index = 1;
+        for (const auto &row : rows_) {
+          index = bind_row(statement_, index, row);
+        }
+        statement_.exec();
+      } else {
+        for (const auto &row : rows_) {
+          bind_row(single_statement_, 1, row);
+          single_statement_.exec();
+        }
+      }
+    } catch (...) {
+      // Leave the connection outside of a transaction so that the inserter
+      // and the pragma guard can be destroyed cleanly
+      rows_.clear();
+      try {
+        rollback();
+      } catch (...) {
+      }
+      throw;
+    }
+
+    row_count_ += std::size(rows_);
+    uncommitted_ += std::size(rows_);
+    rows_.clear();
+
+    if (rows_per_transaction_ != 0 && uncommitted_ >= rows_per_transaction_) {
+      commit();
+    }
+  }
+
+  static std::int32_t bind_row(SqlQuery &query, std::int32_t index,
+                               const std::tuple<Ts...> &row) {
+    std::apply(
+        [&](const auto &...values) {
+          (detail::bind_value<true>(query, index++, values), ...);
+        },
+        row);
+    return index;
+  }
+
+  void commit() {
+    if (in_transaction_) {
+      db_.commit();
+      in_transaction_ = false;
+      uncommitted_ = 0;
+    }
+  }
+
+  void rollback() {
+    if (in_transaction_) {
+      in_transaction_ = false;
+      row_count_ -= uncommitted_;
+      uncommitted_ = 0;
+      db_.rollback();
+    }
+  }
+
+  SqlDatabase &db_;
+  std::size_t rows_per_transaction_;
+  std::size_t rows_per_statement_;
+  std::optional<LoaderPragmaGuard> guard_;
+  SqlQuery statement_;
+  SqlQuery single_statement_;
+
+  std::vector<std::tuple<Ts...>> rows_;
+  std::size_t row_count_ = 0;
+  std::size_t uncommitted_ = 0;
+  bool in_transaction_ = false;
+  std::int32_t uncaught_exceptions_ = std::uncaught_exceptions();
+};
+
 }  // namespace klib
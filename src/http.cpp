@@ -5,13 +5,49 @@
 
 #include "klib/http.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
 #include <cstddef>
+#include <cstring>
+#include <exception>
 #include <filesystem>
-
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <brotli/encode.h>
 #include <curl/curl.h>
+#include <fmt/format.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/sha.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <zlib.h>
+#include <zstd.h>
 #include <scope_guard.hpp>
 
+#include "klib/archive.h"
 #include "klib/exception.h"
+#include "klib/log.h"
 #include "klib/url.h"
 #include "klib/util.h"
 
@@ -25,18 +61,419 @@ extern int cacert_size;
     }                                             \
   } while (0)
 
+#define CHECK_CURL_SHARE(rc)                         \
+  do {                                               \
+    if (rc != CURLSHcode::CURLSHE_OK) [[unlikely]] { \
+      throw RuntimeError(curl_share_strerror(rc));   \
+    }                                                \
+  } while (0)
+
+#define CHECK_CURL_MULTI(rc)                       \
+  do {                                             \
+    if (rc != CURLMcode::CURLM_OK) [[unlikely]] {  \
+      throw RuntimeError(curl_multi_strerror(rc)); \
+    }                                              \
+  } while (0)
+
 namespace klib {
 
 namespace {
 
+struct BandwidthMeter {
+  RateLimiter *limiter = nullptr;
+  curl_off_t transferred = 0;
+};
+
+// Exceptions must not propagate through libcurl
+struct WriteContext {
+  const WriteCallback *callback = nullptr;
+  std::exception_ptr exception;
+};
+
+struct ReadContext {
+  const ReadCallback *callback = nullptr;
+  std::exception_ptr exception;
+};
+
+struct Segment {
+  CURL *curl = nullptr;
+  std::int32_t fd = -1;
+  std::int64_t offset = 0;
+  std::int64_t end = 0;
+  BandwidthMeter meter;
+};
+
 std::size_t callback_func_std_string(void *contents, std::size_t size,
                                      std::size_t nmemb, std::string *s) {
   s->append(static_cast<const char *>(contents), size * nmemb);
   return size * nmemb;
 }
 
+std::size_t callback_func_write_callback(void *contents, std::size_t size,
+                                         std::size_t nmemb,
+                                         WriteContext *context) {
+  auto length = size * nmemb;
+  try {
+    if (!(*context->callback)(
+            std::string_view(static_cast<const char *>(contents), length)))
+        [[unlikely]] {
+      return 0;
+    }
+  } catch (...) {
+    context->exception = std::current_exception();
+    return 0;
+  }
+
+  return length;
+}
+
+std::size_t callback_func_segment(void *contents, std::size_t size,
+                                  std::size_t nmemb, Segment *segment) {
+  auto length = size * nmemb;
+  if (segment->offset + static_cast<std::int64_t>(length) > segment->end + 1)
+      [[unlikely]] {
+    return 0;
+  }
+
+  auto data = static_cast<const char *>(contents);
+  auto rest = length;
+  while (rest > 0) {
+    auto written = pwrite(segment->fd, data, rest, segment->offset);
+    if (written == -1) [[unlikely]] {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 0;
+    }
+
+    data += written;
+    rest -= written;
+    segment->offset += written;
+  }
+
+  return length;
+}
+
+std::int32_t callback_func_xferinfo(BandwidthMeter *meter, curl_off_t,
+                                   curl_off_t dlnow, curl_off_t,
+                                   curl_off_t ulnow) {
+  auto transferred = dlnow + ulnow;
+  // The counters start over when a redirect is followed
+  if (transferred < meter->transferred) {
+    meter->transferred = 0;
+  }
+  if (transferred > meter->transferred) {
+    meter->limiter->throttle(transferred - meter->transferred);
+    meter->transferred = transferred;
+  }
+  return 0;
+}
+
+std::size_t callback_func_header(
+    char *buffer, std::size_t size, std::size_t nitems,
+    phmap::flat_hash_map<std::string, std::string> *headers) {
+  auto length = size * nitems;
+  std::string_view line(buffer, length);
+
+  // A new status line after redirection or 100 Continue
+  if (line.starts_with("HTTP/")) {
+    headers->clear();
+    return length;
+  }
+
+  auto index = line.find(':');
+  if (index == std::string_view::npos) {
+    return length;
+  }
+
+  std::string name(line.substr(0, index));
+  std::transform(std::begin(name), std::end(name), std::begin(name),
+                 [](unsigned char c) { return std::tolower(c); });
+
+  auto value = line.substr(index + 1);
+  auto is_space = [](char c) {
+    return std::isspace(static_cast<unsigned char>(c));
+  };
+  while (!std::empty(value) && is_space(value.front())) {
+    value.remove_prefix(1);
+  }
+  while (!std::empty(value) && is_space(value.back())) {
+    value.remove_suffix(1);
+  }
+
+  if (auto [iter, inserted] = headers->try_emplace(name, value); !inserted) {
+    iter->second.append(", ").append(value);
+  }
+
+  return length;
+}
+
+std::size_t callback_func_read(char *buffer, std::size_t size,
+                               std::size_t nitems, ReadContext *context) {
+  try {
+    return (*context->callback)(buffer, size * nitems);
+  } catch (...) {
+    context->exception = std::current_exception();
+    return CURL_READFUNC_ABORT;
+  }
+}
+
+std::string gzip_compress(std::string_view data) {
+  if (std::size(data) > std::numeric_limits<uInt>::max()) [[unlikely]] {
+    throw InvalidArgument("Content too large");
+  }
+
+  z_stream stream = {};
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16,
+                   8, Z_DEFAULT_STRATEGY) != Z_OK) [[unlikely]] {
+    throw RuntimeError("deflateInit2() failed");
+  }
+  SCOPE_EXIT { deflateEnd(&stream); };
+
+  std::string result;
+  result.resize(deflateBound(&stream, std::size(data)));
+
+  stream.next_in =
+      reinterpret_cast<Bytef *>(const_cast<char *>(std::data(data)));
+  stream.avail_in = std::size(data);
+  stream.next_out = reinterpret_cast<Bytef *>(std::data(result));
+  stream.avail_out = std::size(result);
+
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END) [[unlikely]] {
+    throw RuntimeError("deflate() failed");
+  }
+  result.resize(stream.total_out);
+
+  return result;
+}
+
+std::string brotli_compress(std::string_view data) {
+  std::string result;
+  auto length = BrotliEncoderMaxCompressedSize(std::size(data));
+  result.resize(length);
+
+  if (!BrotliEncoderCompress(
+          5, BROTLI_DEFAULT_WINDOW, BROTLI_DEFAULT_MODE, std::size(data),
+          reinterpret_cast<const std::uint8_t *>(std::data(data)), &length,
+          reinterpret_cast<std::uint8_t *>(std::data(result)))) [[unlikely]] {
+    throw RuntimeError("BrotliEncoderCompress() failed");
+  }
+  result.resize(length);
+
+  return result;
+}
+
+std::string compress_content(std::string_view data, ContentEncoding encoding) {
+  switch (encoding) {
+    case ContentEncoding::Gzip:
+      return gzip_compress(data);
+    case ContentEncoding::Zstd:
+      return compress_data(std::data(data), std::size(data),
+                           ZSTD_CLEVEL_DEFAULT);
+    case ContentEncoding::Brotli:
+      return brotli_compress(data);
+    default:
+      return std::string(data);
+  }
+}
+
+std::string content_encoding_str(ContentEncoding encoding) {
+  switch (encoding) {
+    case ContentEncoding::Gzip:
+      return "gzip";
+    case ContentEncoding::Zstd:
+      return "zstd";
+    case ContentEncoding::Brotli:
+      return "br";
+    default:
+      return "identity";
+  }
+}
+
+bool write_to_fd(std::int32_t fd, std::string_view data) {
+  while (!std::empty(data)) {
+    auto length = write(fd, std::data(data), std::size(data));
+    if (length == -1) [[unlikely]] {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data.remove_prefix(length);
+  }
+
+  return true;
+}
+
+// Reads the file block by block, which may be far larger than memory
+std::string sha256_file_hex(const std::string &path) {
+  auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) [[unlikely]] {
+    throw RuntimeError("Can not open file: '{}'", path);
+  }
+  SCOPE_EXIT { close(fd); };
+
+  SHA256_CTX context;
+  SHA256_Init(&context);
+
+  std::vector<std::uint8_t> buffer(1024 * 1024);
+  while (true) {
+    auto length = read(fd, std::data(buffer), std::size(buffer));
+    if (length == -1) [[unlikely]] {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw RuntimeError("read() failed: {}", std::strerror(errno));
+    }
+    if (length == 0) {
+      break;
+    }
+    SHA256_Update(&context, std::data(buffer), length);
+  }
+
+  std::string digest;
+  digest.resize(SHA256_DIGEST_LENGTH);
+  SHA256_Final(reinterpret_cast<std::uint8_t *>(std::data(digest)), &context);
+
+  return bytes_to_hex_string(digest);
+}
+
+X509_STORE *load_ca_store() {
+  auto bio = BIO_new_mem_buf(cacert, cacert_size);
+  if (!bio) [[unlikely]] {
+    throw RuntimeError("BIO_new_mem_buf() failed");
+  }
+  SCOPE_EXIT { BIO_free(bio); };
+
+  auto store = X509_STORE_new();
+  if (!store) [[unlikely]] {
+    throw RuntimeError("X509_STORE_new() failed");
+  }
+
+  while (auto cert = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr)) {
+    X509_STORE_add_cert(store, cert);
+    X509_free(cert);
+  }
+  // The last read always fails with PEM_R_NO_START_LINE
+  ERR_clear_error();
+
+  return store;
+}
+
+// The embedded CA bundle is parsed only once, every SSL_CTX shares the store
+X509_STORE *ca_store() {
+  static std::unique_ptr<X509_STORE, decltype(X509_STORE_free) *> store(
+      load_ca_store(), X509_STORE_free);
+  return store.get();
+}
+
+CURLcode callback_func_ssl_ctx(CURL *, void *ssl_ctx, void *) {
+  X509_STORE *store;
+  try {
+    store = ca_store();
+  } catch (...) {
+    return CURLE_SSL_CACERT_BADFILE;
+  }
+
+  X509_STORE_up_ref(store);
+  SSL_CTX_set_cert_store(static_cast<SSL_CTX *>(ssl_ctx), store);
+
+  return CURLE_OK;
+}
+
+class ShareCache {
+ public:
+  ShareCache(const ShareCache &) = delete;
+  ShareCache(ShareCache &&) = delete;
+  ShareCache &operator=(const ShareCache &) = delete;
+  ShareCache &operator=(ShareCache &&) = delete;
+
+  static ShareCache &get() {
+    static ShareCache share_cache;
+    return share_cache;
+  }
+
+  [[nodiscard]] CURLSH *handle() { return share_; }
+
+  void record(CURL *curl);
+
+  [[nodiscard]] ShareStatistics statistics() const;
+
+ private:
+  ShareCache();
+  ~ShareCache();
+
+  static void lock(CURL *, curl_lock_data data, curl_lock_access,
+                   void *user_ptr);
+  static void unlock(CURL *, curl_lock_data data, void *user_ptr);
+
+  CURLSH *share_;
+  std::array<std::mutex, CURL_LOCK_DATA_LAST> mutexes_;
+
+  std::atomic<std::uint64_t> transfers_ = 0;
+  std::atomic<std::uint64_t> connects_ = 0;
+  std::atomic<std::uint64_t> tls_handshakes_ = 0;
+};
+
+ShareCache::ShareCache() {
+  share_ = curl_share_init();
+  if (!share_) [[unlikely]] {
+    throw RuntimeError("curl_share_init() failed");
+  }
+  SCOPE_FAIL { curl_share_cleanup(share_); };
+
+  auto rc = curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, ShareCache::lock);
+  CHECK_CURL_SHARE(rc);
+
+  rc = curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, ShareCache::unlock);
+  CHECK_CURL_SHARE(rc);
+
+  rc = curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+  CHECK_CURL_SHARE(rc);
+
+  for (auto data : {CURL_LOCK_DATA_DNS, CURL_LOCK_DATA_SSL_SESSION,
+                    CURL_LOCK_DATA_CONNECT, CURL_LOCK_DATA_COOKIE}) {
+    rc = curl_share_setopt(share_, CURLSHOPT_SHARE, data);
+    CHECK_CURL_SHARE(rc);
+  }
+}
+
+ShareCache::~ShareCache() { curl_share_cleanup(share_); }
+
+void ShareCache::record(CURL *curl) {
+  long connects = 0;
+  auto rc = curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+  CHECK_CURL(rc);
+
+  curl_off_t app_connect_time = 0;
+  rc = curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &app_connect_time);
+  CHECK_CURL(rc);
+
+  transfers_.fetch_add(1, std::memory_order_relaxed);
+  connects_.fetch_add(connects, std::memory_order_relaxed);
+  // Zero means the connection was reused or TLS was not used
+  if (app_connect_time > 0) {
+    tls_handshakes_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+ShareStatistics ShareCache::statistics() const {
+  return {transfers_.load(std::memory_order_relaxed),
+          connects_.load(std::memory_order_relaxed),
+          tls_handshakes_.load(std::memory_order_relaxed)};
+}
+
+void ShareCache::lock(CURL *, curl_lock_data data, curl_lock_access,
+                      void *user_ptr) {
+  static_cast<ShareCache *>(user_ptr)->mutexes_[data].lock();
+}
+
+void ShareCache::unlock(CURL *, curl_lock_data data, void *user_ptr) {
+  static_cast<ShareCache *>(user_ptr)->mutexes_[data].unlock();
+}
+
 HttpStatus get_status(CURL *curl) {
-  std::int32_t status_code;
+  long status_code;
 
   auto rc = curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status_code);
   CHECK_CURL(rc);
@@ -107,8 +544,630 @@ curl_mime *add_form(
   return form;
 }
 
+RetryPolicy no_retry_policy() {
+  RetryPolicy policy;
+  policy.max_retries = 0;
+  return policy;
+}
+
+bool is_transient_error(CURLcode rc) {
+  switch (rc) {
+    case CURLE_COULDNT_RESOLVE_PROXY:
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+    case CURLE_HTTP3:
+    case CURLE_QUIC_CONNECT_ERROR:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool is_http3_error(CURLcode rc) {
+  return rc == CURLE_QUIC_CONNECT_ERROR || rc == CURLE_HTTP3;
+}
+
+bool content_received(CURL *curl) {
+  curl_off_t size = 0;
+  auto rc = curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &size);
+  CHECK_CURL(rc);
+  return size > 0;
+}
+
+bool is_idempotent(CURL *curl) {
+  char *method = nullptr;
+  auto rc = curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_METHOD, &method);
+  CHECK_CURL(rc);
+
+  if (!method) {
+    return true;
+  }
+  std::string_view str = method;
+  return str == "GET" || str == "HEAD" || str == "PUT" || str == "DELETE" ||
+         str == "OPTIONS" || str == "TRACE";
+}
+
+// Full jitter, see
+// https://aws.amazon.com/blogs/architecture/exponential-backoff-and-jitter/
+std::chrono::milliseconds backoff_delay(const RetryPolicy &policy,
+                                        std::int32_t retries) {
+  thread_local std::mt19937_64 engine(std::random_device{}());
+
+  auto cap = policy.base_delay.count() << std::min(retries, 30);
+  cap = std::max<std::int64_t>(std::min(cap, policy.max_delay.count()), 0);
+  std::uniform_int_distribution<std::int64_t> dist(0, cap);
+  return std::chrono::milliseconds(dist(engine));
+}
+
+std::chrono::microseconds get_time(CURL *curl, CURLINFO info) {
+  curl_off_t time = 0;
+  auto rc = curl_easy_getinfo(curl, info, &time);
+  CHECK_CURL(rc);
+  return std::chrono::microseconds(time);
+}
+
+void set_bandwidth_meter(CURL *curl, BandwidthMeter *meter) {
+  CURLcode rc;
+  if (meter) {
+    rc = curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION,
+                          callback_func_xferinfo);
+    CHECK_CURL(rc);
+    rc = curl_easy_setopt(curl, CURLOPT_XFERINFODATA, meter);
+    CHECK_CURL(rc);
+    rc = curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0);
+  } else {
+    rc = curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, nullptr);
+    CHECK_CURL(rc);
+    rc = curl_easy_setopt(curl, CURLOPT_XFERINFODATA, nullptr);
+    CHECK_CURL(rc);
+    rc = curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1);
+  }
+  CHECK_CURL(rc);
+}
+
+std::string get_host(CURL *curl) {
+  // Set together with CURLOPT_URL
+  char *url = nullptr;
+  auto rc = curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+  CHECK_CURL(rc);
+  return std::string(URL(url).host());
+}
+
+TransferInfo get_transfer_info(CURL *curl) {
+  TransferInfo info;
+  info.namelookup = get_time(curl, CURLINFO_NAMELOOKUP_TIME_T);
+  info.connect = get_time(curl, CURLINFO_CONNECT_TIME_T);
+  info.appconnect = get_time(curl, CURLINFO_APPCONNECT_TIME_T);
+  info.pretransfer = get_time(curl, CURLINFO_PRETRANSFER_TIME_T);
+  info.starttransfer = get_time(curl, CURLINFO_STARTTRANSFER_TIME_T);
+  info.total = get_time(curl, CURLINFO_TOTAL_TIME_T);
+
+  curl_off_t size = 0;
+  auto rc = curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &size);
+  CHECK_CURL(rc);
+  info.bytes_uploaded = size;
+
+  rc = curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &size);
+  CHECK_CURL(rc);
+  info.bytes_downloaded = size;
+
+  long version = 0;
+  rc = curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version);
+  CHECK_CURL(rc);
+  switch (version) {
+    case CURL_HTTP_VERSION_1_0:
+      info.http_version = HttpVersion::Http10;
+      break;
+    case CURL_HTTP_VERSION_1_1:
+      info.http_version = HttpVersion::Http11;
+      break;
+    case CURL_HTTP_VERSION_2_0:
+      info.http_version = HttpVersion::Http2;
+      break;
+    case CURL_HTTP_VERSION_3:
+      info.http_version = HttpVersion::Http3;
+      break;
+    default:
+      info.http_version = HttpVersion::Unknown;
+  }
+
+  // The number of new connections made for the request, including redirects
+  long connects = 0;
+  rc = curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+  CHECK_CURL(rc);
+  info.connection_reused = connects == 0;
+
+  return info;
+}
+
 }  // namespace
 
+class HttpMetrics::HttpMetricsImpl {
+ public:
+  void record(const TransferInfo &info);
+
+  [[nodiscard]] std::uint64_t requests() const;
+  [[nodiscard]] std::uint64_t requests(HttpVersion version) const;
+  [[nodiscard]] std::uint64_t reused_connections() const;
+  [[nodiscard]] std::uint64_t retries() const;
+  [[nodiscard]] std::int64_t bytes_uploaded() const;
+  [[nodiscard]] std::int64_t bytes_downloaded() const;
+  [[nodiscard]] std::chrono::microseconds percentile(TimingPhase phase,
+                                                     double percentile) const;
+  [[nodiscard]] std::chrono::microseconds max(TimingPhase phase) const;
+  [[nodiscard]] std::vector<HistogramBucket> histogram(
+      TimingPhase phase) const;
+  [[nodiscard]] std::string report() const;
+  void reset();
+
+ private:
+  // Values below sub_buckets have a bucket each, every further power of two
+  // is split into sub_buckets buckets
+  constexpr static std::int32_t sub_bucket_bits = 3;
+  constexpr static std::uint64_t sub_buckets = 1 << sub_bucket_bits;
+  constexpr static std::size_t bucket_count =
+      (64 - sub_bucket_bits + 1) * sub_buckets;
+  constexpr static std::size_t phase_count =
+      static_cast<std::size_t>(TimingPhase::Total) + 1;
+  constexpr static std::size_t version_count =
+      static_cast<std::size_t>(HttpVersion::Http3) + 1;
+
+  using Buckets = std::array<std::atomic<std::uint64_t>, bucket_count>;
+
+  static std::size_t bucket_index(std::uint64_t value);
+  static std::chrono::microseconds bucket_upper_bound(std::size_t index);
+
+  void record(TimingPhase phase, std::chrono::microseconds time);
+
+  std::atomic<std::uint64_t> requests_ = 0;
+  std::atomic<std::uint64_t> reused_connections_ = 0;
+  std::atomic<std::uint64_t> retries_ = 0;
+  std::atomic<std::int64_t> bytes_uploaded_ = 0;
+  std::atomic<std::int64_t> bytes_downloaded_ = 0;
+  std::array<std::atomic<std::uint64_t>, version_count> versions_ = {};
+  std::array<Buckets, phase_count> buckets_ = {};
+  std::array<std::atomic<std::int64_t>, phase_count> max_ = {};
+};
+
+void HttpMetrics::HttpMetricsImpl::record(const TransferInfo &info) {
+  record(TimingPhase::NameLookup, info.namelookup);
+  record(TimingPhase::Connect, info.connect);
+  record(TimingPhase::AppConnect, info.appconnect);
+  record(TimingPhase::PreTransfer, info.pretransfer);
+  record(TimingPhase::StartTransfer, info.starttransfer);
+  record(TimingPhase::Total, info.total);
+
+  requests_.fetch_add(1, std::memory_order_relaxed);
+  if (info.connection_reused) {
+    reused_connections_.fetch_add(1, std::memory_order_relaxed);
+  }
+  retries_.fetch_add(info.retries, std::memory_order_relaxed);
+  bytes_uploaded_.fetch_add(info.bytes_uploaded, std::memory_order_relaxed);
+  bytes_downloaded_.fetch_add(info.bytes_downloaded,
+                              std::memory_order_relaxed);
+  versions_[static_cast<std::size_t>(info.http_version)].fetch_add(
+      1, std::memory_order_relaxed);
+}
+
+std::uint64_t HttpMetrics::HttpMetricsImpl::requests() const {
+  return requests_.load(std::memory_order_relaxed);
+}
+
+std::uint64_t HttpMetrics::HttpMetricsImpl::requests(
+    HttpVersion version) const {
+  return versions_[static_cast<std::size_t>(version)].load(
+      std::memory_order_relaxed);
+}
+
+std::uint64_t HttpMetrics::HttpMetricsImpl::reused_connections() const {
+  return reused_connections_.load(std::memory_order_relaxed);
+}
+
+std::uint64_t HttpMetrics::HttpMetricsImpl::retries() const {
+  return retries_.load(std::memory_order_relaxed);
+}
+
+std::int64_t HttpMetrics::HttpMetricsImpl::bytes_uploaded() const {
+  return bytes_uploaded_.load(std::memory_order_relaxed);
+}
+
+std::int64_t HttpMetrics::HttpMetricsImpl::bytes_downloaded() const {
+  return bytes_downloaded_.load(std::memory_order_relaxed);
+}
+
+std::chrono::microseconds HttpMetrics::HttpMetricsImpl::percentile(
+    TimingPhase phase, double percentile) const {
+  if (percentile < 0 || percentile > 100) [[unlikely]] {
+    throw InvalidArgument("The percentile must be in [0, 100]: {}",
+                          percentile);
+  }
+
+  auto buckets = histogram(phase);
+  std::uint64_t total = 0;
+  for (const auto &bucket : buckets) {
+    total += bucket.count;
+  }
+  if (total == 0) {
+    return std::chrono::microseconds(0);
+  }
+
+  auto rank = std::max<std::uint64_t>(
+      static_cast<std::uint64_t>(std::ceil(percentile / 100 * total)), 1);
+  std::uint64_t seen = 0;
+  for (const auto &bucket : buckets) {
+    seen += bucket.count;
+    if (seen >= rank) {
+      return bucket.upper_bound;
+    }
+  }
+
+  return buckets.back().upper_bound;
+}
+
+std::chrono::microseconds HttpMetrics::HttpMetricsImpl::max(
+    TimingPhase phase) const {
+  return std::chrono::microseconds(
+      max_[static_cast<std::size_t>(phase)].load(std::memory_order_relaxed));
+}
+
+std::vector<HistogramBucket> HttpMetrics::HttpMetricsImpl::histogram(
+    TimingPhase phase) const {
+  std::vector<HistogramBucket> result;
+  const auto &buckets = buckets_[static_cast<std::size_t>(phase)];
+  for (std::size_t i = 0; i < bucket_count; ++i) {
+    if (auto count = buckets[i].load(std::memory_order_relaxed); count > 0) {
+      HistogramBucket bucket;
+      bucket.upper_bound = bucket_upper_bound(i);
+      bucket.count = count;
+      result.push_back(bucket);
+    }
+  }
+  return result;
+}
+
+std::string HttpMetrics::HttpMetricsImpl::report() const {
+  auto result = fmt::format(
+      "requests: {}, reused connections: {}, retries: {}, uploaded: {} bytes, "
+      "downloaded: {} bytes\n",
+      requests(), reused_connections(), retries(), bytes_uploaded(),
+      bytes_downloaded());
+  result += fmt::format(
+      "HTTP/1.0: {}, HTTP/1.1: {}, HTTP/2: {}, HTTP/3: {}\n",
+      requests(HttpVersion::Http10), requests(HttpVersion::Http11),
+      requests(HttpVersion::Http2), requests(HttpVersion::Http3));
+
+  result += fmt::format("{:<16}{:>12}{:>12}{:>12}{:>12}\n", "phase(us)", "p50",
+                        "p90", "p99", "max");
+  constexpr std::array<std::string_view, phase_count> names = {
+      "namelookup",  "connect",       "appconnect",
+      "pretransfer", "starttransfer", "total"};
+  for (std::size_t i = 0; i < phase_count; ++i) {
+    auto phase = static_cast<TimingPhase>(i);
+    result += fmt::format("{:<16}{:>12}{:>12}{:>12}{:>12}\n", names[i],
+                          percentile(phase, 50).count(),
+                          percentile(phase, 90).count(),
+                          percentile(phase, 99).count(), max(phase).count());
+  }
+
+  return result;
+}
+
+void HttpMetrics::HttpMetricsImpl::reset() {
+  requests_.store(0, std::memory_order_relaxed);
+  reused_connections_.store(0, std::memory_order_relaxed);
+  retries_.store(0, std::memory_order_relaxed);
+  bytes_uploaded_.store(0, std::memory_order_relaxed);
+  bytes_downloaded_.store(0, std::memory_order_relaxed);
+  for (auto &count : versions_) {
+    count.store(0, std::memory_order_relaxed);
+  }
+  for (auto &buckets : buckets_) {
+    for (auto &count : buckets) {
+      count.store(0, std::memory_order_relaxed);
+    }
+  }
+  for (auto &max : max_) {
+    max.store(0, std::memory_order_relaxed);
+  }
+}
+
+std::size_t HttpMetrics::HttpMetricsImpl::bucket_index(std::uint64_t value) {
+  if (value < sub_buckets) {
+    return value;
+  }
+
+  auto msb = static_cast<std::int32_t>(std::bit_width(value)) - 1;
+  return (msb - sub_bucket_bits + 1) * sub_buckets +
+         ((value >> (msb - sub_bucket_bits)) & (sub_buckets - 1));
+}
+
+std::chrono::microseconds HttpMetrics::HttpMetricsImpl::bucket_upper_bound(
+    std::size_t index) {
+  if (index < sub_buckets) {
+    return std::chrono::microseconds(index + 1);
+  }
+
+  auto shift = index / sub_buckets - 1;
+  auto upper = (sub_buckets + index % sub_buckets + 1) << shift;
+  constexpr auto limit =
+      static_cast<std::uint64_t>(std::numeric_limits<std::int64_t>::max());
+  return std::chrono::microseconds(std::min(upper, limit));
+}
+
+void HttpMetrics::HttpMetricsImpl::record(TimingPhase phase,
+                                          std::chrono::microseconds time) {
+  auto value = std::max<std::int64_t>(time.count(), 0);
+  auto index = static_cast<std::size_t>(phase);
+  buckets_[index][bucket_index(value)].fetch_add(1,
+                                                 std::memory_order_relaxed);
+
+  auto &max = max_[index];
+  auto current = max.load(std::memory_order_relaxed);
+  while (value > current &&
+         !max.compare_exchange_weak(current, value,
+                                    std::memory_order_relaxed)) {
+  }
+}
+
+class RateLimiter::RateLimiterImpl {
+ public:
+  RateLimiterImpl(double qps, std::int32_t burst, std::int64_t bandwidth);
+
+  void set_host_rate(const std::string &host, double qps, std::int32_t burst);
+  void set_bandwidth(std::int64_t bytes_per_second);
+  std::chrono::nanoseconds acquire(std::string_view host);
+  bool try_acquire(std::string_view host);
+  void throttle(std::int64_t bytes);
+
+ private:
+  // Generic cell rate algorithm, tat is the time at which the bucket would be
+  // full again, a request of the cost is allowed once tat + cost - tolerance
+  // is not later than now
+  struct Bucket {
+    std::int64_t interval = 0;
+    std::int64_t tolerance = 0;
+    std::int64_t tat = 0;
+    bool custom = false;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    phmap::flat_hash_map<std::string, Bucket> buckets;
+  };
+
+  constexpr static std::size_t shard_count = 16;
+  constexpr static std::size_t prune_threshold = 4096;
+  constexpr static std::int64_t second = 1'000'000'000;
+
+  static std::int64_t now();
+  static Bucket make_bucket(double qps, std::int32_t burst);
+  static std::string to_key(std::string_view host);
+
+  Shard &shard(std::string_view key);
+  std::int64_t reserve(std::string_view host, bool wait);
+
+  Bucket default_bucket_;
+  std::array<Shard, shard_count> shards_;
+
+  std::atomic<std::int64_t> bandwidth_;
+  std::atomic<std::int64_t> bandwidth_tat_ = 0;
+};
+
+RateLimiter::RateLimiterImpl::RateLimiterImpl(double qps, std::int32_t burst,
+                                              std::int64_t bandwidth)
+    : default_bucket_(make_bucket(qps, burst)) {
+  set_bandwidth(bandwidth);
+}
+
+void RateLimiter::RateLimiterImpl::set_host_rate(const std::string &host,
+                                                 double qps,
+                                                 std::int32_t burst) {
+  auto bucket = make_bucket(qps, burst);
+  bucket.custom = true;
+
+  auto key = to_key(host);
+  auto &shard = this->shard(key);
+  std::lock_guard lock(shard.mutex);
+  if (auto iter = shard.buckets.find(key); iter != std::end(shard.buckets)) {
+    bucket.tat = iter->second.tat;
+    iter->second = bucket;
+  } else {
+    shard.buckets.emplace(std::move(key), bucket);
+  }
+}
+
+void RateLimiter::RateLimiterImpl::set_bandwidth(
+    std::int64_t bytes_per_second) {
+  if (bytes_per_second < 0) [[unlikely]] {
+    throw InvalidArgument("The bandwidth can not be negative: {}",
+                          bytes_per_second);
+  }
+  bandwidth_.store(bytes_per_second, std::memory_order_relaxed);
+}
+
+std::chrono::nanoseconds RateLimiter::RateLimiterImpl::acquire(
+    std::string_view host) {
+  auto wait = reserve(host, true);
+  if (wait > 0) {
+    std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+  }
+  return std::chrono::nanoseconds(std::max<std::int64_t>(wait, 0));
+}
+
+bool RateLimiter::RateLimiterImpl::try_acquire(std::string_view host) {
+  return reserve(host, false) <= 0;
+}
+
+void RateLimiter::RateLimiterImpl::throttle(std::int64_t bytes) {
+  auto bandwidth = bandwidth_.load(std::memory_order_relaxed);
+  if (bandwidth == 0 || bytes <= 0) {
+    return;
+  }
+
+  auto cost = static_cast<std::int64_t>(static_cast<double>(bytes) /
+                                        static_cast<double>(bandwidth) *
+                                        static_cast<double>(second));
+  auto current = now();
+  auto tat = bandwidth_tat_.load(std::memory_order_relaxed);
+  std::int64_t new_tat;
+  do {
+    new_tat = std::max(tat, current) + cost;
+  } while (!bandwidth_tat_.compare_exchange_weak(tat, new_tat,
+                                                 std::memory_order_relaxed));
+
+  if (auto wait = new_tat - second - current; wait > 0) {
+    std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+  }
+}
+
+std::int64_t RateLimiter::RateLimiterImpl::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+RateLimiter::RateLimiterImpl::Bucket RateLimiter::RateLimiterImpl::make_bucket(
+    double qps, std::int32_t burst) {
+  if (qps < 0) [[unlikely]] {
+    throw InvalidArgument("The number of requests per second can not be "
+                          "negative: {}",
+                          qps);
+  }
+  if (burst < 1) [[unlikely]] {
+    throw InvalidArgument("The burst must be at least 1: {}", burst);
+  }
+
+  Bucket bucket;
+  if (qps > 0) {
+    bucket.interval =
+        static_cast<std::int64_t>(static_cast<double>(second) / qps);
+    bucket.tolerance = bucket.interval * burst;
+  }
+  return bucket;
+}
+
+std::string RateLimiter::RateLimiterImpl::to_key(std::string_view host) {
+  std::string key(host);
+  std::transform(std::begin(key), std::end(key), std::begin(key),
+                 [](unsigned char c) { return std::tolower(c); });
+  return key;
+}
+
+RateLimiter::RateLimiterImpl::Shard &RateLimiter::RateLimiterImpl::shard(
+    std::string_view key) {
+  return shards_[std::hash<std::string_view>{}(key) % shard_count];
+}
+
+std::int64_t RateLimiter::RateLimiterImpl::reserve(std::string_view host,
+                                                   bool wait) {
+  auto key = to_key(host);
+  auto &shard = this->shard(key);
+  auto current = now();
+
+  std::lock_guard lock(shard.mutex);
+  auto iter = shard.buckets.find(key);
+  if (iter == std::end(shard.buckets)) {
+    if (default_bucket_.interval == 0) {
+      return 0;
+    }
+    // A bucket whose tat has passed is full, the same as a new one
+    if (std::size(shard.buckets) >= prune_threshold) {
+      phmap::erase_if(shard.buckets, [&](const auto &item) {
+        return !item.second.custom && item.second.tat <= current;
+      });
+    }
+    iter = shard.buckets.emplace(std::move(key), default_bucket_).first;
+  }
+
+  auto &bucket = iter->second;
+  if (bucket.interval == 0) {
+    return 0;
+  }
+
+  auto new_tat = std::max(bucket.tat, current) + bucket.interval;
+  auto result = new_tat - bucket.tolerance - current;
+  if (wait || result <= 0) {
+    bucket.tat = new_tat;
+  }
+  return result;
+}
+
+RateLimiter::RateLimiter(double qps, std::int32_t burst,
+                         std::int64_t bandwidth)
+    : impl_(std::make_unique<RateLimiterImpl>(qps, burst, bandwidth)) {}
+
+RateLimiter::~RateLimiter() = default;
+
+void RateLimiter::set_host_rate(const std::string &host, double qps,
+                                std::int32_t burst) {
+  impl_->set_host_rate(host, qps, burst);
+}
+
+void RateLimiter::set_bandwidth(std::int64_t bytes_per_second) {
+  impl_->set_bandwidth(bytes_per_second);
+}
+
+std::chrono::nanoseconds RateLimiter::acquire(std::string_view host) {
+  return impl_->acquire(host);
+}
+
+bool RateLimiter::try_acquire(std::string_view host) {
+  return impl_->try_acquire(host);
+}
+
+void RateLimiter::throttle(std::int64_t bytes) { impl_->throttle(bytes); }
+
+HttpMetrics::HttpMetrics() : impl_(std::make_unique<HttpMetricsImpl>()) {}
+
+HttpMetrics::~HttpMetrics() = default;
+
+void HttpMetrics::record(const TransferInfo &info) { impl_->record(info); }
+
+std::uint64_t HttpMetrics::requests() const { return impl_->requests(); }
+
+std::uint64_t HttpMetrics::requests(HttpVersion version) const {
+  return impl_->requests(version);
+}
+
+std::uint64_t HttpMetrics::reused_connections() const {
+  return impl_->reused_connections();
+}
+
+std::uint64_t HttpMetrics::retries() const { return impl_->retries(); }
+
+std::int64_t HttpMetrics::bytes_uploaded() const {
+  return impl_->bytes_uploaded();
+}
+
+std::int64_t HttpMetrics::bytes_downloaded() const {
+  return impl_->bytes_downloaded();
+}
+
+std::chrono::microseconds HttpMetrics::percentile(TimingPhase phase,
+                                                  double percentile) const {
+  return impl_->percentile(phase, percentile);
+}
+
+std::chrono::microseconds HttpMetrics::max(TimingPhase phase) const {
+  return impl_->max(phase);
+}
+
+std::vector<HistogramBucket> HttpMetrics::histogram(TimingPhase phase) const {
+  return impl_->histogram(phase);
+}
+
+std::string HttpMetrics::report() const { return impl_->report(); }
+
+void HttpMetrics::reset() { impl_->reset(); }
+
 class Request::RequestImpl {
  public:
   RequestImpl();
@@ -120,6 +1179,8 @@ class Request::RequestImpl {
   ~RequestImpl();
 
   void verbose(bool flag);
+  void use_share_cache(bool flag);
+  void enable_http3(bool flag);
   void set_proxy(const std::string &proxy);
   void set_proxy_from_env();
   void set_no_proxy(const std::string &no_proxy);
@@ -130,11 +1191,45 @@ class Request::RequestImpl {
   void set_connect_timeout(std::int64_t seconds);
   void set_cookie(
       const phmap::flat_hash_map<std::string, std::string> &cookies);
+  void set_request_compression(ContentEncoding encoding,
+                               std::size_t threshold);
+  void set_retry_policy(const RetryPolicy &policy);
+  void set_metrics(std::shared_ptr<HttpMetrics> metrics);
+  void set_rate_limiter(std::shared_ptr<RateLimiter> limiter);
   void basic_auth(const std::string &user_name, const std::string &password);
 
   [[nodiscard]] Response get(
       const std::string &url,
+      const phmap::flat_hash_map<std::string, std::string> &headers,
+      const WriteCallback &callback = {});
+  [[nodiscard]] Response get_hedged(
+      const std::string &url,
+      const phmap::flat_hash_map<std::string, std::string> &headers,
+      std::chrono::milliseconds delay);
+  [[nodiscard]] Response download(
+      const std::string &url, const std::string &path,
       const phmap::flat_hash_map<std::string, std::string> &headers);
+  [[nodiscard]] Response download_segmented(
+      const std::string &url, const std::string &path, std::int32_t segments,
+      const std::string &sha256,
+      const phmap::flat_hash_map<std::string, std::string> &headers);
+  [[nodiscard]] Response get_if_none_match(
+      const std::string &url, const std::string &etag,
+      const phmap::flat_hash_map<std::string, std::string> &headers);
+  [[nodiscard]] Response get_if_modified_since(
+      const std::string &url, const std::string &last_modified,
+      const phmap::flat_hash_map<std::string, std::string> &headers);
+  [[nodiscard]] Response get_range(
+      const std::string &url, std::int64_t begin, std::int64_t end,
+      const phmap::flat_hash_map<std::string, std::string> &headers,
+      const WriteCallback &callback = {});
+  [[nodiscard]] Response resume_download(
+      const std::string &url, const std::string &path,
+      const phmap::flat_hash_map<std::string, std::string> &headers);
+  [[nodiscard]] Response head(
+      const std::string &url,
+      const phmap::flat_hash_map<std::string, std::string> &headers,
+      std::string *effective_url = nullptr);
   [[nodiscard]] Response post(
       const std::string &url,
       const phmap::flat_hash_map<std::string, std::string> &data,
@@ -142,6 +1237,12 @@ class Request::RequestImpl {
   [[nodiscard]] Response post(
       const std::string &url, const std::string &json,
       const phmap::flat_hash_map<std::string, std::string> &headers);
+  [[nodiscard]] Response post(
+      const std::string &url, const ReadCallback &callback, std::int64_t size,
+      const phmap::flat_hash_map<std::string, std::string> &headers);
+  [[nodiscard]] Response post_file(
+      const std::string &url, const std::string &path,
+      const phmap::flat_hash_map<std::string, std::string> &headers);
   [[nodiscard]] Response post_mime(
       const std::string &url,
       const phmap::flat_hash_map<std::string, std::string> &data,
@@ -149,12 +1250,44 @@ class Request::RequestImpl {
       const phmap::flat_hash_map<std::string, std::string> &headers);
 
  private:
-  Response do_easy_perform();
+  static void set_response_target(CURL *curl, Response &response,
+                                  WriteContext *context = nullptr);
+  void reset_response_target();
+
+  CURLcode easy_perform(Response &response, bool streaming, bool replayable);
+  Response do_easy_perform(const WriteCallback &callback = {},
+                           bool replayable = true);
+
+  std::optional<std::chrono::milliseconds> retry_delay(
+      CURLcode rc, bool streaming, std::int32_t retries);
+  std::optional<std::chrono::microseconds> hedge_delay() const;
+  void record_latency(std::chrono::microseconds latency);
+  void record_transfer(CURL *curl, Response &response, std::int32_t retries);
+
+  Response do_post(
+      const std::string &url, const std::string &content,
+      const phmap::flat_hash_map<std::string, std::string> &headers);
 
   std::string splicing_post_fields(
       const phmap::flat_hash_map<std::string, std::string> &data);
 
   CURL *curl_;
+  bool use_share_cache_ = false;
+  bool http3_ = false;
+
+  ContentEncoding request_encoding_ = ContentEncoding::Identity;
+  std::size_t compression_threshold_ = 0;
+
+  RetryPolicy retry_policy_ = no_retry_policy();
+
+  std::shared_ptr<HttpMetrics> metrics_;
+  std::shared_ptr<RateLimiter> rate_limiter_;
+
+  CURLM *hedge_multi_ = nullptr;
+  std::vector<std::int64_t> latencies_;
+  std::size_t latency_index_ = 0;
+  constexpr static std::size_t max_latency_samples = 128;
+  constexpr static std::size_t min_latency_samples = 20;
 
   const inline static std::string cookies_path =
       get_env("HOME").value_or("/tmp") + "/.cookies.txt";
@@ -179,9 +1312,8 @@ Request::RequestImpl::RequestImpl() {
   rc = curl_easy_setopt(curl_, CURLOPT_CAPATH, nullptr);
   CHECK_CURL(rc);
 
-  curl_blob blob = {cacert, static_cast<std::size_t>(cacert_size),
-                    CURL_BLOB_NOCOPY};
-  rc = curl_easy_setopt(curl_, CURLOPT_CAINFO_BLOB, &blob);
+  rc = curl_easy_setopt(curl_, CURLOPT_SSL_CTX_FUNCTION,
+                        callback_func_ssl_ctx);
   CHECK_CURL(rc);
     
   rc = curl_easy_setopt(curl_,CURLOPT_SSL_VERIFYHOST, 0);
@@ -219,12 +1351,10 @@ Request::RequestImpl::RequestImpl() {
 
   rc = curl_easy_setopt(curl_, CURLOPT_ACCEPT_ENCODING, "gzip, deflate, br");
   CHECK_CURL(rc);
-
-  rc = curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, callback_func_std_string);
-  CHECK_CURL(rc);
 }
 
 Request::RequestImpl::~RequestImpl() {
+  curl_multi_cleanup(hedge_multi_);
   curl_easy_cleanup(curl_);
   curl_global_cleanup();
 }
@@ -234,6 +1364,30 @@ void Request::RequestImpl::verbose(bool flag) {
   CHECK_CURL(rc);
 }
 
+void Request::RequestImpl::use_share_cache(bool flag) {
+  auto rc = curl_easy_setopt(curl_, CURLOPT_SHARE,
+                             flag ? ShareCache::get().handle() : nullptr);
+  CHECK_CURL(rc);
+
+  use_share_cache_ = flag;
+}
+
+void Request::RequestImpl::enable_http3(bool flag) {
+  if (flag && !http3_supported()) {
+    warn("libcurl is built without HTTP/3 support, use HTTP/1.1 and HTTP/2");
+    flag = false;
+  }
+
+  long ctrl = CURLALTSVC_H1 | CURLALTSVC_H2;
+  if (flag) {
+    ctrl |= CURLALTSVC_H3;
+  }
+  auto rc = curl_easy_setopt(curl_, CURLOPT_ALTSVC_CTRL, ctrl);
+  CHECK_CURL(rc);
+
+  http3_ = flag;
+}
+
 void Request::RequestImpl::set_proxy(const std::string &proxy) {
   auto rc = curl_easy_setopt(curl_, CURLOPT_PROXY,
                              std::empty(proxy) ? nullptr : proxy.c_str());
@@ -273,74 +1427,492 @@ void Request::RequestImpl::set_timeout(std::int64_t seconds) {
   CHECK_CURL(rc);
 }
 
-void Request::RequestImpl::set_connect_timeout(std::int64_t seconds) {
-  auto rc = curl_easy_setopt(curl_, CURLOPT_CONNECTTIMEOUT, seconds);
-  CHECK_CURL(rc);
-}
+void Request::RequestImpl::set_connect_timeout(std::int64_t seconds) {
+  auto rc = curl_easy_setopt(curl_, CURLOPT_CONNECTTIMEOUT, seconds);
+  CHECK_CURL(rc);
+}
+
+void Request::RequestImpl::set_cookie(
+    const phmap::flat_hash_map<std::string, std::string> &cookies) {
+  std::string cookies_str;
+  for (const auto &[key, value] : cookies) {
+    cookies_str.append(key).append("=").append(value).append(";");
+  }
+
+  auto rc = curl_easy_setopt(curl_, CURLOPT_COOKIE, cookies_str.c_str());
+  CHECK_CURL(rc);
+}
+
+void Request::RequestImpl::set_request_compression(ContentEncoding encoding,
+                                                   std::size_t threshold) {
+  request_encoding_ = encoding;
+  compression_threshold_ = threshold;
+}
+
+void Request::RequestImpl::set_retry_policy(const RetryPolicy &policy) {
+  if (policy.max_retries < 0) [[unlikely]] {
+    throw InvalidArgument("The number of retries can not be negative");
+  }
+  retry_policy_ = policy;
+}
+
+void Request::RequestImpl::set_metrics(std::shared_ptr<HttpMetrics> metrics) {
+  metrics_ = std::move(metrics);
+}
+
+void Request::RequestImpl::set_rate_limiter(
+    std::shared_ptr<RateLimiter> limiter) {
+  rate_limiter_ = std::move(limiter);
+}
+
+void Request::RequestImpl::basic_auth(const std::string &user_name,
+                                      const std::string &password) {
+  auto rc = curl_easy_setopt(curl_, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+  CHECK_CURL(rc);
+
+  rc = curl_easy_setopt(curl_, CURLOPT_USERNAME, user_name.c_str());
+  CHECK_CURL(rc);
+  rc = curl_easy_setopt(curl_, CURLOPT_PASSWORD, password.c_str());
+  CHECK_CURL(rc);
+}
+
+Response Request::RequestImpl::get(
+    const std::string &url,
+    const phmap::flat_hash_map<std::string, std::string> &headers,
+    const WriteCallback &callback) {
+  auto rc = curl_easy_setopt(curl_, CURLOPT_HTTPGET, 1);
+  CHECK_CURL(rc);
+
+  rc = curl_easy_setopt(curl_, CURLOPT_URL, url.c_str());
+  SCOPE_EXIT {
+    rc = curl_easy_setopt(curl_, CURLOPT_URL, nullptr);
+    CHECK_CURL(rc);
+  };
+
+  auto chunk = add_header(curl_, headers);
+  SCOPE_EXIT {
+    curl_slist_free_all(chunk);
+    rc = curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, nullptr);
+    CHECK_CURL(rc);
+  };
+
+  return do_easy_perform(callback);
+}
+
+Response Request::RequestImpl::get_hedged(
+    const std::string &url,
+    const phmap::flat_hash_map<std::string, std::string> &headers,
+    std::chrono::milliseconds delay) {
+  if (!hedge_multi_) {
+    hedge_multi_ = curl_multi_init();
+    if (!hedge_multi_) [[unlikely]] {
+      throw RuntimeError("curl_multi_init() failed");
+    }
+    // Two requests multiplexed on one connection would share its fate
+    auto mc = curl_multi_setopt(hedge_multi_, CURLMOPT_PIPELINING,
+                                CURLPIPE_NOTHING);
+    CHECK_CURL_MULTI(mc);
+  }
+
+  auto rc = curl_easy_setopt(curl_, CURLOPT_HTTPGET, 1);
+  CHECK_CURL(rc);
+
+  rc = curl_easy_setopt(curl_, CURLOPT_URL, url.c_str());
+  SCOPE_EXIT {
+    rc = curl_easy_setopt(curl_, CURLOPT_URL, nullptr);
+    CHECK_CURL(rc);
+  };
+
+  auto chunk = add_header(curl_, headers);
+  SCOPE_EXIT {
+    curl_slist_free_all(chunk);
+    rc = curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, nullptr);
+    CHECK_CURL(rc);
+  };
+
+  std::optional<std::chrono::microseconds> hedge_after;
+  if (delay.count() > 0) {
+    hedge_after = delay;
+  } else {
+    hedge_after = hedge_delay();
+  }
+
+  std::array<Response, 2> responses;
+  set_response_target(curl_, responses[0]);
+  SCOPE_EXIT { reset_response_target(); };
+
+  std::string host;
+  std::array<BandwidthMeter, 2> meters;
+  if (rate_limiter_) {
+    host = get_host(curl_);
+    meters[0].limiter = meters[1].limiter = rate_limiter_.get();
+    set_bandwidth_meter(curl_, &meters[0]);
+    rate_limiter_->acquire(host);
+  }
+  SCOPE_EXIT {
+    if (rate_limiter_) {
+      set_bandwidth_meter(curl_, nullptr);
+    }
+  };
+
+  CURL *hedge = nullptr;
+  SCOPE_EXIT {
+    curl_multi_remove_handle(hedge_multi_, curl_);
+    if (hedge) {
+      curl_multi_remove_handle(hedge_multi_, hedge);
+      curl_easy_cleanup(hedge);
+    }
+  };
+
+  auto mc = curl_multi_add_handle(hedge_multi_, curl_);
+  CHECK_CURL_MULTI(mc);
+  const auto begin = std::chrono::steady_clock::now();
+
+  CURL *winner = nullptr;
+  CURLcode result = CURLE_OK;
+  std::int32_t in_flight = 1;
+  while (!winner) {
+    std::int32_t still_running = 0;
+    mc = curl_multi_perform(hedge_multi_, &still_running);
+    CHECK_CURL_MULTI(mc);
+
+    std::int32_t msgs_in_queue = 0;
+    while (auto msg = curl_multi_info_read(hedge_multi_, &msgs_in_queue)) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      --in_flight;
+      result = msg->data.result;
+      // A failed request only loses if the other one is still going or is yet
+      // to be sent
+      if (result == CURLE_OK || (in_flight == 0 && (!hedge_after || hedge))) {
+        winner = msg->easy_handle;
+        break;
+      }
+    }
+    if (winner) {
+      break;
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - begin);
+    std::int32_t timeout = 1000;
+    if (hedge_after && !hedge) {
+      if (elapsed >= *hedge_after || in_flight == 0) {
+        // Hedging is given up rather than waited for
+        if (rate_limiter_ && !rate_limiter_->try_acquire(host)) {
+          hedge_after.reset();
+          if (in_flight == 0) {
+            winner = curl_;
+          }
+          continue;
+        }
+        // Only duplicated when needed, the duplicate shares the headers list
+        hedge = curl_easy_duphandle(curl_);
+        if (!hedge) [[unlikely]] {
+          throw RuntimeError("curl_easy_duphandle() failed");
+        }
+        // Otherwise the cookie jar is written when the duplicate is cleaned up
+        rc = curl_easy_setopt(hedge, CURLOPT_COOKIEJAR, nullptr);
+        CHECK_CURL(rc);
+        if (use_share_cache_) {
+          rc = curl_easy_setopt(hedge, CURLOPT_SHARE,
+                                ShareCache::get().handle());
+          CHECK_CURL(rc);
+        }
+        set_response_target(hedge, responses[1]);
+        if (rate_limiter_) {
+          set_bandwidth_meter(hedge, &meters[1]);
+        }
+
+        mc = curl_multi_add_handle(hedge_multi_, hedge);
+        CHECK_CURL_MULTI(mc);
+        ++in_flight;
+        continue;
+      }
+      timeout = static_cast<std::int32_t>(
+          (*hedge_after - elapsed).count() / 1000 + 1);
+    }
+
+    mc = curl_multi_poll(hedge_multi_, nullptr, 0, timeout, nullptr);
+    CHECK_CURL_MULTI(mc);
+  }
+
+  CHECK_CURL(result);
+  record_latency(std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - begin));
+
+  if (use_share_cache_) {
+    ShareCache::get().record(winner);
+  }
+
+  auto &response = responses[winner == curl_ ? 0 : 1];
+  response.status_ = get_status(winner);
+  record_transfer(winner, response, 0);
+
+  return std::move(response);
+}
+
+Response Request::RequestImpl::download(
+    const std::string &url, const std::string &path,
+    const phmap::flat_hash_map<std::string, std::string> &headers) {
+  auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) [[unlikely]] {
+    throw RuntimeError("Can not open file: '{}'", path);
+  }
+  SCOPE_EXIT { close(fd); };
+
+  return get(url, headers,
+             [fd](std::string_view data) { return write_to_fd(fd, data); });
+}
+
+Response Request::RequestImpl::download_segmented(
+    const std::string &url, const std::string &path, std::int32_t segments,
+    const std::string &sha256,
+    const phmap::flat_hash_map<std::string, std::string> &headers) {
+  auto verify = [&] {
+    if (!std::empty(sha256) && sha256_file_hex(path) != sha256) [[unlikely]] {
+      throw RuntimeError("SHA-256 of file '{}' does not match", path);
+    }
+  };
+
+  // Content-Length and byte ranges must refer to the identity encoding, since
+  // segments of a content-coded representation can not be decoded one by one.
+  // The segment handles duplicated below inherit this
+  auto rc = curl_easy_setopt(curl_, CURLOPT_ACCEPT_ENCODING, nullptr);
+  CHECK_CURL(rc);
+  SCOPE_EXIT {
+    rc = curl_easy_setopt(curl_, CURLOPT_ACCEPT_ENCODING, "gzip, deflate, br");
+    CHECK_CURL(rc);
+  };
+
+  std::string final_url;
+  auto response = head(url, headers, &final_url);
+
+  std::int64_t content_length = -1;
+  if (auto length = response.header("Content-Length"); length) {
+    std::from_chars(std::data(*length), std::data(*length) + std::size(*length),
+                    content_length);
+  }
+  auto accept_ranges = response.header("Accept-Ranges");
+
+  auto fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) [[unlikely]] {
+    throw RuntimeError("Can not open file: '{}'", path);
+  }
+  SCOPE_EXIT { close(fd); };
+  // Only a file truncated here is removed, a failed HEAD request or open()
+  // leaves an existing file alone
+  SCOPE_FAIL {
+    std::error_code error_code;
+    std::filesystem::remove(path, error_code);
+  };
+
+  if (segments <= 1 || !response.ok() || content_length < segments ||
+      !accept_ranges || *accept_ranges != "bytes") {
+    auto result = get(final_url, headers, [fd](std::string_view data) {
+      return write_to_fd(fd, data);
+    });
+    verify();
+    return result;
+  }
+
+  if (auto err = posix_fallocate(fd, 0, content_length); err != 0)
+      [[unlikely]] {
+    throw RuntimeError("posix_fallocate() failed: {}", std::strerror(err));
+  }
+
+  auto chunk = add_header(curl_, headers);
+  SCOPE_EXIT {
+    curl_slist_free_all(chunk);
+    rc = curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, nullptr);
+    CHECK_CURL(rc);
+  };
+
+  auto multi = curl_multi_init();
+  if (!multi) [[unlikely]] {
+    throw RuntimeError("curl_multi_init() failed");
+  }
+
+  std::vector<Segment> segment_list(segments);
+  SCOPE_EXIT {
+    for (auto &segment : segment_list) {
+      if (segment.curl) {
+        curl_multi_remove_handle(multi, segment.curl);
+        curl_easy_cleanup(segment.curl);
+      }
+    }
+    curl_multi_cleanup(multi);
+  };
+
+  const auto segment_size = content_length / segments;
+  for (std::int32_t i = 0; i < segments; ++i) {
+    auto &segment = segment_list[i];
+    segment.fd = fd;
+    segment.offset = i * segment_size;
+    segment.end =
+        i == segments - 1 ? content_length - 1 : (i + 1) * segment_size - 1;
+
+    // Inherits proxy, timeout, share cache and other settings
+    segment.curl = curl_easy_duphandle(curl_);
+    if (!segment.curl) [[unlikely]] {
+      throw RuntimeError("curl_easy_duphandle() failed");
+    }
+
+    auto range = std::to_string(segment.offset) + "-" +
+                 std::to_string(segment.end);
+    rc = curl_easy_setopt(segment.curl, CURLOPT_HTTPGET, 1);
+    CHECK_CURL(rc);
+    rc = curl_easy_setopt(segment.curl, CURLOPT_URL, final_url.c_str());
+    CHECK_CURL(rc);
+    rc = curl_easy_setopt(segment.curl, CURLOPT_RANGE, range.c_str());
+    CHECK_CURL(rc);
+    rc = curl_easy_setopt(segment.curl, CURLOPT_WRITEFUNCTION,
+                          callback_func_segment);
+    CHECK_CURL(rc);
+    rc = curl_easy_setopt(segment.curl, CURLOPT_WRITEDATA, &segment);
+    CHECK_CURL(rc);
+    if (rate_limiter_) {
+      segment.meter.limiter = rate_limiter_.get();
+      set_bandwidth_meter(segment.curl, &segment.meter);
+      rate_limiter_->acquire(URL(final_url).host());
+    }
+
+    auto mc = curl_multi_add_handle(multi, segment.curl);
+    CHECK_CURL_MULTI(mc);
+  }
+
+  std::int32_t still_running = 0;
+  do {
+    auto mc = curl_multi_perform(multi, &still_running);
+    CHECK_CURL_MULTI(mc);
+
+    if (still_running) {
+      mc = curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+      CHECK_CURL_MULTI(mc);
+    }
+  } while (still_running);
+
+  std::int32_t msgs_in_queue = 0;
+  while (auto msg = curl_multi_info_read(multi, &msgs_in_queue)) {
+    if (msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+
+    CHECK_CURL(msg->data.result);
+    if (auto status = get_status(msg->easy_handle);
+        status != HttpStatus::HTTP_STATUS_PARTIAL_CONTENT) [[unlikely]] {
+      throw RuntimeError("Segment request failed: {}", http_status_str(status));
+    }
+  }
 
-void Request::RequestImpl::set_cookie(
-    const phmap::flat_hash_map<std::string, std::string> &cookies) {
-  std::string cookies_str;
-  for (const auto &[key, value] : cookies) {
-    cookies_str.append(key).append("=").append(value).append(";");
+  for (const auto &segment : segment_list) {
+    if (segment.offset != segment.end + 1) [[unlikely]] {
+      throw RuntimeError("Incomplete segment");
+    }
   }
 
-  auto rc = curl_easy_setopt(curl_, CURLOPT_COOKIE, cookies_str.c_str());
-  CHECK_CURL(rc);
+  verify();
+
+  return response;
 }
 
-void Request::RequestImpl::basic_auth(const std::string &user_name,
-                                      const std::string &password) {
-  auto rc = curl_easy_setopt(curl_, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
-  CHECK_CURL(rc);
+Response Request::RequestImpl::get_if_none_match(
+    const std::string &url, const std::string &etag,
+    const phmap::flat_hash_map<std::string, std::string> &headers) {
+  auto headers_copy = headers;
+  headers_copy["If-None-Match"] = etag;
 
-  rc = curl_easy_setopt(curl_, CURLOPT_USERNAME, user_name.c_str());
-  CHECK_CURL(rc);
-  rc = curl_easy_setopt(curl_, CURLOPT_PASSWORD, password.c_str());
-  CHECK_CURL(rc);
+  return get(url, headers_copy);
 }
 
-Response Request::RequestImpl::get(
-    const std::string &url,
+Response Request::RequestImpl::get_if_modified_since(
+    const std::string &url, const std::string &last_modified,
     const phmap::flat_hash_map<std::string, std::string> &headers) {
-  auto rc = curl_easy_setopt(curl_, CURLOPT_HTTPGET, 1);
-  CHECK_CURL(rc);
+  auto headers_copy = headers;
+  headers_copy["If-Modified-Since"] = last_modified;
 
-  rc = curl_easy_setopt(curl_, CURLOPT_URL, url.c_str());
+  return get(url, headers_copy);
+}
+
+Response Request::RequestImpl::get_range(
+    const std::string &url, std::int64_t begin, std::int64_t end,
+    const phmap::flat_hash_map<std::string, std::string> &headers,
+    const WriteCallback &callback) {
+  if (begin < 0 || (end >= 0 && end < begin)) [[unlikely]] {
+    throw InvalidArgument("Invalid range: {}-{}", begin, end);
+  }
+
+  auto range = std::to_string(begin) + "-";
+  if (end >= 0) {
+    range.append(std::to_string(end));
+  }
+
+  auto rc = curl_easy_setopt(curl_, CURLOPT_RANGE, range.c_str());
+  CHECK_CURL(rc);
   SCOPE_EXIT {
-    rc = curl_easy_setopt(curl_, CURLOPT_URL, nullptr);
+    rc = curl_easy_setopt(curl_, CURLOPT_RANGE, nullptr);
     CHECK_CURL(rc);
   };
 
-  auto chunk = add_header(curl_, headers);
+  // A byte range of a content-coded representation is not decodable on its
+  // own, and resumed downloads append it to the identity bytes on disk
+  rc = curl_easy_setopt(curl_, CURLOPT_ACCEPT_ENCODING, nullptr);
+  CHECK_CURL(rc);
   SCOPE_EXIT {
-    curl_slist_free_all(chunk);
-    rc = curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, nullptr);
+    rc = curl_easy_setopt(curl_, CURLOPT_ACCEPT_ENCODING, "gzip, deflate, br");
     CHECK_CURL(rc);
   };
 
-  return do_easy_perform();
+  return get(url, headers, callback);
 }
 
-Response Request::RequestImpl::post(
-    const std::string &url,
-    const phmap::flat_hash_map<std::string, std::string> &data,
+Response Request::RequestImpl::resume_download(
+    const std::string &url, const std::string &path,
     const phmap::flat_hash_map<std::string, std::string> &headers) {
-  auto rc = curl_easy_setopt(curl_, CURLOPT_HTTPPOST, 1);
-  CHECK_CURL(rc);
+  auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1) [[unlikely]] {
+    throw RuntimeError("Can not open file: '{}'", path);
+  }
+  SCOPE_EXIT { close(fd); };
 
-  auto post_fields = splicing_post_fields(data);
-  rc = curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, post_fields.c_str());
-  CHECK_CURL(rc);
-  SCOPE_EXIT {
-    rc = curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, nullptr);
-    CHECK_CURL(rc);
-  };
+  auto offset = lseek(fd, 0, SEEK_END);
+  if (offset == -1) [[unlikely]] {
+    throw RuntimeError("lseek() failed: {}", std::strerror(errno));
+  }
+
+  std::optional<HttpStatus> status;
+  return get_range(
+      url, offset, -1, headers, [&](std::string_view data) {
+        if (!status) {
+          status = get_status(curl_);
+
+          // The server ignored the range and sent the whole content
+          if (*status == HttpStatus::HTTP_STATUS_OK &&
+              (ftruncate(fd, 0) == -1 || lseek(fd, 0, SEEK_SET) == -1))
+              [[unlikely]] {
+            return false;
+          }
+        }
+
+        // Discard the body of error responses such as 416
+        if (*status != HttpStatus::HTTP_STATUS_OK &&
+            *status != HttpStatus::HTTP_STATUS_PARTIAL_CONTENT) {
+          return true;
+        }
+
+        return write_to_fd(fd, data);
+      });
+}
 
-  rc = curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE, std::size(post_fields));
+Response Request::RequestImpl::head(
+    const std::string &url,
+    const phmap::flat_hash_map<std::string, std::string> &headers,
+    std::string *effective_url) {
+  auto rc = curl_easy_setopt(curl_, CURLOPT_NOBODY, 1);
   CHECK_CURL(rc);
   SCOPE_EXIT {
-    rc = curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE, -1);
+    rc = curl_easy_setopt(curl_, CURLOPT_NOBODY, 0);
     CHECK_CURL(rc);
   };
 
@@ -357,26 +1929,60 @@ Response Request::RequestImpl::post(
     CHECK_CURL(rc);
   };
 
-  return do_easy_perform();
+  auto response = do_easy_perform();
+
+  // Must be read before CURLOPT_URL is reset, which also clears it
+  if (effective_url) {
+    char *str = nullptr;
+    rc = curl_easy_getinfo(curl_, CURLINFO_EFFECTIVE_URL, &str);
+    CHECK_CURL(rc);
+    *effective_url = str && *str ? str : url;
+  }
+
+  return response;
+}
+
+Response Request::RequestImpl::post(
+    const std::string &url,
+    const phmap::flat_hash_map<std::string, std::string> &data,
+    const phmap::flat_hash_map<std::string, std::string> &headers) {
+  return do_post(url, splicing_post_fields(data), headers);
 }
 
 Response Request::RequestImpl::post(
     const std::string &url, const std::string &json,
     const phmap::flat_hash_map<std::string, std::string> &headers) {
-  auto rc = curl_easy_setopt(curl_, CURLOPT_HTTPPOST, 1);
+  auto headers_copy = headers;
+  headers_copy["Content-Type"] = "application/json";
+
+  return do_post(url, json, headers_copy);
+}
+
+Response Request::RequestImpl::post(
+    const std::string &url, const ReadCallback &callback, std::int64_t size,
+    const phmap::flat_hash_map<std::string, std::string> &headers) {
+  auto rc = curl_easy_setopt(curl_, CURLOPT_POST, 1);
   CHECK_CURL(rc);
 
-  rc = curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, json.c_str());
+  ReadContext context = {&callback, {}};
+  rc = curl_easy_setopt(curl_, CURLOPT_READFUNCTION, callback_func_read);
+  CHECK_CURL(rc);
+  rc = curl_easy_setopt(curl_, CURLOPT_READDATA, &context);
   CHECK_CURL(rc);
   SCOPE_EXIT {
-    rc = curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, nullptr);
+    rc = curl_easy_setopt(curl_, CURLOPT_READFUNCTION, nullptr);
+    CHECK_CURL(rc);
+    rc = curl_easy_setopt(curl_, CURLOPT_READDATA, stdin);
     CHECK_CURL(rc);
   };
 
-  rc = curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE, std::size(json));
+  // With unknown size, curl uses chunked transfer encoding for HTTP/1.1
+  rc = curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE_LARGE,
+                        static_cast<curl_off_t>(size < 0 ? -1 : size));
   CHECK_CURL(rc);
   SCOPE_EXIT {
-    rc = curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE, -1);
+    rc = curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE_LARGE,
+                          static_cast<curl_off_t>(-1));
     CHECK_CURL(rc);
   };
 
@@ -386,16 +1992,53 @@ Response Request::RequestImpl::post(
     CHECK_CURL(rc);
   };
 
-  auto headers_copy = headers;
-  headers_copy["Content-Type"] = "application/json";
-  auto chunk = add_header(curl_, headers_copy);
+  auto chunk = add_header(curl_, headers);
   SCOPE_EXIT {
     curl_slist_free_all(chunk);
     rc = curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, nullptr);
     CHECK_CURL(rc);
   };
 
-  return do_easy_perform();
+  // The content has been consumed from the callback, it can not be sent again
+  try {
+    return do_easy_perform({}, false);
+  } catch (...) {
+    if (context.exception) [[unlikely]] {
+      std::rethrow_exception(context.exception);
+    }
+    throw;
+  }
+}
+
+Response Request::RequestImpl::post_file(
+    const std::string &url, const std::string &path,
+    const phmap::flat_hash_map<std::string, std::string> &headers) {
+  auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) [[unlikely]] {
+    throw RuntimeError("Can not open file: '{}'", path);
+  }
+  SCOPE_EXIT { close(fd); };
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1) [[unlikely]] {
+    throw RuntimeError("fstat() failed: {}", std::strerror(errno));
+  }
+
+  return post(
+      url,
+      [fd](char *buffer, std::size_t size) -> std::size_t {
+        while (true) {
+          auto length = read(fd, buffer, size);
+          if (length == -1) [[unlikely]] {
+            if (errno == EINTR) {
+              continue;
+            }
+            throw RuntimeError("read() failed: {}", std::strerror(errno));
+          }
+          return length;
+        }
+      },
+      file_stat.st_size, headers);
 }
 
 Response Request::RequestImpl::post_mime(
@@ -429,38 +2072,256 @@ Response Request::RequestImpl::post_mime(
   return do_easy_perform();
 }
 
-Response Request::RequestImpl::do_easy_perform() {
-  Response response;
+void Request::RequestImpl::set_response_target(CURL *curl, Response &response,
+                                               WriteContext *context) {
+  CURLcode rc;
+  if (context) {
+    rc = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,
+                          callback_func_write_callback);
+    CHECK_CURL(rc);
+    rc = curl_easy_setopt(curl, CURLOPT_WRITEDATA, context);
+  } else {
+    response.text_.reserve(16384);
+    rc = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,
+                          callback_func_std_string);
+    CHECK_CURL(rc);
+    rc = curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response.text_);
+  }
+  CHECK_CURL(rc);
+
+  rc = curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, callback_func_header);
+  CHECK_CURL(rc);
+  rc = curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response.headers_);
+  CHECK_CURL(rc);
+}
+
+void Request::RequestImpl::reset_response_target() {
+  auto rc = curl_easy_setopt(curl_, CURLOPT_WRITEDATA, stdout);
+  CHECK_CURL(rc);
+  rc = curl_easy_setopt(curl_, CURLOPT_HEADERFUNCTION, nullptr);
+  CHECK_CURL(rc);
+  rc = curl_easy_setopt(curl_, CURLOPT_HEADERDATA, nullptr);
+  CHECK_CURL(rc);
+}
+
+CURLcode Request::RequestImpl::easy_perform(Response &response,
+                                            bool streaming, bool replayable) {
+  auto rc = curl_easy_perform(curl_);
+  if (!http3_ || !is_http3_error(rc)) {
+    return rc;
+  }
+  // Nothing has been sent if the QUIC connection could not be established
+  if (rc == CURLE_HTTP3 &&
+      (!replayable || (streaming && content_received(curl_)))) {
+    return rc;
+  }
+
+  warn("HTTP/3 failed, fall back to HTTP/1.1 and HTTP/2: {}",
+       curl_easy_strerror(rc));
+
+  rc = curl_easy_setopt(curl_, CURLOPT_ALTSVC_CTRL,
+                        CURLALTSVC_H1 | CURLALTSVC_H2);
+  CHECK_CURL(rc);
+  SCOPE_EXIT {
+    rc = curl_easy_setopt(curl_, CURLOPT_ALTSVC_CTRL,
+                          CURLALTSVC_H1 | CURLALTSVC_H2 | CURLALTSVC_H3);
+    CHECK_CURL(rc);
+  };
+
+  response.headers_.clear();
+  response.text_.clear();
+  return curl_easy_perform(curl_);
+}
+
+Response Request::RequestImpl::do_easy_perform(const WriteCallback &callback,
+                                               bool replayable) {
+  SCOPE_EXIT { reset_response_target(); };
+
+  std::string host;
+  BandwidthMeter meter;
+  if (rate_limiter_) {
+    host = get_host(curl_);
+    meter.limiter = rate_limiter_.get();
+    set_bandwidth_meter(curl_, &meter);
+  }
+  SCOPE_EXIT {
+    if (meter.limiter) {
+      set_bandwidth_meter(curl_, nullptr);
+    }
+  };
+
+  for (std::int32_t retries = 0;; ++retries) {
+    Response response;
+    WriteContext context = {&callback, {}};
+    set_response_target(curl_, response, callback ? &context : nullptr);
+
+    if (meter.limiter) {
+      meter.transferred = 0;
+      rate_limiter_->acquire(host);
+    }
+    auto rc = easy_perform(response, static_cast<bool>(callback), replayable);
+    if (context.exception) [[unlikely]] {
+      std::rethrow_exception(context.exception);
+    }
+
+    if (replayable && retries < retry_policy_.max_retries) {
+      if (auto delay = retry_delay(rc, static_cast<bool>(callback), retries);
+          delay) {
+        std::this_thread::sleep_for(*delay);
+        continue;
+      }
+    }
+    CHECK_CURL(rc);
+
+    if (use_share_cache_) {
+      ShareCache::get().record(curl_);
+    }
+
+    response.status_ = get_status(curl_);
+    record_transfer(curl_, response, retries);
+
+    return response;
+  }
+}
+
+std::optional<std::chrono::milliseconds> Request::RequestImpl::retry_delay(
+    CURLcode rc, bool streaming, std::int32_t retries) {
+  // The callback has already seen part of the content
+  if (streaming && content_received(curl_)) {
+    return {};
+  }
+
+  if (!retry_policy_.retry_non_idempotent && !is_idempotent(curl_)) {
+    return {};
+  }
+
+  auto delay = backoff_delay(retry_policy_, retries);
+
+  if (rc != CURLE_OK) {
+    if (retry_policy_.retry_on_error && is_transient_error(rc)) {
+      return delay;
+    }
+    return {};
+  }
+
+  if (std::find(std::begin(retry_policy_.retry_status),
+                std::end(retry_policy_.retry_status),
+                get_status(curl_)) == std::end(retry_policy_.retry_status)) {
+    return {};
+  }
+
+  curl_off_t retry_after = 0;
+  rc = curl_easy_getinfo(curl_, CURLINFO_RETRY_AFTER, &retry_after);
+  CHECK_CURL(rc);
+  if (retry_after > 0) {
+    std::chrono::milliseconds after = std::chrono::seconds(retry_after);
+    if (after > retry_policy_.max_delay) {
+      return {};
+    }
+    delay = std::max(delay, after);
+  }
+
+  return delay;
+}
+
+std::optional<std::chrono::microseconds> Request::RequestImpl::hedge_delay()
+    const {
+  if (std::size(latencies_) < min_latency_samples) {
+    return {};
+  }
+
+  auto latencies = latencies_;
+  auto nth = std::begin(latencies) + std::size(latencies) * 95 / 100;
+  std::nth_element(std::begin(latencies), nth, std::end(latencies));
+  return std::chrono::microseconds(*nth);
+}
+
+void Request::RequestImpl::record_latency(std::chrono::microseconds latency) {
+  if (std::size(latencies_) < max_latency_samples) {
+    latencies_.push_back(latency.count());
+  } else {
+    latencies_[latency_index_] = latency.count();
+    latency_index_ = (latency_index_ + 1) % max_latency_samples;
+  }
+}
+
+void Request::RequestImpl::record_transfer(CURL *curl, Response &response,
+                                           std::int32_t retries) {
+  response.transfer_info_ = get_transfer_info(curl);
+  response.transfer_info_.retries = retries;
+
+  if (metrics_) {
+    metrics_->record(response.transfer_info_);
+  }
+}
+
+Response Request::RequestImpl::do_post(
+    const std::string &url, const std::string &content,
+    const phmap::flat_hash_map<std::string, std::string> &headers) {
+  auto rc = curl_easy_setopt(curl_, CURLOPT_HTTPPOST, 1);
+  CHECK_CURL(rc);
+
+  auto headers_copy = headers;
+  std::string compressed;
+  std::string_view body = content;
+  if (request_encoding_ != ContentEncoding::Identity &&
+      std::size(content) >= compression_threshold_) {
+    compressed = compress_content(content, request_encoding_);
+    body = compressed;
+    headers_copy["Content-Encoding"] = content_encoding_str(request_encoding_);
+  }
 
-  auto rc = curl_easy_setopt(curl_, CURLOPT_WRITEDATA, &response.text_);
+  rc = curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, std::data(body));
   CHECK_CURL(rc);
   SCOPE_EXIT {
-    rc = curl_easy_setopt(curl_, CURLOPT_WRITEDATA, stdout);
+    rc = curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, nullptr);
     CHECK_CURL(rc);
   };
 
-  rc = curl_easy_perform(curl_);
+  rc = curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE, std::size(body));
   CHECK_CURL(rc);
+  SCOPE_EXIT {
+    rc = curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE, -1);
+    CHECK_CURL(rc);
+  };
 
-  response.status_ = get_status(curl_);
+  rc = curl_easy_setopt(curl_, CURLOPT_URL, url.c_str());
+  SCOPE_EXIT {
+    rc = curl_easy_setopt(curl_, CURLOPT_URL, nullptr);
+    CHECK_CURL(rc);
+  };
 
-  return response;
+  auto chunk = add_header(curl_, headers_copy);
+  SCOPE_EXIT {
+    curl_slist_free_all(chunk);
+    rc = curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, nullptr);
+    CHECK_CURL(rc);
+  };
+
+  return do_easy_perform();
 }
 
 std::string Request::RequestImpl::splicing_post_fields(
     const phmap::flat_hash_map<std::string, std::string> &data) {
-  std::string result;
-
+  std::size_t max_size = 0;
   for (const auto &[key, value] : data) {
-    result.append(url_encode(key));
-    result.append("=");
-    result.append(url_encode(value));
-    result.append("&");
+    max_size += (std::size(key) + std::size(value)) * 3 + 2;
   }
 
-  if (result.ends_with("&")) {
-    result.pop_back();
+  std::string result;
+  result.resize(max_size);
+
+  auto begin = std::data(result);
+  auto out = begin;
+  for (const auto &[key, value] : data) {
+    if (out != begin) {
+      *out++ = '&';
+    }
+    out = url_encode_to(key, out);
+    *out++ = '=';
+    out = url_encode_to(value, out);
   }
+  result.resize(out - begin);
 
   return result;
 }
@@ -471,6 +2332,18 @@ Request::~Request() = default;
 
 void Request::verbose(bool flag) { impl_->verbose(flag); }
 
+void Request::use_share_cache(bool flag) { impl_->use_share_cache(flag); }
+
+bool Request::http3_supported() {
+  return curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP3;
+}
+
+void Request::enable_http3(bool flag) { impl_->enable_http3(flag); }
+
+ShareStatistics Request::share_statistics() {
+  return ShareCache::get().statistics();
+}
+
 void Request::set_proxy(const std::string &proxy) { impl_->set_proxy(proxy); }
 
 void Request::set_proxy_from_env() { impl_->set_proxy_from_env(); }
@@ -498,6 +2371,23 @@ void Request::set_cookie(
   impl_->set_cookie(cookies);
 }
 
+void Request::set_request_compression(ContentEncoding encoding,
+                                      std::size_t threshold) {
+  impl_->set_request_compression(encoding, threshold);
+}
+
+void Request::set_retry_policy(const RetryPolicy &policy) {
+  impl_->set_retry_policy(policy);
+}
+
+void Request::set_metrics(std::shared_ptr<HttpMetrics> metrics) {
+  impl_->set_metrics(std::move(metrics));
+}
+
+void Request::set_rate_limiter(std::shared_ptr<RateLimiter> limiter) {
+  impl_->set_rate_limiter(std::move(limiter));
+}
+
 void Request::basic_auth(const std::string &user_name,
                          const std::string &password) {
   impl_->basic_auth(user_name, password);
@@ -509,6 +2399,56 @@ Response Request::get(
   return impl_->get(url, header);
 }
 
+Response Request::get_hedged(
+    const std::string &url,
+    const phmap::flat_hash_map<std::string, std::string> &header,
+    std::chrono::milliseconds delay) {
+  return impl_->get_hedged(url, header, delay);
+}
+
+Response Request::get_stream(
+    const std::string &url, const WriteCallback &callback,
+    const phmap::flat_hash_map<std::string, std::string> &header) {
+  return impl_->get(url, header, callback);
+}
+
+Response Request::download(
+    const std::string &url, const std::string &path,
+    const phmap::flat_hash_map<std::string, std::string> &header) {
+  return impl_->download(url, path, header);
+}
+
+Response Request::download_segmented(
+    const std::string &url, const std::string &path, std::int32_t segments,
+    const std::string &sha256,
+    const phmap::flat_hash_map<std::string, std::string> &header) {
+  return impl_->download_segmented(url, path, segments, sha256, header);
+}
+
+Response Request::get_if_none_match(
+    const std::string &url, const std::string &etag,
+    const phmap::flat_hash_map<std::string, std::string> &header) {
+  return impl_->get_if_none_match(url, etag, header);
+}
+
+Response Request::get_if_modified_since(
+    const std::string &url, const std::string &last_modified,
+    const phmap::flat_hash_map<std::string, std::string> &header) {
+  return impl_->get_if_modified_since(url, last_modified, header);
+}
+
+Response Request::get_range(
+    const std::string &url, std::int64_t begin, std::int64_t end,
+    const phmap::flat_hash_map<std::string, std::string> &header) {
+  return impl_->get_range(url, begin, end, header);
+}
+
+Response Request::resume_download(
+    const std::string &url, const std::string &path,
+    const phmap::flat_hash_map<std::string, std::string> &header) {
+  return impl_->resume_download(url, path, header);
+}
+
 Response Request::post(
     const std::string &url,
     const phmap::flat_hash_map<std::string, std::string> &data,
@@ -522,6 +2462,18 @@ Response Request::post(
   return impl_->post(url, json, header);
 }
 
+Response Request::post_stream(
+    const std::string &url, const ReadCallback &callback, std::int64_t size,
+    const phmap::flat_hash_map<std::string, std::string> &header) {
+  return impl_->post(url, callback, size, header);
+}
+
+Response Request::post_file(
+    const std::string &url, const std::string &path,
+    const phmap::flat_hash_map<std::string, std::string> &header) {
+  return impl_->post_file(url, path, header);
+}
+
 Response Request::post_mime(
     const std::string &url,
     const phmap::flat_hash_map<std::string, std::string> &data,
@@ -530,13 +2482,33 @@ Response Request::post_mime(
   return impl_->post_mime(url, data, file, header);
 }
 
-Response::Response() { text_.reserve(16384); }
+Response::Response() = default;
 
 HttpStatus Response::status() const { return status_; }
 
 bool Response::ok() const { return status_ == HttpStatus::HTTP_STATUS_OK; }
 
-std::string Response::text() const { return text_; }
+const phmap::flat_hash_map<std::string, std::string> &Response::headers()
+    const {
+  return headers_;
+}
+
+std::optional<std::string> Response::header(std::string_view name) const {
+  std::string key(name);
+  std::transform(std::begin(key), std::end(key), std::begin(key),
+                 [](unsigned char c) { return std::tolower(c); });
+
+  if (auto iter = headers_.find(key); iter != std::end(headers_)) {
+    return iter->second;
+  }
+  return {};
+}
+
+const std::string &Response::text() const & { return text_; }
+
+std::string Response::text() && { return std::move(text_); }
+
+const TransferInfo &Response::transfer_info() const { return transfer_info_; }
 
 void Response::save_to_file(const std::string &path) const {
   write_file(path, true, text_);
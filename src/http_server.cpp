@@ -0,0 +1,1509 @@
+/**
+ * @see https://nghttp2.org/documentation/tutorial-server.html
+ * @see https://man7.org/linux/man-pages/man7/epoll.7.html
+ */
+
+#include "klib/http_server.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <limits>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <nghttp2/nghttp2.h>
+#include <scope_guard.hpp>
+
+#include "klib/exception.h"
+#include "klib/log.h"
+#include "klib/url.h"
+
+namespace klib {
+
+namespace {
+
+constexpr std::string_view http2_preface = NGHTTP2_CLIENT_MAGIC;
+constexpr std::size_t max_header_size = 64 * 1024;
+
+std::string to_lower(std::string_view str) {
+  std::string result(str);
+  std::transform(std::begin(result), std::end(result), std::begin(result),
+                 [](unsigned char c) { return std::tolower(c); });
+  return result;
+}
+
+std::string_view trim(std::string_view str) {
+  auto is_space = [](char c) { return c == ' ' || c == '\t'; };
+  while (!std::empty(str) && is_space(str.front())) {
+    str.remove_prefix(1);
+  }
+  while (!std::empty(str) && is_space(str.back())) {
+    str.remove_suffix(1);
+  }
+  return str;
+}
+
+void add_header(phmap::flat_hash_map<std::string, std::string> &headers,
+                std::string_view name, std::string_view value) {
+  auto [iter, inserted] = headers.try_emplace(to_lower(name), value);
+  if (!inserted) {
+    iter->second.append(", ").append(value);
+  }
+}
+
+std::optional<HttpMethod> parse_method(std::string_view str) {
+  static const auto methods = [] {
+    phmap::flat_hash_map<std::string, HttpMethod> result;
+    for (std::int32_t i = 0;
+         i <= static_cast<std::int32_t>(HttpMethod::HTTP_METHOD_SOURCE); ++i) {
+      auto method = static_cast<HttpMethod>(i);
+      result.emplace(http_method_str(method), method);
+    }
+    return result;
+  }();
+
+  if (auto iter = methods.find(str); iter != std::end(methods)) {
+    return iter->second;
+  }
+  return {};
+}
+
+std::string_view content_type(const std::filesystem::path &path) {
+  static const phmap::flat_hash_map<std::string, std::string_view> types = {
+      {".html", "text/html; charset=utf-8"},
+      {".htm", "text/html; charset=utf-8"},
+      {".css", "text/css; charset=utf-8"},
+      {".js", "text/javascript; charset=utf-8"},
+      {".json", "application/json"},
+      {".txt", "text/plain; charset=utf-8"},
+      {".xml", "application/xml"},
+      {".svg", "image/svg+xml"},
+      {".png", "image/png"},
+      {".jpg", "image/jpeg"},
+      {".jpeg", "image/jpeg"},
+      {".gif", "image/gif"},
+      {".webp", "image/webp"},
+      {".ico", "image/x-icon"},
+      {".ttf", "font/ttf"},
+      {".otf", "font/otf"},
+      {".woff", "font/woff"},
+      {".woff2", "font/woff2"},
+      {".wasm", "application/wasm"},
+      {".pdf", "application/pdf"},
+      {".zip", "application/zip"},
+      {".gz", "application/gzip"},
+      {".zst", "application/zstd"},
+      {".br", "application/x-brotli"},
+      {".7z", "application/x-7z-compressed"},
+      {".tar", "application/x-tar"}};
+
+  if (auto iter = types.find(to_lower(path.extension().string()));
+      iter != std::end(types)) {
+    return iter->second;
+  }
+  return "application/octet-stream";
+}
+
+void set_error(ServerResponse &response, HttpStatus status) {
+  response.status = status;
+  response.headers = {{"Content-Type", "text/plain; charset=utf-8"}};
+  response.body = http_status_str(status);
+  response.file.clear();
+}
+
+bool keep_alive_by_default(std::string_view version) {
+  return version != "HTTP/1.0";
+}
+
+class File {
+ public:
+  explicit File(int fd) : fd_(fd) {}
+
+  File(const File &) = delete;
+  File &operator=(const File &) = delete;
+
+  ~File() { close(fd_); }
+
+  [[nodiscard]] int fd() const { return fd_; }
+
+ private:
+  int fd_;
+};
+
+/**
+ * @brief Response content ready to be sent, the file range is sent after data
+ */
+struct Body {
+  Body() = default;
+
+  explicit Body(std::string data) : data(std::move(data)) {}
+
+  Body(std::shared_ptr<File> file, std::int64_t offset, std::int64_t length)
+      : file(std::move(file)), offset(offset), length(length) {}
+
+  std::string data;
+  std::shared_ptr<File> file;
+  std::int64_t offset = 0;
+  std::int64_t length = 0;
+
+  [[nodiscard]] std::int64_t size() const {
+    return static_cast<std::int64_t>(std::size(data)) + length;
+  }
+};
+
+/**
+ * @brief Parse a single byte range of the Range header
+ * @return The first and last byte offset, or std::nullopt if unsatisfiable
+ */
+std::optional<std::pair<std::int64_t, std::int64_t>> parse_range(
+    std::string_view range, std::int64_t size) {
+  if (!range.starts_with("bytes=") || range.find(',') != std::string::npos ||
+      size == 0) {
+    return {};
+  }
+  range.remove_prefix(6);
+
+  auto dash = range.find('-');
+  if (dash == std::string_view::npos) {
+    return {};
+  }
+
+  auto to_int = [](std::string_view str, std::int64_t &value) {
+    auto [ptr, ec] =
+        std::from_chars(std::data(str), std::data(str) + std::size(str), value);
+    return ec == std::errc{} && ptr == std::data(str) + std::size(str);
+  };
+
+  auto first_str = trim(range.substr(0, dash));
+  auto last_str = trim(range.substr(dash + 1));
+  std::int64_t first = 0;
+  std::int64_t last = size - 1;
+
+  if (std::empty(first_str)) {
+    std::int64_t suffix;
+    if (!to_int(last_str, suffix) || suffix <= 0) {
+      return {};
+    }
+    first = std::max<std::int64_t>(size - suffix, 0);
+  } else {
+    if (!to_int(first_str, first) || first >= size) {
+      return {};
+    }
+    if (!std::empty(last_str)) {
+      if (!to_int(last_str, last) || last < first) {
+        return {};
+      }
+      last = std::min(last, size - 1);
+    }
+  }
+
+  return std::pair{first, last};
+}
+
+class Router {
+ public:
+  void route(HttpMethod method, const std::string &path,
+             const RequestHandler &handler) {
+    routes_.insert_or_assign(route_key(method, path), handler);
+  }
+
+  void mount(const std::string &prefix, const std::string &dir) {
+    mounts_.emplace_back(prefix, std::filesystem::path(dir));
+    std::sort(std::begin(mounts_), std::end(mounts_),
+              [](const auto &lhs, const auto &rhs) {
+                return std::size(lhs.first) > std::size(rhs.first);
+              });
+  }
+
+  void set_max_body_size(std::size_t size) { max_body_size_ = size; }
+
+  [[nodiscard]] std::size_t max_body_size() const { return max_body_size_; }
+
+  /**
+   * @brief Run the handler, then turn the response into the content to send
+   */
+  Body dispatch(const ServerRequest &request, ServerResponse &response) const {
+    auto iter = routes_.find(route_key(request.method, request.path));
+    if (iter == std::end(routes_) &&
+        request.method == HttpMethod::HTTP_METHOD_HEAD) {
+      iter = routes_.find(route_key(HttpMethod::HTTP_METHOD_GET, request.path));
+    }
+
+    if (iter != std::end(routes_)) {
+      try {
+        iter->second(request, response);
+      } catch (const std::exception &err) {
+        warn("Request handler of '{}' failed: {}", request.path, err.what());
+        set_error(response, HttpStatus::HTTP_STATUS_INTERNAL_SERVER_ERROR);
+      } catch (...) {
+        warn("Request handler of '{}' failed", request.path);
+        set_error(response, HttpStatus::HTTP_STATUS_INTERNAL_SERVER_ERROR);
+      }
+    } else if (!serve_file(request, response)) {
+      set_error(response, HttpStatus::HTTP_STATUS_NOT_FOUND);
+    }
+
+    if (std::empty(response.file)) {
+      return Body(std::move(response.body));
+    }
+    return open_file(request, response);
+  }
+
+ private:
+  static std::string route_key(HttpMethod method, const std::string &path) {
+    return http_method_str(method) + ' ' + path;
+  }
+
+  bool serve_file(const ServerRequest &request,
+                  ServerResponse &response) const {
+    if (request.method != HttpMethod::HTTP_METHOD_GET &&
+        request.method != HttpMethod::HTTP_METHOD_HEAD) {
+      return false;
+    }
+
+    for (const auto &[prefix, dir] : mounts_) {
+      if (!request.path.starts_with(prefix)) {
+        continue;
+      }
+      std::string_view rest = request.path;
+      rest.remove_prefix(std::size(prefix));
+      if (!prefix.ends_with('/') && !std::empty(rest) && rest.front() != '/') {
+        continue;
+      }
+
+      while (!std::empty(rest) && rest.front() == '/') {
+        rest.remove_prefix(1);
+      }
+      auto relative = std::filesystem::path(rest).lexically_normal();
+      if (!std::empty(relative) && *std::begin(relative) == "..") {
+        set_error(response, HttpStatus::HTTP_STATUS_FORBIDDEN);
+        return true;
+      }
+
+      auto path = dir / relative;
+      std::error_code ec;
+      if (std::filesystem::is_directory(path, ec)) {
+        path /= "index.html";
+      }
+      if (!std::filesystem::is_regular_file(path, ec)) {
+        set_error(response, HttpStatus::HTTP_STATUS_NOT_FOUND);
+        return true;
+      }
+
+      response.headers.insert_or_assign("Content-Type",
+                                        std::string(content_type(path)));
+      response.headers.insert_or_assign("Accept-Ranges", "bytes");
+      response.file = path.string();
+      return true;
+    }
+
+    return false;
+  }
+
+  static Body open_file(const ServerRequest &request,
+                        ServerResponse &response) {
+    auto fd = open(response.file.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) [[unlikely]] {
+      if (fd != -1) {
+        close(fd);
+      }
+      set_error(response, HttpStatus::HTTP_STATUS_NOT_FOUND);
+      return Body(std::move(response.body));
+    }
+
+    Body body(std::make_shared<File>(fd), 0, st.st_size);
+
+    auto range = request.header("Range");
+    if (!range || response.status != HttpStatus::HTTP_STATUS_OK) {
+      return body;
+    }
+
+    auto bytes = parse_range(*range, st.st_size);
+    if (!bytes) {
+      set_error(response, HttpStatus::HTTP_STATUS_RANGE_NOT_SATISFIABLE);
+      response.headers.emplace("Content-Range",
+                               "bytes */" + std::to_string(st.st_size));
+      return Body(std::move(response.body));
+    }
+
+    auto [first, last] = *bytes;
+    response.status = HttpStatus::HTTP_STATUS_PARTIAL_CONTENT;
+    response.headers.insert_or_assign(
+        "Content-Range", "bytes " + std::to_string(first) + '-' +
+                             std::to_string(last) + '/' +
+                             std::to_string(st.st_size));
+    body.offset = first;
+    body.length = last - first + 1;
+    return body;
+  }
+
+  phmap::flat_hash_map<std::string, RequestHandler> routes_;
+  std::vector<std::pair<std::string, std::filesystem::path>> mounts_;
+  std::size_t max_body_size_ = 64 * 1024 * 1024;
+};
+
+/**
+ * @brief A client connection, speaks HTTP/1.1 until it sees the HTTP/2
+ * connection preface
+ */
+class Connection {
+ public:
+  Connection(int fd, const Router &router) : fd_(fd), router_(router) {}
+
+  Connection(const Connection &) = delete;
+  Connection &operator=(const Connection &) = delete;
+
+  ~Connection() {
+    nghttp2_session_del(session_);
+    close(fd_);
+  }
+
+  /**
+   * @return False if the connection should be closed
+   */
+  bool on_readable();
+
+  /**
+   * @return False if the connection should be closed
+   */
+  bool on_writable() { return flush(); }
+
+  [[nodiscard]] bool want_read() const { return !read_closed_; }
+
+  [[nodiscard]] bool want_write() const { return !std::empty(out_); }
+
+ private:
+  struct Stream {
+    ServerRequest request;
+    bool bad_request = false;
+    bool too_large = false;
+    Body body;
+    std::size_t data_offset = 0;
+  };
+
+  bool process_http1();
+  bool process_http1_request(std::string_view head, std::size_t head_size);
+  std::optional<std::size_t> parse_chunked(std::size_t begin);
+
+  void queue_response(const ServerRequest &request, ServerResponse &response,
+                      Body body, bool keep_alive);
+  void queue_error(HttpStatus status);
+
+  bool start_http2();
+  void submit_http2_response(std::int32_t stream_id, Stream &stream);
+
+  void queue(std::string_view data);
+  bool flush();
+
+  static ssize_t on_send(nghttp2_session *, const std::uint8_t *data,
+                         std::size_t length, int, void *user_data);
+  static int on_send_data(nghttp2_session *, nghttp2_frame *frame,
+                          const std::uint8_t *framehd, std::size_t length,
+                          nghttp2_data_source *source, void *user_data);
+  static ssize_t on_read_data(nghttp2_session *, std::int32_t,
+                              std::uint8_t *buf, std::size_t length,
+                              std::uint32_t *data_flags,
+                              nghttp2_data_source *source, void *);
+  static int on_begin_headers(nghttp2_session *, const nghttp2_frame *frame,
+                              void *user_data);
+  static int on_header(nghttp2_session *, const nghttp2_frame *frame,
+                       const std::uint8_t *name, std::size_t name_length,
+                       const std::uint8_t *value, std::size_t value_length,
+                       std::uint8_t, void *user_data);
+  static int on_data_chunk_recv(nghttp2_session *, std::uint8_t,
+                                std::int32_t stream_id,
+                                const std::uint8_t *data, std::size_t length,
+                                void *user_data);
+  static int on_frame_recv(nghttp2_session *, const nghttp2_frame *frame,
+                           void *user_data);
+  static int on_stream_close(nghttp2_session *, std::int32_t stream_id,
+                             std::uint32_t, void *user_data);
+
+  int fd_;
+  const Router &router_;
+
+  std::string in_;
+  // Content of the chunks already removed from in_
+  std::string chunked_body_;
+  bool continue_sent_ = false;
+  bool close_after_write_ = false;
+  // The client has shut down its sending side, the responses to what it has
+  // sent are still written
+  bool read_closed_ = false;
+  std::int64_t requests_ = 0;
+
+  std::deque<Body> out_;
+  std::size_t out_data_offset_ = 0;
+
+  nghttp2_session *session_ = nullptr;
+  phmap::flat_hash_map<std::int32_t, std::unique_ptr<Stream>> streams_;
+};
+
+bool Connection::on_readable() {
+  std::array<char, 65536> buffer;
+
+  while (!read_closed_) {
+    auto size = read(fd_, std::data(buffer), std::size(buffer));
+    if (size == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return false;
+    }
+    if (size == 0) {
+      read_closed_ = true;
+      break;
+    }
+
+    if (session_) {
+      auto rc = nghttp2_session_mem_recv(
+          session_, reinterpret_cast<const std::uint8_t *>(std::data(buffer)),
+          size);
+      if (rc < 0) {
+        return false;
+      }
+    } else if (!close_after_write_) {
+      in_.append(std::data(buffer), size);
+      if (!process_http1()) {
+        return false;
+      }
+    }
+  }
+
+  return flush();
+}
+
+bool Connection::process_http1() {
+  while (!close_after_write_) {
+    if (requests_ == 0 &&
+        http2_preface.starts_with(std::string_view(in_).substr(
+            0, std::min(std::size(in_), std::size(http2_preface))))) {
+      if (std::size(in_) < std::size(http2_preface)) {
+        return true;
+      }
+      return start_http2();
+    }
+
+    auto head_end = in_.find("\r\n\r\n");
+    if (head_end == std::string::npos) {
+      if (std::size(in_) > max_header_size) {
+        queue_error(HttpStatus::HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE);
+      }
+      return true;
+    }
+
+    auto head_size = head_end + 4;
+    if (!process_http1_request(std::string_view(in_).substr(0, head_end),
+                               head_size)) {
+      return true;
+    }
+  }
+
+  return true;
+}
+
+bool Connection::process_http1_request(std::string_view head,
+                                       std::size_t head_size) {
+  auto line_end = head.find("\r\n");
+  auto request_line = head.substr(0, line_end);
+  head = line_end == std::string_view::npos ? std::string_view()
+                                            : head.substr(line_end + 2);
+
+  auto first_space = request_line.find(' ');
+  auto last_space = request_line.rfind(' ');
+  if (first_space == std::string_view::npos || first_space == last_space) {
+    queue_error(HttpStatus::HTTP_STATUS_BAD_REQUEST);
+    return false;
+  }
+
+  auto method_str = request_line.substr(0, first_space);
+  auto target =
+      request_line.substr(first_space + 1, last_space - first_space - 1);
+  auto version = request_line.substr(last_space + 1);
+  if (version != "HTTP/1.1" && version != "HTTP/1.0") {
+    queue_error(HttpStatus::HTTP_STATUS_HTTP_VERSION_NOT_SUPPORTED);
+    return false;
+  }
+
+  auto method = parse_method(method_str);
+  if (!method) {
+    queue_error(HttpStatus::HTTP_STATUS_NOT_IMPLEMENTED);
+    return false;
+  }
+  if (!target.starts_with('/')) {
+    queue_error(HttpStatus::HTTP_STATUS_BAD_REQUEST);
+    return false;
+  }
+
+  ServerRequest request;
+  request.method = *method;
+
+  while (!std::empty(head)) {
+    line_end = head.find("\r\n");
+    auto line = head.substr(0, line_end);
+    head = line_end == std::string_view::npos ? std::string_view()
+                                              : head.substr(line_end + 2);
+
+    auto colon = line.find(':');
+    if (colon == std::string_view::npos || colon == 0) {
+      queue_error(HttpStatus::HTTP_STATUS_BAD_REQUEST);
+      return false;
+    }
+    add_header(request.headers, line.substr(0, colon),
+               trim(line.substr(colon + 1)));
+  }
+
+  std::size_t request_size = head_size;
+  if (auto encoding = request.header("Transfer-Encoding"); encoding) {
+    if (to_lower(*encoding) != "chunked") {
+      queue_error(HttpStatus::HTTP_STATUS_NOT_IMPLEMENTED);
+      return false;
+    }
+    auto end = parse_chunked(head_size);
+    if (!end) {
+      if (close_after_write_) {
+        return false;
+      }
+      if (!continue_sent_ && request.header("Expect")) {
+        queue("HTTP/1.1 100 Continue\r\n\r\n");
+        continue_sent_ = true;
+      }
+      return false;
+    }
+    request.body = std::move(chunked_body_);
+    chunked_body_.clear();
+    request_size = *end;
+  } else if (auto length_str = request.header("Content-Length"); length_str) {
+    std::size_t length;
+    auto [ptr, ec] = std::from_chars(
+        std::data(*length_str), std::data(*length_str) + std::size(*length_str),
+        length);
+    if (ec != std::errc{} ||
+        ptr != std::data(*length_str) + std::size(*length_str)) {
+      queue_error(HttpStatus::HTTP_STATUS_BAD_REQUEST);
+      return false;
+    }
+    if (length > router_.max_body_size()) {
+      queue_error(HttpStatus::HTTP_STATUS_PAYLOAD_TOO_LARGE);
+      return false;
+    }
+    if (std::size(in_) - head_size < length) {
+      if (!continue_sent_ && request.header("Expect")) {
+        queue("HTTP/1.1 100 Continue\r\n\r\n");
+        continue_sent_ = true;
+      }
+      return false;
+    }
+    request.body = in_.substr(head_size, length);
+    request_size += length;
+  }
+
+  auto query_begin = target.find('?');
+  if (query_begin != std::string_view::npos) {
+    request.query = target.substr(query_begin + 1);
+    target = target.substr(0, query_begin);
+  }
+  request.path = url_decode(target);
+
+  auto connection = to_lower(request.header("Connection").value_or(""));
+  auto keep_alive = keep_alive_by_default(version)
+                        ? connection.find("close") == std::string::npos
+                        : connection.find("keep-alive") != std::string::npos;
+
+  in_.erase(0, request_size);
+  continue_sent_ = false;
+  ++requests_;
+
+  ServerResponse response;
+  auto body = router_.dispatch(request, response);
+  queue_response(request, response, std::move(body), keep_alive);
+
+  return true;
+}
+
+/**
+ * @brief Move the complete chunks to chunked_body_ and remove them from in_,
+ * so that at most one chunk is buffered
+ * @return The end of the chunked content, or std::nullopt if it is incomplete
+ * or an error has been queued
+ */
+std::optional<std::size_t> Connection::parse_chunked(std::size_t begin) {
+  auto consumed = begin;
+  SCOPE_EXIT { in_.erase(begin, consumed - begin); };
+
+  while (true) {
+    auto line_end = in_.find("\r\n", consumed);
+    if (line_end == std::string::npos) {
+      if (std::size(in_) - consumed > max_header_size) {
+        queue_error(HttpStatus::HTTP_STATUS_BAD_REQUEST);
+      }
+      return {};
+    }
+
+    // Chunk extensions after the size are ignored
+    std::size_t chunk_size;
+    auto [ptr, ec] = std::from_chars(std::data(in_) + consumed,
+                                     std::data(in_) + line_end, chunk_size, 16);
+    if (ec != std::errc{}) {
+      queue_error(HttpStatus::HTTP_STATUS_BAD_REQUEST);
+      return {};
+    }
+    auto pos = line_end + 2;
+
+    if (chunk_size == 0) {
+      auto trailer_end = in_.find("\r\n", pos);
+      while (trailer_end != std::string::npos && trailer_end != pos) {
+        pos = trailer_end + 2;
+        trailer_end = in_.find("\r\n", pos);
+      }
+      if (trailer_end == std::string::npos) {
+        if (std::size(in_) - consumed > max_header_size) {
+          queue_error(HttpStatus::HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE);
+        }
+        return {};
+      }
+      // Relative to in_ after the consumed chunks are removed
+      return trailer_end + 2 - (consumed - begin);
+    }
+
+    if (chunk_size > router_.max_body_size() - std::size(chunked_body_)) {
+      queue_error(HttpStatus::HTTP_STATUS_PAYLOAD_TOO_LARGE);
+      return {};
+    }
+    auto available = std::size(in_) - pos;
+    if (available < chunk_size || available - chunk_size < 2) {
+      return {};
+    }
+    if (in_.compare(pos + chunk_size, 2, "\r\n") != 0) {
+      queue_error(HttpStatus::HTTP_STATUS_BAD_REQUEST);
+      return {};
+    }
+
+    chunked_body_.append(in_, pos, chunk_size);
+    consumed = pos + chunk_size + 2;
+  }
+}
+
+void Connection::queue_response(const ServerRequest &request,
+                                 ServerResponse &response, Body body,
+                                 bool keep_alive) {
+  auto code = static_cast<std::int32_t>(response.status);
+
+  std::string head = "HTTP/1.1 " + std::to_string(code) + ' ' +
+                     http_status_str(response.status) + "\r\n";
+  for (const auto &[name, value] : response.headers) {
+    auto lower = to_lower(name);
+    if (lower == "content-length" || lower == "connection" ||
+        lower == "transfer-encoding") {
+      continue;
+    }
+    head.append(name).append(": ").append(value).append("\r\n");
+  }
+  head.append("Content-Length: ")
+      .append(std::to_string(body.size()))
+      .append("\r\n");
+  head.append(keep_alive ? "Connection: keep-alive\r\n"
+                         : "Connection: close\r\n");
+  head.append("\r\n");
+
+  if (request.method == HttpMethod::HTTP_METHOD_HEAD) {
+    body = Body{};
+  }
+  body.data.insert(0, head);
+  out_.push_back(std::move(body));
+
+  if (!keep_alive) {
+    close_after_write_ = true;
+  }
+}
+
+void Connection::queue_error(HttpStatus status) {
+  ServerRequest request;
+  ServerResponse response;
+  set_error(response, status);
+  queue_response(request, response, Body(std::move(response.body)),
+                 false);
+}
+
+void Connection::queue(std::string_view data) {
+  if (std::empty(out_) || out_.back().file) {
+    out_.emplace_back();
+  }
+  out_.back().data.append(data);
+}
+
+bool Connection::flush() {
+  while (true) {
+    while (!std::empty(out_)) {
+      auto &body = out_.front();
+
+      if (out_data_offset_ < std::size(body.data)) {
+        auto size = send(fd_, std::data(body.data) + out_data_offset_,
+                         std::size(body.data) - out_data_offset_, MSG_NOSIGNAL);
+        if (size == -1) {
+          if (errno == EINTR) {
+            continue;
+          }
+          return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        out_data_offset_ += size;
+        continue;
+      }
+
+      if (body.length > 0) {
+        off_t offset = body.offset;
+        auto size = sendfile(fd_, body.file->fd(), &offset,
+                             std::min<std::int64_t>(body.length, 1 << 30));
+        if (size == -1) {
+          if (errno == EINTR) {
+            continue;
+          }
+          return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (size == 0) [[unlikely]] {
+          // The file was truncated, the promised length can not be sent
+          return false;
+        }
+        body.offset += size;
+        body.length -= size;
+        continue;
+      }
+
+      out_.pop_front();
+      out_data_offset_ = 0;
+    }
+
+    if (!session_) {
+      return !close_after_write_ && !read_closed_;
+    }
+
+    // Only ask nghttp2 for more frames once the previous ones are written, so
+    // that a slow client does not make the queue grow without bound
+    if (nghttp2_session_send(session_) != 0) {
+      return false;
+    }
+    if (std::empty(out_)) {
+      return !read_closed_ && (nghttp2_session_want_read(session_) ||
+                               nghttp2_session_want_write(session_));
+    }
+  }
+}
+
+bool Connection::start_http2() {
+  nghttp2_session_callbacks *callbacks;
+  if (nghttp2_session_callbacks_new(&callbacks) != 0) [[unlikely]] {
+    return false;
+  }
+  SCOPE_EXIT { nghttp2_session_callbacks_del(callbacks); };
+
+  nghttp2_session_callbacks_set_send_callback(callbacks, on_send);
+  nghttp2_session_callbacks_set_send_data_callback(callbacks, on_send_data);
+  nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks,
+                                                          on_begin_headers);
+  nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(
+      callbacks, on_data_chunk_recv);
+  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks,
+                                                       on_frame_recv);
+  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks,
+                                                         on_stream_close);
+
+  if (nghttp2_session_server_new(&session_, callbacks, this) != 0)
+      [[unlikely]] {
+    return false;
+  }
+
+  std::array<nghttp2_settings_entry, 1> settings = {
+      {{NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 128}}};
+  if (nghttp2_submit_settings(session_, NGHTTP2_FLAG_NONE, std::data(settings),
+                              std::size(settings)) != 0) [[unlikely]] {
+    return false;
+  }
+
+  auto rc = nghttp2_session_mem_recv(
+      session_, reinterpret_cast<const std::uint8_t *>(std::data(in_)),
+      std::size(in_));
+  in_.clear();
+  in_.shrink_to_fit();
+
+  return rc >= 0;
+}
+
+void Connection::submit_http2_response(std::int32_t stream_id,
+                                       Stream &stream) {
+  ServerResponse response;
+  if (stream.bad_request) {
+    set_error(response, HttpStatus::HTTP_STATUS_BAD_REQUEST);
+    stream.body = Body(std::move(response.body));
+  } else if (stream.too_large) {
+    set_error(response, HttpStatus::HTTP_STATUS_PAYLOAD_TOO_LARGE);
+    stream.body = Body(std::move(response.body));
+  } else {
+    stream.body = router_.dispatch(stream.request, response);
+  }
+
+  auto status = std::to_string(static_cast<std::int32_t>(response.status));
+  auto content_length = std::to_string(stream.body.size());
+
+  std::vector<std::pair<std::string, std::string>> headers;
+  headers.reserve(std::size(response.headers));
+  for (const auto &[name, value] : response.headers) {
+    auto lower = to_lower(name);
+    if (lower == "content-length" || lower == "connection" ||
+        lower == "transfer-encoding" || lower == "keep-alive") {
+      continue;
+    }
+    headers.emplace_back(std::move(lower), value);
+  }
+
+  auto make_nv = [](std::string_view name, std::string_view value) {
+    return nghttp2_nv{
+        reinterpret_cast<std::uint8_t *>(const_cast<char *>(std::data(name))),
+        reinterpret_cast<std::uint8_t *>(const_cast<char *>(std::data(value))),
+        std::size(name), std::size(value), NGHTTP2_NV_FLAG_NONE};
+  };
+
+  std::vector<nghttp2_nv> nva;
+  nva.reserve(std::size(headers) + 2);
+  nva.push_back(make_nv(":status", status));
+  nva.push_back(make_nv("content-length", content_length));
+  for (const auto &[name, value] : headers) {
+    nva.push_back(make_nv(name, value));
+  }
+
+  if (stream.request.method == HttpMethod::HTTP_METHOD_HEAD ||
+      stream.body.size() == 0) {
+    nghttp2_submit_response(session_, stream_id, std::data(nva), std::size(nva),
+                            nullptr);
+    return;
+  }
+
+  nghttp2_data_provider provider;
+  provider.source.ptr = &stream;
+  provider.read_callback = on_read_data;
+  nghttp2_submit_response(session_, stream_id, std::data(nva), std::size(nva),
+                          &provider);
+}
+
+ssize_t Connection::on_send(nghttp2_session *, const std::uint8_t *data,
+                            std::size_t length, int, void *user_data) {
+  auto connection = static_cast<Connection *>(user_data);
+  connection->queue(
+      std::string_view(reinterpret_cast<const char *>(data), length));
+  return static_cast<ssize_t>(length);
+}
+
+int Connection::on_send_data(nghttp2_session *, nghttp2_frame *frame,
+                             const std::uint8_t *framehd, std::size_t length,
+                             nghttp2_data_source *source, void *user_data) {
+  auto connection = static_cast<Connection *>(user_data);
+  auto stream = static_cast<Stream *>(source->ptr);
+  auto &body = stream->body;
+
+  std::string head(reinterpret_cast<const char *>(framehd), 9);
+  if (frame->data.padlen > 0) {
+    head.push_back(static_cast<char>(frame->data.padlen - 1));
+  }
+  connection->queue(head);
+
+  // Queue a reference to the file range, it is sent with sendfile() later
+  connection->out_.push_back(
+      Body(body.file, body.offset, static_cast<std::int64_t>(length)));
+  body.offset += static_cast<std::int64_t>(length);
+
+  if (frame->data.padlen > 1) {
+    connection->queue(std::string(frame->data.padlen - 1, '\0'));
+  }
+
+  return 0;
+}
+
+ssize_t Connection::on_read_data(nghttp2_session *, std::int32_t,
+                                 std::uint8_t *buf, std::size_t length,
+                                 std::uint32_t *data_flags,
+                                 nghttp2_data_source *source, void *) {
+  auto stream = static_cast<Stream *>(source->ptr);
+  auto &body = stream->body;
+
+  if (stream->data_offset < std::size(body.data)) {
+    auto size = std::min(length, std::size(body.data) - stream->data_offset);
+    std::memcpy(buf, std::data(body.data) + stream->data_offset, size);
+    stream->data_offset += size;
+    if (stream->data_offset == std::size(body.data) && body.length == 0) {
+      *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return static_cast<ssize_t>(size);
+  }
+
+  auto size = std::min<std::int64_t>(static_cast<std::int64_t>(length),
+                                     body.length);
+  body.length -= size;
+  *data_flags |= NGHTTP2_DATA_FLAG_NO_COPY;
+  if (body.length == 0) {
+    *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+  }
+  return static_cast<ssize_t>(size);
+}
+
+int Connection::on_begin_headers(nghttp2_session *, const nghttp2_frame *frame,
+                                 void *user_data) {
+  if (frame->hd.type != NGHTTP2_HEADERS ||
+      frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+    return 0;
+  }
+
+  auto connection = static_cast<Connection *>(user_data);
+  connection->streams_.insert_or_assign(frame->hd.stream_id,
+                                        std::make_unique<Stream>());
+  return 0;
+}
+
+int Connection::on_header(nghttp2_session *, const nghttp2_frame *frame,
+                          const std::uint8_t *name, std::size_t name_length,
+                          const std::uint8_t *value, std::size_t value_length,
+                          std::uint8_t, void *user_data) {
+  auto connection = static_cast<Connection *>(user_data);
+  auto iter = connection->streams_.find(frame->hd.stream_id);
+  if (iter == std::end(connection->streams_)) {
+    return 0;
+  }
+  auto &stream = *iter->second;
+
+  std::string_view name_str(reinterpret_cast<const char *>(name), name_length);
+  std::string_view value_str(reinterpret_cast<const char *>(value),
+                             value_length);
+
+  if (name_str == ":method") {
+    if (auto method = parse_method(value_str); method) {
+      stream.request.method = *method;
+    } else {
+      stream.bad_request = true;
+    }
+  } else if (name_str == ":path") {
+    auto query_begin = value_str.find('?');
+    if (query_begin != std::string_view::npos) {
+      stream.request.query = value_str.substr(query_begin + 1);
+      value_str = value_str.substr(0, query_begin);
+    }
+    stream.request.path = url_decode(value_str);
+  } else if (name_str == ":authority") {
+    add_header(stream.request.headers, "host", value_str);
+  } else if (!name_str.starts_with(':')) {
+    add_header(stream.request.headers, name_str, value_str);
+  }
+
+  return 0;
+}
+
+int Connection::on_data_chunk_recv(nghttp2_session *, std::uint8_t,
+                                   std::int32_t stream_id,
+                                   const std::uint8_t *data, std::size_t length,
+                                   void *user_data) {
+  auto connection = static_cast<Connection *>(user_data);
+  auto iter = connection->streams_.find(stream_id);
+  if (iter == std::end(connection->streams_)) {
+    return 0;
+  }
+  auto &stream = *iter->second;
+
+  if (std::size(stream.request.body) + length >
+      connection->router_.max_body_size()) {
+    stream.too_large = true;
+    stream.request.body.clear();
+    return 0;
+  }
+  if (!stream.too_large) {
+    stream.request.body.append(reinterpret_cast<const char *>(data), length);
+  }
+
+  return 0;
+}
+
+int Connection::on_frame_recv(nghttp2_session *, const nghttp2_frame *frame,
+                              void *user_data) {
+  if ((frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA) ||
+      !(frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+    return 0;
+  }
+
+  auto connection = static_cast<Connection *>(user_data);
+  auto iter = connection->streams_.find(frame->hd.stream_id);
+  if (iter == std::end(connection->streams_)) {
+    return 0;
+  }
+
+  connection->submit_http2_response(frame->hd.stream_id, *iter->second);
+  return 0;
+}
+
+int Connection::on_stream_close(nghttp2_session *, std::int32_t stream_id,
+                                std::uint32_t, void *user_data) {
+  auto connection = static_cast<Connection *>(user_data);
+  connection->streams_.erase(stream_id);
+  return 0;
+}
+
+int create_listener(const std::string &host, std::uint16_t port) {
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) [[unlikely]] {
+    throw InvalidArgument("Invalid IPv4 address: '{}'", host);
+  }
+
+  auto fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) [[unlikely]] {
+    throw RuntimeError("socket() failed: {}", std::strerror(errno));
+  }
+  SCOPE_FAIL { close(fd); };
+
+  std::int32_t on = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+      [[unlikely]] {
+    throw RuntimeError("setsockopt() failed: {}", std::strerror(errno));
+  }
+
+  if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1)
+      [[unlikely]] {
+    throw RuntimeError("Can not bind to {}:{}: {}", host, port,
+                       std::strerror(errno));
+  }
+  if (listen(fd, SOMAXCONN) == -1) [[unlikely]] {
+    throw RuntimeError("listen() failed: {}", std::strerror(errno));
+  }
+
+  return fd;
+}
+
+bool epoll_add(int epoll_fd, int fd, std::uint32_t events) {
+  epoll_event event = {};
+  event.events = events;
+  event.data.fd = fd;
+  return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+/**
+ * @brief Create the epoll instance of a worker, watching the listening socket
+ * and the eventfd used to stop it
+ */
+int create_epoll(int listen_fd, int event_fd) {
+  auto epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) [[unlikely]] {
+    throw RuntimeError("epoll_create1() failed: {}", std::strerror(errno));
+  }
+  SCOPE_FAIL { close(epoll_fd); };
+
+  if (!epoll_add(epoll_fd, listen_fd, EPOLLIN) ||
+      !epoll_add(epoll_fd, event_fd, EPOLLIN)) [[unlikely]] {
+    throw RuntimeError("epoll_ctl() failed: {}", std::strerror(errno));
+  }
+
+  return epoll_fd;
+}
+
+/**
+ * @brief Accept and close a pending connection in the slot of the spare
+ * descriptor, so that it leaves the backlog when the process is out of them
+ * @return 0 if a connection is dropped, otherwise the error of accept4()
+ */
+int drop_connection(int listen_fd, int &reserve_fd) {
+  if (reserve_fd == -1) {
+    return EMFILE;
+  }
+
+  close(reserve_fd);
+  auto client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+  auto error = errno;
+  if (client != -1) {
+    close(client);
+  }
+  reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  return client != -1 ? 0 : error;
+}
+
+struct Client {
+  std::unique_ptr<Connection> connection;
+  std::uint32_t events = EPOLLIN | EPOLLRDHUP;
+  std::chrono::steady_clock::time_point last_active;
+};
+
+void run_worker(int epoll_fd, int listen_fd, int event_fd, const Router &router,
+                std::chrono::seconds idle_timeout) {
+  // sendfile() has no MSG_NOSIGNAL, SIGPIPE is thread-directed so blocking it
+  // here leaves the rest of the process alone
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+  phmap::flat_hash_map<int, Client> clients;
+  std::array<epoll_event, 256> events;
+
+  // Idle connections are looked for about once a second
+  const std::int32_t wait_timeout = idle_timeout.count() > 0 ? 1000 : -1;
+  auto last_sweep = std::chrono::steady_clock::now();
+
+  // The listening socket is level-triggered, a connection that can not be
+  // accepted for lack of descriptors would be reported again at once
+  auto reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  SCOPE_EXIT {
+    if (reserve_fd != -1) {
+      close(reserve_fd);
+    }
+  };
+  std::optional<std::chrono::steady_clock::time_point> resume_accept;
+  constexpr std::int32_t accept_pause = 100;
+
+  while (true) {
+    auto count = epoll_wait(epoll_fd, std::data(events), std::size(events),
+                            resume_accept ? accept_pause : wait_timeout);
+    if (count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // Runs in a library thread, exiting here would take the whole process
+      // down, stop() still joins it
+      warn("epoll_wait() failed, the worker stops: {}", std::strerror(errno));
+      return;
+    }
+    auto now = std::chrono::steady_clock::now();
+
+    if (resume_accept && now >= *resume_accept) {
+      if (reserve_fd == -1) {
+        reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+      }
+      epoll_event event = {};
+      event.events = EPOLLIN;
+      event.data.fd = listen_fd;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_fd, &event);
+      resume_accept.reset();
+    }
+
+    for (std::int32_t i = 0; i < count; ++i) {
+      auto fd = events[i].data.fd;
+      auto flags = events[i].events;
+
+      if (fd == event_fd) {
+        return;
+      }
+
+      if (fd == listen_fd) {
+        while (true) {
+          auto client = accept4(listen_fd, nullptr, nullptr,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if (client == -1) {
+            auto error = errno;
+            if (error == EMFILE || error == ENFILE) [[unlikely]] {
+              error = drop_connection(listen_fd, reserve_fd);
+              if (error == 0) {
+                warn("Out of file descriptors, a connection is dropped");
+                continue;
+              }
+            }
+
+            // Without a spare descriptor, stop watching the listening socket
+            // for a while instead
+            if (error == EMFILE || error == ENFILE) [[unlikely]] {
+              warn("accept4() failed, accepting is paused: {}",
+                   std::strerror(error));
+              epoll_event event = {};
+              event.data.fd = listen_fd;
+              epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_fd, &event);
+              resume_accept = now + std::chrono::milliseconds(accept_pause);
+            }
+            break;
+          }
+          std::int32_t on = 1;
+          setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+          if (!epoll_add(epoll_fd, client, EPOLLIN | EPOLLRDHUP))
+              [[unlikely]] {
+            close(client);
+            continue;
+          }
+          clients.insert_or_assign(
+              client,
+              Client{std::make_unique<Connection>(client, router),
+                     EPOLLIN | EPOLLRDHUP, now});
+        }
+        continue;
+      }
+
+      auto iter = clients.find(fd);
+      if (iter == std::end(clients)) {
+        continue;
+      }
+      auto &client = iter->second;
+      auto &connection = *client.connection;
+      client.last_active = now;
+
+      bool keep = !(flags & EPOLLERR);
+      if (keep && (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+        keep = connection.on_readable();
+      }
+      if (keep && (flags & EPOLLOUT)) {
+        keep = connection.on_writable();
+      }
+
+      if (!keep) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        clients.erase(iter);
+        continue;
+      }
+
+      // Stop watching the input once the client has shut it down, otherwise
+      // it is reported as readable until the responses are written
+      std::uint32_t wanted = 0;
+      if (connection.want_read()) {
+        wanted |= EPOLLIN | EPOLLRDHUP;
+      }
+      if (connection.want_write()) {
+        wanted |= EPOLLOUT;
+      }
+      if (wanted != client.events) {
+        epoll_event event = {};
+        event.events = wanted;
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+        client.events = wanted;
+      }
+    }
+
+    if (wait_timeout == -1 || now - last_sweep < std::chrono::seconds(1)) {
+      continue;
+    }
+    last_sweep = now;
+
+    std::vector<int> idle;
+    for (const auto &[fd, client] : clients) {
+      if (now - client.last_active >= idle_timeout) {
+        idle.push_back(fd);
+      }
+    }
+    for (auto fd : idle) {
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+      clients.erase(fd);
+    }
+  }
+}
+
+}  // namespace
+
+std::optional<std::string> ServerRequest::header(std::string_view name) const {
+  if (auto iter = headers.find(to_lower(name)); iter != std::end(headers)) {
+    return iter->second;
+  }
+  return {};
+}
+
+class HttpServer::HttpServerImpl {
+ public:
+  HttpServerImpl(const std::string &host, std::uint16_t port,
+                 std::int32_t threads);
+
+  HttpServerImpl(const HttpServerImpl &) = delete;
+  HttpServerImpl(HttpServerImpl &&) = delete;
+  HttpServerImpl &operator=(const HttpServerImpl &) = delete;
+  HttpServerImpl &operator=(HttpServerImpl &&) = delete;
+
+  ~HttpServerImpl();
+
+  void route(HttpMethod method, const std::string &path,
+             const RequestHandler &handler);
+  void mount(const std::string &prefix, const std::string &dir);
+  void set_max_body_size(std::size_t size);
+  void set_idle_timeout(std::int64_t seconds);
+
+  void start();
+  void stop();
+
+  [[nodiscard]] std::uint16_t port() const { return port_; }
+
+ private:
+  void check_not_started() const;
+
+  std::string host_;
+  std::uint16_t port_;
+  std::int32_t threads_;
+
+  Router router_;
+  std::chrono::seconds idle_timeout_ = std::chrono::seconds(60);
+
+  int event_fd_ = -1;
+  std::vector<int> listen_fds_;
+  std::vector<int> epoll_fds_;
+  std::vector<std::thread> workers_;
+};
+
+HttpServer::HttpServerImpl::HttpServerImpl(const std::string &host,
+                                           std::uint16_t port,
+                                           std::int32_t threads)
+    : host_(host), port_(port), threads_(threads) {
+  if (threads_ < 0) [[unlikely]] {
+    throw InvalidArgument("The number of threads can not be negative");
+  }
+  if (threads_ == 0) {
+    threads_ =
+        std::max(static_cast<std::int32_t>(std::thread::hardware_concurrency()),
+                 1);
+  }
+}
+
+HttpServer::HttpServerImpl::~HttpServerImpl() { stop(); }
+
+void HttpServer::HttpServerImpl::route(HttpMethod method,
+                                       const std::string &path,
+                                       const RequestHandler &handler) {
+  check_not_started();
+  router_.route(method, path, handler);
+}
+
+void HttpServer::HttpServerImpl::mount(const std::string &prefix,
+                                       const std::string &dir) {
+  check_not_started();
+  if (!prefix.starts_with('/')) [[unlikely]] {
+    throw InvalidArgument("The prefix must start with '/': '{}'", prefix);
+  }
+  if (!std::filesystem::is_directory(dir)) [[unlikely]] {
+    throw InvalidArgument("'{}' is not a directory", dir);
+  }
+  router_.mount(prefix, dir);
+}
+
+void HttpServer::HttpServerImpl::set_max_body_size(std::size_t size) {
+  check_not_started();
+  router_.set_max_body_size(size);
+}
+
+void HttpServer::HttpServerImpl::set_idle_timeout(std::int64_t seconds) {
+  check_not_started();
+  if (seconds < 0) [[unlikely]] {
+    throw InvalidArgument("The idle timeout can not be negative");
+  }
+  idle_timeout_ = std::chrono::seconds(seconds);
+}
+
+void HttpServer::HttpServerImpl::start() {
+  check_not_started();
+
+  SCOPE_FAIL { stop(); };
+
+  event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (event_fd_ == -1) [[unlikely]] {
+    throw RuntimeError("eventfd() failed: {}", std::strerror(errno));
+  }
+
+  for (std::int32_t i = 0; i < threads_; ++i) {
+    listen_fds_.push_back(create_listener(host_, port_));
+
+    if (port_ == 0) {
+      sockaddr_in addr = {};
+      socklen_t size = sizeof(addr);
+      if (getsockname(listen_fds_.back(), reinterpret_cast<sockaddr *>(&addr),
+                      &size) == -1) [[unlikely]] {
+        throw RuntimeError("getsockname() failed: {}", std::strerror(errno));
+      }
+      port_ = ntohs(addr.sin_port);
+    }
+
+    epoll_fds_.push_back(create_epoll(listen_fds_.back(), event_fd_));
+  }
+
+  for (std::int32_t i = 0; i < threads_; ++i) {
+    workers_.emplace_back(run_worker, epoll_fds_[i], listen_fds_[i], event_fd_,
+                          std::cref(router_), idle_timeout_);
+  }
+}
+
+void HttpServer::HttpServerImpl::stop() {
+  if (event_fd_ == -1) {
+    return;
+  }
+
+  // The eventfd is never read, so it wakes up every worker
+  std::uint64_t value = 1;
+  [[maybe_unused]] auto rc = write(event_fd_, &value, sizeof(value));
+
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+  workers_.clear();
+
+  for (auto epoll_fd : epoll_fds_) {
+    close(epoll_fd);
+  }
+  epoll_fds_.clear();
+
+  for (auto listen_fd : listen_fds_) {
+    close(listen_fd);
+  }
+  listen_fds_.clear();
+
+  close(event_fd_);
+  event_fd_ = -1;
+}
+
+void HttpServer::HttpServerImpl::check_not_started() const {
+  if (event_fd_ != -1) [[unlikely]] {
+    throw LogicError("The server has already started");
+  }
+}
+
+HttpServer::HttpServer(const std::string &host, std::uint16_t port,
+                       std::int32_t threads)
+    : impl_(std::make_unique<HttpServerImpl>(host, port, threads)) {}
+
+HttpServer::~HttpServer() = default;
+
+void HttpServer::route(HttpMethod method, const std::string &path,
+                       const RequestHandler &handler) {
+  impl_->route(method, path, handler);
+}
+
+void HttpServer::mount(const std::string &prefix, const std::string &dir) {
+  impl_->mount(prefix, dir);
+}
+
+void HttpServer::set_max_body_size(std::size_t size) {
+  impl_->set_max_body_size(size);
+}
+
+void HttpServer::set_idle_timeout(std::int64_t seconds) {
+  impl_->set_idle_timeout(seconds);
+}
+
+void HttpServer::start() { impl_->start(); }
+
+void HttpServer::stop() { impl_->stop(); }
+
+std::uint16_t HttpServer::port() const { return impl_->port(); }
+
+}  // namespace klib
@@ -1,5 +1,22 @@
 #include "klib/sql.h"
 
+#include <unistd.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <list>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <variant>
+
+#include <zdict.h>
+#include <zstd.h>
+#include <parallel_hashmap/phmap.h>
 #include <sqlcipher/sqlite3.h>
 #include <boost/core/ignore_unused.hpp>
 #include <scope_guard.hpp>
@@ -7,6 +24,7 @@
 #include "klib/archive.h"
 #include "klib/exception.h"
 #include "klib/log.h"
+#include "klib/util.h"
 
 namespace klib {
 
@@ -24,33 +42,14 @@ namespace klib {
     }                                         \
   } while (0)
 
-class Column::ColumnImpl {
- public:
-  ColumnImpl(SqlQuery &sql_query, std::int32_t index);
-
-  [[nodiscard]] bool is_null() const;
-
-  [[nodiscard]] std::int32_t as_int32() const;
-  [[nodiscard]] std::int64_t as_int64() const;
-  [[nodiscard]] double as_double() const;
-  [[nodiscard]] std::string as_text() const;
-  [[nodiscard]] std::string as_blob() const;
-
- private:
-  [[nodiscard]] std::int32_t get_type() const;
-
-  [[nodiscard]] bool is_integer() const;
-  [[nodiscard]] bool is_float() const;
-  [[nodiscard]] bool is_text() const;
-  [[nodiscard]] bool is_blob() const;
-
-  sqlite3_stmt *stmt_ = nullptr;
-  std::int32_t index_ = 0;
-};
+#define CHECK_ZSTD(rc)                           \
+  do {                                           \
+    if (ZSTD_isError(rc)) [[unlikely]] {         \
+      throw RuntimeError(ZSTD_getErrorName(rc)); \
+    }                                            \
+  } while (0)
 
 class SqlQuery::SqlQueryImpl {
-  friend class Column::ColumnImpl;
-
  public:
   explicit SqlQueryImpl(SqlDatabase &db);
 
@@ -61,6 +60,9 @@ class SqlQuery::SqlQueryImpl {
 
   ~SqlQueryImpl();
 
+  // Called when the database is destroyed first
+  void detach() { database_ = nullptr; }
+
   void finalize();
 
   void prepare(std::string_view sql);
@@ -68,8 +70,12 @@ class SqlQuery::SqlQueryImpl {
   void bind(std::int32_t index, std::int32_t value);
   void bind(std::int32_t index, std::int64_t value);
   void bind(std::int32_t index, double value);
-  void bind(std::int32_t index, const std::string &value);
-  void bind(std::int32_t index, const char *value, std::size_t size);
+  void bind_null(std::int32_t index);
+  void bind(std::int32_t index, std::string_view value);
+  void bind(std::int32_t index, const char *value, std::size_t size,
+            BlobCompression compression);
+  void bind_static(std::int32_t index, std::string_view value);
+  void bind_static(std::int32_t index, const char *value, std::size_t size);
 
   std::int32_t exec();
 
@@ -77,22 +83,33 @@ class SqlQuery::SqlQueryImpl {
 
   [[nodiscard]] std::string get_column_name(std::int32_t index);
 
-  [[nodiscard]] Column get_column(SqlQuery &sql_query,
-                                  std::int32_t index) const;
+  [[nodiscard]] sqlite3_stmt *get_column_stmt(std::int32_t index) const;
+
+  [[nodiscard]] std::string decompress_blob(std::string_view blob) const;
 
  private:
+  void check_attached() const;
+
+  // Null once the database has been destroyed, the connection is then kept
+  // alive by sqlite3_close_v2() until the statement is finalized
+  SqlDatabase::SqlDatabaseImpl *database_ = nullptr;
   sqlite3 *db_ = nullptr;
   sqlite3_stmt *stmt_ = nullptr;
 
   std::int32_t column_count_ = 0;
+
+  // Compressed blobs are bound with SQLITE_STATIC, indexed by parameter
+  std::vector<std::string> blob_buffers_;
 };
 
 class SqlDatabase::SqlDatabaseImpl {
   friend SqlQuery::SqlQueryImpl;
 
  public:
+  // Unencrypted if password is null
   explicit SqlDatabaseImpl(const std::string &db_name, OpenMode open_mode,
-                           const std::string &password);
+                           const std::string *password,
+                           const CipherOptions &options = {});
 
   SqlDatabaseImpl(const SqlDatabaseImpl &) = delete;
   SqlDatabaseImpl(SqlDatabaseImpl &&) = delete;
@@ -104,7 +121,12 @@ class SqlDatabase::SqlDatabaseImpl {
   void transaction();
   void commit();
   void rollback();
+  [[nodiscard]] bool in_transaction() const;
   void vacuum();
+  void backup(const std::string &dest_name, std::int32_t pages_per_step,
+              std::chrono::milliseconds interval,
+              const BackupCallback &callback);
+  void vacuum_into(const std::string &dest_name, bool compress);
 
   [[nodiscard]] static bool table_exists(SqlDatabase &db,
                                          const std::string &table_name);
@@ -117,99 +139,84 @@ class SqlDatabase::SqlDatabaseImpl {
 
   std::int32_t exec(std::string_view sql);
 
- private:
-  sqlite3 *db_ = nullptr;
-};
-
-Column::ColumnImpl::ColumnImpl(SqlQuery &sql_query, std::int32_t index)
-    : stmt_(sql_query.impl_->stmt_), index_(index) {}
-
-bool Column::ColumnImpl::is_null() const { return get_type() == SQLITE_NULL; }
-
-std::int32_t Column::ColumnImpl::as_int32() const {
-  if (!is_integer()) [[unlikely]] {
-    throw InvalidArgument("Not a integer");
-  }
-
-  return sqlite3_column_int(stmt_, index_);
-}
-
-std::int64_t Column::ColumnImpl::as_int64() const {
-  if (!is_integer()) [[unlikely]] {
-    throw InvalidArgument("Not a integer");
-  }
-
-  return sqlite3_column_int64(stmt_, index_);
-}
+  void set_statement_cache_size(std::size_t size);
 
-double Column::ColumnImpl::as_double() const {
-  if (!is_float()) [[unlikely]] {
-    throw InvalidArgument("Not a float");
-  }
-
-  return sqlite3_column_double(stmt_, index_);
-}
-
-std::string Column::ColumnImpl::as_text() const {
-  if (!is_text()) [[unlikely]] {
-    throw InvalidArgument("Not a text");
-  }
-
-  return std::string(
-      reinterpret_cast<const char *>(sqlite3_column_text(stmt_, index_)));
-}
+  std::uint32_t train_dictionary(const std::vector<std::string> &samples,
+                                 std::size_t max_size);
 
-std::string Column::ColumnImpl::as_blob() const {
-  if (!is_blob()) [[unlikely]] {
-    throw InvalidArgument("Not a blob");
-  }
+  void compress_blob(std::string &out, const char *data, std::size_t size,
+                     BlobCompression compression);
+  [[nodiscard]] std::string decompress_blob(std::string_view blob);
 
-  return decompress_data(
-      reinterpret_cast<const char *>(sqlite3_column_blob(stmt_, index_)),
-      sqlite3_column_bytes(stmt_, index_));
-}
+ private:
+  [[nodiscard]] sqlite3_stmt *acquire_statement(std::string_view sql);
+  void release_statement(sqlite3_stmt *stmt);
+  void exec_cached(std::string_view sql);
 
-std::int32_t Column::ColumnImpl::get_type() const {
-  return sqlite3_column_type(stmt_, index_);
-}
+  sqlite3 *db_ = nullptr;
+  // Detached when the database is destroyed
+  phmap::flat_hash_set<SqlQuery::SqlQueryImpl *> queries_;
+  // Empty if unencrypted, reused for backups
+  std::string password_;
+  CipherOptions cipher_options_;
+
+  // Reset statements that are not used by any SqlQuery, the most recently used
+  // is at the front, keyed by sqlite3_sql()
+  std::size_t statement_cache_size_ = 32;
+  std::list<sqlite3_stmt *> statements_;
+  phmap::flat_hash_map<std::string_view, std::list<sqlite3_stmt *>::iterator>
+      statement_index_;
+
+  [[nodiscard]] const ZSTD_CDict *get_cdict();
+  [[nodiscard]] const ZSTD_DDict *get_ddict(std::uint32_t id);
+
+  std::unique_ptr<ZSTD_CCtx, decltype(ZSTD_freeCCtx) *> cctx_{ZSTD_createCCtx(),
+                                                              ZSTD_freeCCtx};
+  std::unique_ptr<ZSTD_DCtx, decltype(ZSTD_freeDCtx) *> dctx_{ZSTD_createDCtx(),
+                                                              ZSTD_freeDCtx};
+  // The latest dictionary, loaded on first use
+  std::unique_ptr<ZSTD_CDict, decltype(ZSTD_freeCDict) *> cdict_{
+      nullptr, ZSTD_freeCDict};
+  phmap::flat_hash_map<std::uint32_t,
+                       std::unique_ptr<ZSTD_DDict, decltype(ZSTD_freeDDict) *>>
+      ddicts_;
+};
 
-bool Column::ColumnImpl::is_integer() const {
-  return get_type() == SQLITE_INTEGER;
+SqlQuery::SqlQueryImpl::SqlQueryImpl(SqlDatabase &db)
+    : database_(db.impl_.get()), db_(db.impl_->db_) {
+  database_->queries_.insert(this);
 }
 
-bool Column::ColumnImpl::is_float() const { return get_type() == SQLITE_FLOAT; }
-
-bool Column::ColumnImpl::is_text() const { return get_type() == SQLITE_TEXT; }
-
-bool Column::ColumnImpl::is_blob() const { return get_type() == SQLITE_BLOB; }
-
-SqlQuery::SqlQueryImpl::SqlQueryImpl(SqlDatabase &db) : db_(db.impl_->db_) {}
-
 SqlQuery::SqlQueryImpl::~SqlQueryImpl() {
   try {
     finalize();
   } catch (...) {
     error("~SqlQueryImpl() failed");
   }
+
+  if (database_) {
+    database_->queries_.erase(this);
+  }
 }
 
 void SqlQuery::SqlQueryImpl::finalize() {
-  auto rc = sqlite3_finalize(stmt_);
-  CHECK_SQLITE2(rc, db_);
+  if (!stmt_) {
+    return;
+  }
+
+  if (database_) {
+    database_->release_statement(stmt_);
+  } else {
+    sqlite3_finalize(stmt_);
+  }
   stmt_ = nullptr;
 }
 
 void SqlQuery::SqlQueryImpl::prepare(std::string_view sql) {
+  check_attached();
   finalize();
 
-  auto rc =
-      sqlite3_prepare_v2(db_, std::data(sql), std::size(sql), &stmt_, nullptr);
-
-  if (rc != SQLITE_OK) [[unlikely]] {
-    finalize();
-    throw RuntimeError(sqlite3_errmsg(db_));
-  }
-
+  stmt_ = database_->acquire_statement(sql);
   column_count_ = sqlite3_column_count(stmt_);
 }
 
@@ -228,18 +235,55 @@ void SqlQuery::SqlQueryImpl::bind(std::int32_t index, double value) {
   CHECK_SQLITE2(rc, db_);
 }
 
-void SqlQuery::SqlQueryImpl::bind(std::int32_t index,
-                                  const std::string &value) {
-  auto rc = sqlite3_bind_text(stmt_, index, value.c_str(), std::size(value),
-                              SQLITE_TRANSIENT);
+void SqlQuery::SqlQueryImpl::bind_null(std::int32_t index) {
+  auto rc = sqlite3_bind_null(stmt_, index);
+  CHECK_SQLITE2(rc, db_);
+}
+
+void SqlQuery::SqlQueryImpl::bind(std::int32_t index, std::string_view value) {
+  auto rc = sqlite3_bind_text64(stmt_, index, value.data() ? value.data() : "",
+                                std::size(value), SQLITE_TRANSIENT,
+                                SQLITE_UTF8);
   CHECK_SQLITE2(rc, db_);
 }
 
 void SqlQuery::SqlQueryImpl::bind(std::int32_t index, const char *value,
-                                  std::size_t size) {
-  auto compressed_data = compress_data(value, size);
-  auto rc = sqlite3_bind_blob(stmt_, index, std::data(compressed_data),
-                              std::size(compressed_data), SQLITE_TRANSIENT);
+                                  std::size_t size,
+                                  BlobCompression compression) {
+  if (compression == BlobCompression::None) {
+    // A null pointer would bind NULL
+    auto rc = sqlite3_bind_blob64(stmt_, index, value ? value : "", size,
+                                  SQLITE_TRANSIENT);
+    CHECK_SQLITE2(rc, db_);
+    return;
+  }
+
+  if (index < 1) [[unlikely]] {
+    throw OutOfRange("Parameter index out of range");
+  }
+  if (std::size(blob_buffers_) < static_cast<std::size_t>(index)) {
+    blob_buffers_.resize(index);
+  }
+  check_attached();
+  auto &buffer = blob_buffers_[index - 1];
+  database_->compress_blob(buffer, value, size, compression);
+
+  auto rc = sqlite3_bind_blob64(stmt_, index, std::data(buffer),
+                                std::size(buffer), SQLITE_STATIC);
+  CHECK_SQLITE2(rc, db_);
+}
+
+void SqlQuery::SqlQueryImpl::bind_static(std::int32_t index,
+                                         std::string_view value) {
+  auto rc = sqlite3_bind_text64(stmt_, index, value.data() ? value.data() : "",
+                                std::size(value), SQLITE_STATIC, SQLITE_UTF8);
+  CHECK_SQLITE2(rc, db_);
+}
+
+void SqlQuery::SqlQueryImpl::bind_static(std::int32_t index, const char *value,
+                                         std::size_t size) {
+  auto rc = sqlite3_bind_blob64(stmt_, index, value ? value : "", size,
+                                SQLITE_STATIC);
   CHECK_SQLITE2(rc, db_);
 }
 
@@ -247,6 +291,7 @@ std::int32_t SqlQuery::SqlQueryImpl::exec() {
   if (!stmt_) [[unlikely]] {
     throw LogicError("Call prepare first");
   }
+  check_attached();
 
   if (auto rc = sqlite3_step(stmt_); rc != SQLITE_DONE) [[unlikely]] {
     throw RuntimeError(sqlite3_errmsg(db_));
@@ -260,6 +305,7 @@ bool SqlQuery::SqlQueryImpl::next() {
   if (!stmt_) [[unlikely]] {
     throw LogicError("Call prepare first");
   }
+  check_attached();
 
   if (auto rc = sqlite3_step(stmt_); rc != SQLITE_ROW) {
     CHECK_SQLITE2(sqlite3_reset(stmt_), db_);
@@ -277,21 +323,39 @@ std::string SqlQuery::SqlQueryImpl::get_column_name(std::int32_t index) {
   return sqlite3_column_name(stmt_, index);
 }
 
-Column SqlQuery::SqlQueryImpl::get_column(SqlQuery &sql_query,
-                                          std::int32_t index) const {
+sqlite3_stmt *SqlQuery::SqlQueryImpl::get_column_stmt(
+    std::int32_t index) const {
   if (index >= column_count_) [[unlikely]] {
     throw OutOfRange("Column index out of range");
   }
 
-  return Column(sql_query, index);
+  return stmt_;
+}
+
+std::string SqlQuery::SqlQueryImpl::decompress_blob(
+    std::string_view blob) const {
+  check_attached();
+  return database_->decompress_blob(blob);
+}
+
+void SqlQuery::SqlQueryImpl::check_attached() const {
+  if (!database_) [[unlikely]] {
+    throw LogicError("The database has been destroyed");
+  }
 }
 
 SqlDatabase::SqlDatabaseImpl::SqlDatabaseImpl(const std::string &db_name,
                                               OpenMode open_mode,
-                                              const std::string &password) {
-  if (std::empty(password)) [[unlikely]] {
+                                              const std::string *password,
+                                              const CipherOptions &options)
+    : cipher_options_(options) {
+  if (password && std::empty(*password)) [[unlikely]] {
     throw InvalidArgument("The password is empty");
   }
+  if (password && options.raw_key && std::size(*password) != 32 &&
+      std::size(*password) != 48) [[unlikely]] {
+    throw InvalidArgument("The raw key must be 32 or 48 bytes");
+  }
 
   std::int32_t flag = 0;
   if (open_mode == OpenMode::ReadOnly) {
@@ -307,20 +371,141 @@ SqlDatabase::SqlDatabaseImpl::SqlDatabaseImpl(const std::string &db_name,
     throw RuntimeError(msg);
   }
 
-  auto rc = sqlite3_key(db_, std::data(password), std::size(password));
+  if (!password) {
+    return;
+  }
+  SCOPE_FAIL { sqlite3_close_v2(db_); };
+  password_ = *password;
+
+  auto rc = SQLITE_OK;
+  if (options.raw_key) {
+    // Blob literal, see the "Raw Key Data" section of PRAGMA key
+    const auto key = "x'" + bytes_to_hex_string(password_) + "'";
+    rc = sqlite3_key(db_, std::data(key), std::size(key));
+  } else {
+    rc = sqlite3_key(db_, std::data(password_), std::size(password_));
+  }
   CHECK_SQLITE2(rc, db_);
+
+  // Must be set before the first access
+  if (options.kdf_iter) {
+    exec("PRAGMA kdf_iter=" + std::to_string(*options.kdf_iter));
+  }
+  if (options.cipher_page_size) {
+    exec("PRAGMA cipher_page_size=" +
+         std::to_string(*options.cipher_page_size));
+  }
+  if (options.hmac_algorithm) {
+    switch (*options.hmac_algorithm) {
+      case CipherHmac::Sha1:
+        exec("PRAGMA cipher_hmac_algorithm=HMAC_SHA1");
+        break;
+      case CipherHmac::Sha256:
+        exec("PRAGMA cipher_hmac_algorithm=HMAC_SHA256");
+        break;
+      case CipherHmac::Sha512:
+        exec("PRAGMA cipher_hmac_algorithm=HMAC_SHA512");
+        break;
+    }
+  }
 }
 
-SqlDatabase::SqlDatabaseImpl::~SqlDatabaseImpl() { sqlite3_close_v2(db_); }
+SqlDatabase::SqlDatabaseImpl::~SqlDatabaseImpl() {
+  for (auto query : queries_) {
+    query->detach();
+  }
+  for (auto stmt : statements_) {
+    sqlite3_finalize(stmt);
+  }
+  sqlite3_close_v2(db_);
+}
+
+void SqlDatabase::SqlDatabaseImpl::transaction() { exec_cached("BEGIN"); }
 
-void SqlDatabase::SqlDatabaseImpl::transaction() { exec("BEGIN"); }
+void SqlDatabase::SqlDatabaseImpl::commit() { exec_cached("COMMIT"); }
 
-void SqlDatabase::SqlDatabaseImpl::commit() { exec("COMMIT"); }
+void SqlDatabase::SqlDatabaseImpl::rollback() { exec_cached("ROLLBACK"); }
 
-void SqlDatabase::SqlDatabaseImpl::rollback() { exec("ROLLBACK"); }
+bool SqlDatabase::SqlDatabaseImpl::in_transaction() const {
+  return !sqlite3_get_autocommit(db_);
+}
 
 void SqlDatabase::SqlDatabaseImpl::vacuum() { exec("VACUUM"); }
 
+void SqlDatabase::SqlDatabaseImpl::backup(const std::string &dest_name,
+                                          std::int32_t pages_per_step,
+                                          std::chrono::milliseconds interval,
+                                          const BackupCallback &callback) {
+  SqlDatabaseImpl dest(dest_name, OpenMode::ReadWrite,
+                       std::empty(password_) ? nullptr : &password_,
+                       cipher_options_);
+
+  auto backup = sqlite3_backup_init(dest.db_, "main", db_, "main");
+  if (!backup) [[unlikely]] {
+    throw RuntimeError(sqlite3_errmsg(dest.db_));
+  }
+
+  std::int32_t rc;
+  while (true) {
+    rc = sqlite3_backup_step(backup, pages_per_step);
+    if (rc == SQLITE_DONE) {
+      break;
+    } else if (rc != SQLITE_OK && rc != SQLITE_BUSY && rc != SQLITE_LOCKED)
+        [[unlikely]] {
+      sqlite3_backup_finish(backup);
+      throw RuntimeError(sqlite3_errstr(rc));
+    }
+
+    if (callback && !callback(sqlite3_backup_remaining(backup),
+                              sqlite3_backup_pagecount(backup))) {
+      sqlite3_backup_finish(backup);
+      throw RuntimeError("Backup aborted");
+    }
+
+    if (interval.count() > 0) {
+      std::this_thread::sleep_for(interval);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+
+  if (callback) {
+    boost::ignore_unused(callback(0, sqlite3_backup_pagecount(backup)));
+  }
+  CHECK_SQLITE2(sqlite3_backup_finish(backup), dest.db_);
+}
+
+void SqlDatabase::SqlDatabaseImpl::vacuum_into(const std::string &dest_name,
+                                               bool compress) {
+  if (!compress) {
+    auto stmt = acquire_statement("VACUUM INTO ?");
+    SCOPE_EXIT { release_statement(stmt); };
+    CHECK_SQLITE2(sqlite3_bind_text64(stmt, 1, std::data(dest_name),
+                                      std::size(dest_name), SQLITE_STATIC,
+                                      SQLITE_UTF8),
+                  db_);
+    if (sqlite3_step(stmt) != SQLITE_DONE) [[unlikely]] {
+      throw RuntimeError(sqlite3_errmsg(db_));
+    }
+    return;
+  }
+
+  // VACUUM INTO accepts an empty file, a unique one never clobbers user files
+  std::string temp_name = dest_name + ".XXXXXX";
+  auto fd = mkstemp(std::data(temp_name));
+  if (fd == -1) [[unlikely]] {
+    throw RuntimeError("mkstemp() failed: {}", std::strerror(errno));
+  }
+  close(fd);
+  SCOPE_EXIT {
+    std::error_code error_code;
+    std::filesystem::remove(temp_name, error_code);
+  };
+
+  vacuum_into(temp_name, false);
+  write_file(dest_name, true, compress_data(read_file(temp_name, true)));
+}
+
 bool SqlDatabase::SqlDatabaseImpl::table_exists(SqlDatabase &db,
                                                 const std::string &table_name) {
   SqlQuery query(db);
@@ -364,22 +549,260 @@ std::int32_t SqlDatabase::SqlDatabaseImpl::exec(std::string_view sql) {
   return sqlite3_changes(db_);
 }
 
-Column::~Column() = default;
+void SqlDatabase::SqlDatabaseImpl::set_statement_cache_size(std::size_t size) {
+  statement_cache_size_ = size;
+  while (std::size(statements_) > statement_cache_size_) {
+    auto stmt = statements_.back();
+    statement_index_.erase(sqlite3_sql(stmt));
+    statements_.pop_back();
+    sqlite3_finalize(stmt);
+  }
+}
+
+sqlite3_stmt *SqlDatabase::SqlDatabaseImpl::acquire_statement(
+    std::string_view sql) {
+  if (auto iter = statement_index_.find(sql);
+      iter != std::end(statement_index_)) {
+    auto stmt = *iter->second;
+    statements_.erase(iter->second);
+    statement_index_.erase(iter);
+    return stmt;
+  }
+
+  sqlite3_stmt *stmt = nullptr;
+  auto rc =
+      sqlite3_prepare_v2(db_, std::data(sql), std::size(sql), &stmt, nullptr);
+  if (rc != SQLITE_OK) [[unlikely]] {
+    sqlite3_finalize(stmt);
+    throw RuntimeError(sqlite3_errmsg(db_));
+  }
+  if (!stmt) [[unlikely]] {
+    throw InvalidArgument("Empty SQL statement");
+  }
+
+  return stmt;
+}
+
+void SqlDatabase::SqlDatabaseImpl::release_statement(sqlite3_stmt *stmt) {
+  // The error of the last step has been reported by SqlQuery
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  std::string_view sql = sqlite3_sql(stmt);
+  if (statement_cache_size_ == 0 || statement_index_.contains(sql)) {
+    sqlite3_finalize(stmt);
+    return;
+  }
+
+  statements_.push_front(stmt);
+  statement_index_.emplace(sql, std::begin(statements_));
+  if (std::size(statements_) > statement_cache_size_) {
+    auto last = statements_.back();
+    statement_index_.erase(sqlite3_sql(last));
+    statements_.pop_back();
+    sqlite3_finalize(last);
+  }
+}
+
+std::uint32_t SqlDatabase::SqlDatabaseImpl::train_dictionary(
+    const std::vector<std::string> &samples, std::size_t max_size) {
+  std::string buffer;
+  std::vector<std::size_t> sizes;
+  sizes.reserve(std::size(samples));
+  for (const auto &sample : samples) {
+    buffer.append(sample);
+    sizes.push_back(std::size(sample));
+  }
+
+  std::string dictionary(max_size, '\0');
+  auto size = ZDICT_trainFromBuffer(std::data(dictionary), max_size,
+                                    std::data(buffer), std::data(sizes),
+                                    static_cast<unsigned>(std::size(sizes)));
+  if (ZDICT_isError(size)) [[unlikely]] {
+    throw RuntimeError("Failed to train dictionary: {}",
+                       ZDICT_getErrorName(size));
+  }
+  dictionary.resize(size);
+  auto id = ZDICT_getDictID(std::data(dictionary), size);
+
+  exec_cached(
+      "CREATE TABLE IF NOT EXISTS klib_zstd_dictionary(id INTEGER NOT NULL "
+      "UNIQUE, data BLOB NOT NULL)");
+  auto stmt = acquire_statement(
+      "INSERT OR REPLACE INTO klib_zstd_dictionary(id, data) VALUES(?, ?)");
+  SCOPE_EXIT { release_statement(stmt); };
+  CHECK_SQLITE2(sqlite3_bind_int64(stmt, 1, id), db_);
+  CHECK_SQLITE2(sqlite3_bind_blob64(stmt, 2, std::data(dictionary), size,
+                                    SQLITE_STATIC),
+                db_);
+  if (sqlite3_step(stmt) != SQLITE_DONE) [[unlikely]] {
+    throw RuntimeError(sqlite3_errmsg(db_));
+  }
+
+  cdict_.reset();
+  return id;
+}
+
+void SqlDatabase::SqlDatabaseImpl::compress_blob(std::string &out,
+                                                 const char *data,
+                                                 std::size_t size,
+                                                 BlobCompression compression) {
+  out.resize(ZSTD_compressBound(size));
+
+  std::size_t length;
+  if (compression == BlobCompression::ZstdDictionary) {
+    length = ZSTD_compress_usingCDict(cctx_.get(), std::data(out),
+                                      std::size(out), data, size, get_cdict());
+  } else {
+    // Same as compress_data()
+    length = ZSTD_compressCCtx(cctx_.get(), std::data(out), std::size(out),
+                               data, size, -4);
+  }
+  CHECK_ZSTD(length);
+  out.resize(length);
+}
+
+std::string SqlDatabase::SqlDatabaseImpl::decompress_blob(
+    std::string_view blob) {
+  auto length = ZSTD_getFrameContentSize(std::data(blob), std::size(blob));
+  if (length == ZSTD_CONTENTSIZE_ERROR) [[unlikely]] {
+    throw RuntimeError("Not compressed by zstd");
+  } else if (length == ZSTD_CONTENTSIZE_UNKNOWN) [[unlikely]] {
+    throw RuntimeError("Original size unknown");
+  }
+  std::string result;
+  result.resize(length);
+
+  std::size_t rc;
+  if (auto id = ZSTD_getDictID_fromFrame(std::data(blob), std::size(blob));
+      id != 0) {
+    rc = ZSTD_decompress_usingDDict(dctx_.get(), std::data(result), length,
+                                    std::data(blob), std::size(blob),
+                                    get_ddict(id));
+  } else {
+    rc = ZSTD_decompressDCtx(dctx_.get(), std::data(result), length,
+                             std::data(blob), std::size(blob));
+  }
+  CHECK_ZSTD(rc);
+
+  return result;
+}
+
+const ZSTD_CDict *SqlDatabase::SqlDatabaseImpl::get_cdict() {
+  if (cdict_) {
+    return cdict_.get();
+  }
+
+  auto stmt = acquire_statement(
+      "SELECT data FROM klib_zstd_dictionary ORDER BY rowid DESC LIMIT 1");
+  SCOPE_EXIT { release_statement(stmt); };
+  if (sqlite3_step(stmt) != SQLITE_ROW) [[unlikely]] {
+    throw RuntimeError("No dictionary, call train_dictionary() first");
+  }
+
+  cdict_.reset(ZSTD_createCDict(sqlite3_column_blob(stmt, 0),
+                                sqlite3_column_bytes(stmt, 0),
+                                ZSTD_CLEVEL_DEFAULT));
+  if (!cdict_) [[unlikely]] {
+    throw RuntimeError("ZSTD_createCDict() failed");
+  }
+
+  return cdict_.get();
+}
+
+const ZSTD_DDict *SqlDatabase::SqlDatabaseImpl::get_ddict(std::uint32_t id) {
+  if (auto iter = ddicts_.find(id); iter != std::end(ddicts_)) {
+    return iter->second.get();
+  }
 
-bool Column::is_null() const { return impl_->is_null(); }
+  auto stmt =
+      acquire_statement("SELECT data FROM klib_zstd_dictionary WHERE id=?");
+  SCOPE_EXIT { release_statement(stmt); };
+  CHECK_SQLITE2(sqlite3_bind_int64(stmt, 1, id), db_);
+  if (sqlite3_step(stmt) != SQLITE_ROW) [[unlikely]] {
+    throw RuntimeError("Dictionary {} not found", id);
+  }
 
-std::int32_t Column::as_int32() const { return impl_->as_int32(); }
+  std::unique_ptr<ZSTD_DDict, decltype(ZSTD_freeDDict) *> ddict(
+      ZSTD_createDDict(sqlite3_column_blob(stmt, 0),
+                       sqlite3_column_bytes(stmt, 0)),
+      ZSTD_freeDDict);
+  if (!ddict) [[unlikely]] {
+    throw RuntimeError("ZSTD_createDDict() failed");
+  }
 
-std::int64_t Column::as_int64() const { return impl_->as_int64(); }
+  return ddicts_.emplace(id, std::move(ddict)).first->second.get();
+}
 
-double Column::as_double() const { return impl_->as_double(); }
+void SqlDatabase::SqlDatabaseImpl::exec_cached(std::string_view sql) {
+  auto stmt = acquire_statement(sql);
+  SCOPE_EXIT { release_statement(stmt); };
 
-std::string Column::as_text() const { return impl_->as_text(); }
+  if (sqlite3_step(stmt) != SQLITE_DONE) [[unlikely]] {
+    throw RuntimeError(sqlite3_errmsg(db_));
+  }
+}
+
+bool Column::is_null() const { return get_type() == SQLITE_NULL; }
+
+std::int32_t Column::as_int32() const {
+  if (get_type() != SQLITE_INTEGER) [[unlikely]] {
+    throw InvalidArgument("Not a integer");
+  }
 
-std::string Column::as_blob() const { return impl_->as_blob(); }
+  return sqlite3_column_int(stmt_, index_);
+}
 
-Column::Column(SqlQuery &sql_query, std::int32_t index)
-    : impl_(std::make_unique<ColumnImpl>(sql_query, index)) {}
+std::int64_t Column::as_int64() const {
+  if (get_type() != SQLITE_INTEGER) [[unlikely]] {
+    throw InvalidArgument("Not a integer");
+  }
+
+  return sqlite3_column_int64(stmt_, index_);
+}
+
+double Column::as_double() const {
+  if (get_type() != SQLITE_FLOAT) [[unlikely]] {
+    throw InvalidArgument("Not a float");
+  }
+
+  return sqlite3_column_double(stmt_, index_);
+}
+
+std::string Column::as_text() const { return std::string(as_text_view()); }
+
+std::string_view Column::as_text_view() const {
+  if (get_type() != SQLITE_TEXT) [[unlikely]] {
+    throw InvalidArgument("Not a text");
+  }
+
+  // sqlite3_column_bytes() must be called after sqlite3_column_text()
+  auto text =
+      reinterpret_cast<const char *>(sqlite3_column_text(stmt_, index_));
+  return {text, static_cast<std::size_t>(sqlite3_column_bytes(stmt_, index_))};
+}
+
+std::string Column::as_blob(BlobCompression compression) const {
+  auto blob = as_blob_view();
+  if (compression == BlobCompression::None) {
+    return std::string(blob);
+  }
+
+  return query_->impl_->decompress_blob(blob);
+}
+
+std::string_view Column::as_blob_view() const {
+  if (get_type() != SQLITE_BLOB) [[unlikely]] {
+    throw InvalidArgument("Not a blob");
+  }
+
+  auto blob = static_cast<const char *>(sqlite3_column_blob(stmt_, index_));
+  return {blob, static_cast<std::size_t>(sqlite3_column_bytes(stmt_, index_))};
+}
+
+std::int32_t Column::get_type() const {
+  return sqlite3_column_type(stmt_, index_);
+}
 
 SqlQuery::SqlQuery(SqlDatabase &db)
     : impl_(std::make_unique<SqlQueryImpl>(db)) {}
@@ -402,12 +825,24 @@ void SqlQuery::bind(std::int32_t index, double value) {
   impl_->bind(index, value);
 }
 
-void SqlQuery::bind(std::int32_t index, const std::string &value) {
+void SqlQuery::bind_null(std::int32_t index) { impl_->bind_null(index); }
+
+void SqlQuery::bind(std::int32_t index, std::string_view value) {
   impl_->bind(index, value);
 }
 
-void SqlQuery::bind(std::int32_t index, const char *value, std::size_t size) {
-  impl_->bind(index, value, size);
+void SqlQuery::bind(std::int32_t index, const char *value, std::size_t size,
+                    BlobCompression compression) {
+  impl_->bind(index, value, size, compression);
+}
+
+void SqlQuery::bind_static(std::int32_t index, std::string_view value) {
+  impl_->bind_static(index, value);
+}
+
+void SqlQuery::bind_static(std::int32_t index, const char *value,
+                           std::size_t size) {
+  impl_->bind_static(index, value, size);
 }
 
 std::int32_t SqlQuery::exec() { return impl_->exec(); }
@@ -419,13 +854,23 @@ std::string SqlQuery::get_column_name(std::int32_t index) {
 }
 
 Column SqlQuery::get_column(std::int32_t index) {
-  return impl_->get_column(*this, index);
+  return Column(this, impl_->get_column_stmt(index), index);
+}
+
+sqlite3_stmt *SqlQuery::get_row_stmt(std::int32_t column_count) const {
+  return impl_->get_column_stmt(column_count - 1);
 }
 
 SqlDatabase::SqlDatabase(const std::string &db_name,
                          SqlDatabase::OpenMode open_type,
-                         const std::string &password)
-    : impl_(std::make_unique<SqlDatabaseImpl>(db_name, open_type, password)) {}
+                         const std::string &password,
+                         const CipherOptions &options)
+    : impl_(std::make_unique<SqlDatabaseImpl>(db_name, open_type, &password,
+                                              options)) {}
+
+SqlDatabase::SqlDatabase(const std::string &db_name,
+                         SqlDatabase::OpenMode open_type)
+    : impl_(std::make_unique<SqlDatabaseImpl>(db_name, open_type, nullptr)) {}
 
 SqlDatabase::~SqlDatabase() = default;
 
@@ -435,8 +880,21 @@ void SqlDatabase::commit() { impl_->commit(); }
 
 void SqlDatabase::rollback() { impl_->rollback(); }
 
+bool SqlDatabase::in_transaction() const { return impl_->in_transaction(); }
+
 void SqlDatabase::vacuum() { impl_->vacuum(); }
 
+void SqlDatabase::backup(const std::string &dest_name,
+                         std::int32_t pages_per_step,
+                         std::chrono::milliseconds interval,
+                         const BackupCallback &callback) {
+  impl_->backup(dest_name, pages_per_step, interval, callback);
+}
+
+void SqlDatabase::vacuum_into(const std::string &dest_name, bool compress) {
+  impl_->vacuum_into(dest_name, compress);
+}
+
 bool SqlDatabase::table_exists(const std::string &name) {
   return impl_->table_exists(*this, name);
 }
@@ -457,4 +915,475 @@ std::int32_t SqlDatabase::exec(std::string_view sql) {
   return impl_->exec(sql);
 }
 
+void SqlDatabase::set_statement_cache_size(std::size_t size) {
+  impl_->set_statement_cache_size(size);
+}
+
+std::uint32_t SqlDatabase::train_dictionary(
+    const std::vector<std::string> &samples, std::size_t max_size) {
+  return impl_->train_dictionary(samples, max_size);
+}
+
+class SqlDatabasePool::SqlDatabasePoolImpl {
+ public:
+  SqlDatabasePoolImpl(const std::string &db_name, const std::string &password,
+                      std::size_t reader_count,
+                      std::chrono::milliseconds busy_timeout,
+                      const CipherOptions &options);
+
+  [[nodiscard]] SqlDatabase *acquire_reader();
+  [[nodiscard]] SqlDatabase *acquire_writer();
+  void release(SqlDatabase *db, bool writer) noexcept;
+
+  [[nodiscard]] std::size_t reader_count() const {
+    return std::size(readers_);
+  }
+
+ private:
+  std::unique_ptr<SqlDatabase> writer_;
+  std::vector<std::unique_ptr<SqlDatabase>> readers_;
+
+  std::mutex mutex_;
+  std::condition_variable writer_cv_;
+  std::condition_variable reader_cv_;
+  bool writer_leased_ = false;
+  std::vector<SqlDatabase *> idle_readers_;
+};
+
+SqlDatabasePool::SqlDatabasePoolImpl::SqlDatabasePoolImpl(
+    const std::string &db_name, const std::string &password,
+    std::size_t reader_count, std::chrono::milliseconds busy_timeout,
+    const CipherOptions &options) {
+  if (reader_count == 0) [[unlikely]] {
+    throw InvalidArgument("At least one reader is required");
+  }
+
+  const auto busy_timeout_sql =
+      "PRAGMA busy_timeout=" + std::to_string(busy_timeout.count());
+
+  // The journal mode is persistent, set it before the readers are opened
+  writer_ = std::make_unique<SqlDatabase>(db_name, SqlDatabase::ReadWrite,
+                                          password, options);
+  writer_->exec(busy_timeout_sql);
+  writer_->exec("PRAGMA journal_mode=WAL");
+  writer_->exec("PRAGMA synchronous=NORMAL");
+
+  readers_.reserve(reader_count);
+  idle_readers_.reserve(reader_count);
+  for (std::size_t i = 0; i < reader_count; ++i) {
+    // Opened as read-write so that the -shm file can be used, writes are
+    // rejected by query_only
+    auto reader = std::make_unique<SqlDatabase>(db_name, SqlDatabase::ReadWrite,
+                                                password, options);
+    reader->exec(busy_timeout_sql);
+    reader->exec("PRAGMA query_only=ON");
+
+    idle_readers_.push_back(reader.get());
+    readers_.push_back(std::move(reader));
+  }
+}
+
+SqlDatabase *SqlDatabasePool::SqlDatabasePoolImpl::acquire_reader() {
+  std::unique_lock lock(mutex_);
+  reader_cv_.wait(lock, [this] { return !std::empty(idle_readers_); });
+
+  auto db = idle_readers_.back();
+  idle_readers_.pop_back();
+  return db;
+}
+
+SqlDatabase *SqlDatabasePool::SqlDatabasePoolImpl::acquire_writer() {
+  std::unique_lock lock(mutex_);
+  writer_cv_.wait(lock, [this] { return !writer_leased_; });
+
+  writer_leased_ = true;
+  return writer_.get();
+}
+
+void SqlDatabasePool::SqlDatabasePoolImpl::release(SqlDatabase *db,
+                                                   bool writer) noexcept {
+  {
+    std::lock_guard lock(mutex_);
+    if (writer) {
+      writer_leased_ = false;
+    } else {
+      idle_readers_.push_back(db);
+    }
+  }
+
+  if (writer) {
+    writer_cv_.notify_one();
+  } else {
+    reader_cv_.notify_one();
+  }
+}
+
+SqlDatabasePool::Lease::Lease(Lease &&other) noexcept
+    : pool_(std::exchange(other.pool_, nullptr)),
+      db_(std::exchange(other.db_, nullptr)),
+      writer_(other.writer_) {}
+
+SqlDatabasePool::Lease &SqlDatabasePool::Lease::operator=(
+    Lease &&other) noexcept {
+  if (this != &other) {
+    release();
+    pool_ = std::exchange(other.pool_, nullptr);
+    db_ = std::exchange(other.db_, nullptr);
+    writer_ = other.writer_;
+  }
+  return *this;
+}
+
+SqlDatabasePool::Lease::~Lease() { release(); }
+
+void SqlDatabasePool::Lease::release() noexcept {
+  if (db_) {
+    pool_->release(db_, writer_);
+    pool_ = nullptr;
+    db_ = nullptr;
+  }
+}
+
+SqlDatabasePool::SqlDatabasePool(const std::string &db_name,
+                                 const std::string &password,
+                                 std::size_t reader_count,
+                                 std::chrono::milliseconds busy_timeout,
+                                 const CipherOptions &options)
+    : impl_(std::make_unique<SqlDatabasePoolImpl>(
+          db_name, password, reader_count, busy_timeout, options)) {}
+
+SqlDatabasePool::~SqlDatabasePool() = default;
+
+SqlDatabasePool::Lease SqlDatabasePool::reader() {
+  return Lease(this, impl_->acquire_reader(), false);
+}
+
+SqlDatabasePool::Lease SqlDatabasePool::writer() {
+  return Lease(this, impl_->acquire_writer(), true);
+}
+
+std::size_t SqlDatabasePool::reader_count() const {
+  return impl_->reader_count();
+}
+
+void SqlDatabasePool::release(SqlDatabase *db, bool writer) noexcept {
+  impl_->release(db, writer);
+}
+
+class AsyncSqlDatabase::AsyncSqlDatabaseImpl {
+ public:
+  AsyncSqlDatabaseImpl(const std::string &db_name, const std::string &password,
+                       const CipherOptions &options,
+                       std::size_t max_batch_size);
+
+  AsyncSqlDatabaseImpl(const AsyncSqlDatabaseImpl &) = delete;
+  AsyncSqlDatabaseImpl(AsyncSqlDatabaseImpl &&) = delete;
+  AsyncSqlDatabaseImpl &operator=(const AsyncSqlDatabaseImpl &) = delete;
+  AsyncSqlDatabaseImpl &operator=(AsyncSqlDatabaseImpl &&) = delete;
+
+  ~AsyncSqlDatabaseImpl();
+
+  void post(std::function<void(SqlDatabase &)> task);
+  [[nodiscard]] std::future<std::int32_t> post_write(
+      std::function<std::int32_t(SqlDatabase &)> write);
+
+ private:
+  struct Write {
+    std::function<std::int32_t(SqlDatabase &)> func;
+    std::promise<std::int32_t> promise;
+  };
+  using Task = std::variant<std::function<void(SqlDatabase &)>, Write>;
+
+  void push(Task task);
+  void work();
+  void run_writes(std::vector<Write> &writes);
+
+  SqlDatabase db_;
+  std::size_t max_batch_size_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Task> tasks_;
+  bool stop_ = false;
+
+  // Started last, after the members it uses
+  std::thread worker_;
+};
+
+AsyncSqlDatabase::AsyncSqlDatabaseImpl::AsyncSqlDatabaseImpl(
+    const std::string &db_name, const std::string &password,
+    const CipherOptions &options, std::size_t max_batch_size)
+    : db_(db_name, SqlDatabase::ReadWrite, password, options),
+      max_batch_size_(std::max<std::size_t>(max_batch_size, 1)),
+      worker_([this] { work(); }) {}
+
+AsyncSqlDatabase::AsyncSqlDatabaseImpl::~AsyncSqlDatabaseImpl() {
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_one();
+  worker_.join();
+}
+
+void AsyncSqlDatabase::AsyncSqlDatabaseImpl::post(
+    std::function<void(SqlDatabase &)> task) {
+  push(std::move(task));
+}
+
+std::future<std::int32_t> AsyncSqlDatabase::AsyncSqlDatabaseImpl::post_write(
+    std::function<std::int32_t(SqlDatabase &)> write) {
+  std::promise<std::int32_t> promise;
+  auto future = promise.get_future();
+  push(Write{std::move(write), std::move(promise)});
+  return future;
+}
+
+void AsyncSqlDatabase::AsyncSqlDatabaseImpl::push(Task task) {
+  {
+    std::lock_guard lock(mutex_);
+    tasks_.push_back(std::move(task));
+  }
+  cv_.notify_one();
+}
+
+void AsyncSqlDatabase::AsyncSqlDatabaseImpl::work() {
+  std::deque<Task> tasks;
+  std::vector<Write> writes;
+
+  while (true) {
+    {
+      std::unique_lock lock(mutex_);
+      cv_.wait(lock, [this] { return stop_ || !std::empty(tasks_); });
+      if (std::empty(tasks_)) {
+        return;
+      }
+      tasks.swap(tasks_);
+    }
+
+    for (auto &task : tasks) {
+      if (auto write = std::get_if<Write>(&task)) {
+        writes.push_back(std::move(*write));
+        if (std::size(writes) == max_batch_size_) {
+          run_writes(writes);
+        }
+        continue;
+      }
+
+      run_writes(writes);
+      // Exceptions are stored in the future by std::packaged_task
+      std::get<std::function<void(SqlDatabase &)>>(task)(db_);
+    }
+    run_writes(writes);
+    tasks.clear();
+  }
+}
+
+void AsyncSqlDatabase::AsyncSqlDatabaseImpl::run_writes(
+    std::vector<Write> &writes) {
+  if (std::empty(writes)) {
+    return;
+  }
+  SCOPE_EXIT { writes.clear(); };
+
+  auto fail_all = [&](std::exception_ptr error) {
+    for (auto &write : writes) {
+      write.promise.set_exception(error);
+    }
+  };
+
+  try {
+    db_.transaction();
+  } catch (...) {
+    fail_all(std::current_exception());
+    return;
+  }
+
+  SqlQuery savepoint(db_);
+  SqlQuery release(db_);
+  SqlQuery rollback_to(db_);
+  std::vector<std::int32_t> results;
+  std::vector<std::exception_ptr> errors;
+  results.reserve(std::size(writes));
+  errors.reserve(std::size(writes));
+
+  try {
+    savepoint.prepare("SAVEPOINT klib_async_write");
+    release.prepare("RELEASE klib_async_write");
+    rollback_to.prepare("ROLLBACK TO klib_async_write");
+
+    for (auto &write : writes) {
+      savepoint.exec();
+      try {
+        results.push_back(write.func(db_));
+        errors.emplace_back();
+      } catch (...) {
+        // SQLite has rolled back the whole transaction, the batch fails with
+        // this error
+        if (!db_.in_transaction()) {
+          throw;
+        }
+        results.push_back(0);
+        errors.push_back(std::current_exception());
+        rollback_to.exec();
+      }
+      release.exec();
+    }
+
+    savepoint.finalize();
+    release.finalize();
+    rollback_to.finalize();
+    db_.commit();
+  } catch (...) {
+    auto exception = std::current_exception();
+    // SQLite has already rolled back on errors such as SQLITE_FULL, and the
+    // futures carry the original error, a failed rollback must not take the
+    // process down
+    try {
+      if (db_.in_transaction()) {
+        db_.rollback();
+      }
+    } catch (const std::exception &err) {
+      warn("AsyncSqlDatabase rollback failed: {}", err.what());
+    }
+    fail_all(exception);
+    return;
+  }
+
+  for (std::size_t i = 0; i < std::size(writes); ++i) {
+    if (errors[i]) {
+      writes[i].promise.set_exception(errors[i]);
+    } else {
+      writes[i].promise.set_value(results[i]);
+    }
+  }
+}
+
+AsyncSqlDatabase::AsyncSqlDatabase(const std::string &db_name,
+                                   const std::string &password,
+                                   const CipherOptions &options,
+                                   std::size_t max_batch_size)
+    : impl_(std::make_unique<AsyncSqlDatabaseImpl>(db_name, password, options,
+                                                   max_batch_size)) {}
+
+AsyncSqlDatabase::~AsyncSqlDatabase() = default;
+
+void AsyncSqlDatabase::post(std::function<void(SqlDatabase &)> task) {
+  impl_->post(std::move(task));
+}
+
+std::future<std::int32_t> AsyncSqlDatabase::post_write(
+    std::function<std::int32_t(SqlDatabase &)> write) {
+  return impl_->post_write(std::move(write));
+}
+
+LoaderPragmaGuard::LoaderPragmaGuard(SqlDatabase &db,
+                                     std::string_view journal_mode,
+                                     std::int64_t cache_size)
+    : db_(db) {
+  SqlQuery query(db);
+  query.prepare("PRAGMA synchronous");
+  if (!query.next()) [[unlikely]] {
+    throw RuntimeError("Failed to get synchronous");
+  }
+  synchronous_ = query.get_column(0).as_int64();
+
+  query.prepare("PRAGMA journal_mode");
+  if (!query.next()) [[unlikely]] {
+    throw RuntimeError("Failed to get journal_mode");
+  }
+  journal_mode_ = query.get_column(0).as_text();
+
+  query.prepare("PRAGMA cache_size");
+  if (!query.next()) [[unlikely]] {
+    throw RuntimeError("Failed to get cache_size");
+  }
+  cache_size_ = query.get_column(0).as_int64();
+  query.finalize();
+
+  db_.exec("PRAGMA synchronous=OFF");
+  if (!std::empty(journal_mode)) {
+    db_.exec("PRAGMA journal_mode=" + std::string(journal_mode));
+  }
+  db_.exec("PRAGMA cache_size=" + std::to_string(cache_size));
+}
+
+LoaderPragmaGuard::~LoaderPragmaGuard() {
+  // synchronous and journal_mode cannot be changed inside a transaction
+  if (db_.in_transaction()) [[unlikely]] {
+    warn("~LoaderPragmaGuard(): a transaction is still open, pragmas are not "
+         "restored");
+    return;
+  }
+
+  try {
+    db_.exec("PRAGMA synchronous=" + std::to_string(synchronous_));
+    db_.exec("PRAGMA journal_mode=" + journal_mode_);
+    db_.exec("PRAGMA cache_size=" + std::to_string(cache_size_));
+  } catch (const std::exception &err) {
+    warn("~LoaderPragmaGuard() failed: {}", err.what());
+  }
+}
+
+namespace detail {
+
+bool column_is_null(sqlite3_stmt *stmt, std::int32_t index) {
+  return sqlite3_column_type(stmt, index) == SQLITE_NULL;
+}
+
+std::int32_t column_int32(sqlite3_stmt *stmt, std::int32_t index) {
+  return sqlite3_column_int(stmt, index);
+}
+
+std::int64_t column_int64(sqlite3_stmt *stmt, std::int32_t index) {
+  return sqlite3_column_int64(stmt, index);
+}
+
+double column_double(sqlite3_stmt *stmt, std::int32_t index) {
+  return sqlite3_column_double(stmt, index);
+}
+
+std::string_view column_text(sqlite3_stmt *stmt, std::int32_t index) {
+  // sqlite3_column_bytes() must be called after sqlite3_column_text()
+  auto text = reinterpret_cast<const char *>(sqlite3_column_text(stmt, index));
+  if (!text) {
+    return {};
+  }
+  return {text, static_cast<std::size_t>(sqlite3_column_bytes(stmt, index))};
+}
+
+std::string insert_sql(std::string_view table_name,
+                       const std::vector<std::string> &columns,
+                       std::size_t column_count, std::size_t row_count) {
+  if (std::size(columns) != column_count) [[unlikely]] {
+    throw InvalidArgument("Expected {} column names, got {}", column_count,
+                          std::size(columns));
+  }
+
+  std::string sql = "INSERT INTO ";
+  sql.append(table_name).append("(");
+  for (std::size_t i = 0; i < column_count; ++i) {
+    if (i != 0) {
+      sql.append(", ");
+    }
+    sql.append(columns[i]);
+  }
+  sql.append(") VALUES");
+
+  std::string row = "(?";
+  for (std::size_t i = 1; i < column_count; ++i) {
+    row.append(", ?");
+  }
+  row.append(")");
+
+  sql.reserve(std::size(sql) + row_count * (std::size(row) + 2));
+  for (std::size_t i = 0; i < row_count; ++i) {
+    sql.append(i == 0 ? "" : ", ").append(row);
+  }
+
+  return sql;
+}
+
+}  // namespace detail
+
 }  // namespace klib
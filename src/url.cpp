@@ -1,200 +1,1574 @@
+/**
+ * @see https://url.spec.whatwg.org/
+ * @see https://www.rfc-editor.org/rfc/rfc3492
+ */
+
 #include "klib/url.h"
 
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
 #include <vector>
 
-#include <curl/curl.h>
-#include <boost/algorithm/string.hpp>
-#include <scope_guard.hpp>
+#define XXH_STATIC_LINKING_ONLY
+#include <xxhash.h>
 
-#include "klib/exception.h"
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-#define CHECK_CURL_URL(rc)                         \
-  do {                                             \
-    if (rc != CURLUcode::CURLUE_OK) [[unlikely]] { \
-      throw RuntimeError(curl_url_strerror(rc));   \
-    }                                              \
-  } while (0)
+#include "klib/exception.h"
+#include "klib/unicode.h"
 
 namespace klib {
 
-std::string url_encode(const std::string& str) {
-  auto ptr = curl_easy_escape(nullptr, str.c_str(), 0);
-  SCOPE_EXIT { curl_free(ptr); };
-  if (!ptr) [[unlikely]] {
-    throw RuntimeError("curl_easy_escape() failed");
+namespace {
+
+enum class EncodeSet : std::uint8_t {
+  C0Control = 1 << 0,
+  Fragment = 1 << 1,
+  Query = 1 << 2,
+  SpecialQuery = 1 << 3,
+  Path = 1 << 4,
+  Userinfo = 1 << 5,
+  Form = 1 << 6,
+};
+
+constexpr std::array<std::uint8_t, 256> make_encode_table() {
+  std::array<std::uint8_t, 256> table = {};
+  auto add = [&](EncodeSet set, EncodeSet base, std::string_view chars) {
+    for (std::size_t c = 0; c < 256; ++c) {
+      if (table[c] & static_cast<std::uint8_t>(base)) {
+        table[c] |= static_cast<std::uint8_t>(set);
+      }
+    }
+    for (auto c : chars) {
+      table[static_cast<unsigned char>(c)] |= static_cast<std::uint8_t>(set);
+    }
+  };
+
+  for (std::size_t c = 0; c < 256; ++c) {
+    if (c < 0x20 || c > 0x7E) {
+      table[c] |= static_cast<std::uint8_t>(EncodeSet::C0Control);
+    }
+  }
+  add(EncodeSet::Fragment, EncodeSet::C0Control, " \"<>`");
+  add(EncodeSet::Query, EncodeSet::C0Control, " \"#<>");
+  add(EncodeSet::SpecialQuery, EncodeSet::Query, "'");
+  add(EncodeSet::Path, EncodeSet::Query, "?`{}");
+  add(EncodeSet::Userinfo, EncodeSet::Path, "/:;=@[\\]^|");
+  add(EncodeSet::Form, EncodeSet::Userinfo, "$%&+,!'()~");
+
+  return table;
+}
+
+constexpr auto encode_table = make_encode_table();
+
+constexpr char hex_digits[] = "0123456789ABCDEF";
+
+bool need_encode(char c, EncodeSet set) {
+  return encode_table[static_cast<unsigned char>(c)] &
+         static_cast<std::uint8_t>(set);
+}
+
+void append_encoded(std::string &out, std::string_view str, EncodeSet set) {
+  while (!std::empty(str)) {
+    auto iter = std::find_if(std::begin(str), std::end(str),
+                             [set](char c) { return need_encode(c, set); });
+    auto length = static_cast<std::size_t>(iter - std::begin(str));
+    out.append(std::data(str), length);
+    if (length == std::size(str)) {
+      break;
+    }
+
+    auto byte = static_cast<unsigned char>(str[length]);
+    if (set == EncodeSet::Form && byte == ' ') {
+      out.push_back('+');
+    } else {
+      out.push_back('%');
+      out.push_back(hex_digits[byte >> 4]);
+      out.push_back(hex_digits[byte & 0xF]);
+    }
+    str.remove_prefix(length + 1);
+  }
+}
+
+std::int32_t hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+bool is_alpha(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+char to_lower(char c) {
+  return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+// Returns -1 if the scheme is not special, 0 if it has no default port
+std::int32_t special_port(std::string_view scheme) {
+  if (scheme == "http" || scheme == "ws") {
+    return 80;
+  }
+  if (scheme == "https" || scheme == "wss") {
+    return 443;
+  }
+  if (scheme == "ftp") {
+    return 21;
+  }
+  if (scheme == "file") {
+    return 0;
+  }
+  return -1;
+}
+
+bool is_forbidden_host(char c) {
+  switch (c) {
+    case '\0':
+    case '\t':
+    case '\n':
+    case '\r':
+    case ' ':
+    case '#':
+    case '/':
+    case ':':
+    case '<':
+    case '>':
+    case '?':
+    case '@':
+    case '[':
+    case '\\':
+    case ']':
+    case '^':
+    case '|':
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool is_forbidden_domain(char c) {
+  auto byte = static_cast<unsigned char>(c);
+  return is_forbidden_host(c) || byte <= 0x1F || c == '%' || byte == 0x7F;
+}
+
+bool is_single_dot(std::string_view segment) {
+  return segment == "." || segment == "%2e" || segment == "%2E";
+}
+
+bool is_double_dot(std::string_view segment) {
+  if (std::size(segment) == 2) {
+    return segment == "..";
+  }
+  if (std::size(segment) == 4) {
+    return segment == ".%2e" || segment == ".%2E" || segment == "%2e." ||
+           segment == "%2E.";
+  }
+  if (std::size(segment) == 6) {
+    return (segment[0] == '%' && segment[1] == '2' &&
+            to_lower(segment[2]) == 'e') &&
+           (segment[3] == '%' && segment[4] == '2' &&
+            to_lower(segment[5]) == 'e');
+  }
+  return false;
+}
+
+[[noreturn]] void invalid_url(std::string_view url, std::string_view reason) {
+  throw InvalidArgument("Invalid URL({}): {}", reason, url);
+}
+
+void append_punycode(std::string &out, const std::u32string &label) {
+  constexpr std::uint32_t base = 36;
+  constexpr std::uint32_t t_min = 1;
+  constexpr std::uint32_t t_max = 26;
+  constexpr std::uint32_t skew = 38;
+  constexpr std::uint32_t damp = 700;
+
+  auto adapt = [](std::uint32_t delta, std::uint32_t points, bool first) {
+    delta = first ? delta / damp : delta / 2;
+    delta += delta / points;
+    std::uint32_t k = 0;
+    while (delta > ((base - t_min) * t_max) / 2) {
+      delta /= base - t_min;
+      k += base;
+    }
+    return k + (base - t_min + 1) * delta / (delta + skew);
+  };
+  auto digit = [](std::uint32_t d) {
+    return static_cast<char>(d < 26 ? 'a' + d : '0' + d - 26);
+  };
+
+  out.append("xn--");
+  std::uint32_t basic = 0;
+  for (auto c : label) {
+    if (c < 0x80) {
+      out.push_back(to_lower(static_cast<char>(c)));
+      ++basic;
+    }
+  }
+  if (basic > 0) {
+    out.push_back('-');
+  }
+
+  std::uint32_t n = 128;
+  std::uint32_t delta = 0;
+  std::uint32_t bias = 72;
+  std::uint32_t handled = basic;
+  const auto length = static_cast<std::uint32_t>(std::size(label));
+  while (handled < length) {
+    std::uint32_t m = std::numeric_limits<std::uint32_t>::max();
+    for (auto c : label) {
+      if (c >= n && c < m) {
+        m = c;
+      }
+    }
+    if (m - n > (std::numeric_limits<std::uint32_t>::max() - delta) /
+                    (handled + 1)) [[unlikely]] {
+      throw InvalidArgument("Punycode overflow");
+    }
+    delta += (m - n) * (handled + 1);
+    n = m;
+
+    for (auto c : label) {
+      if (c < n) {
+        ++delta;
+      } else if (c == n) {
+        auto q = delta;
+        for (auto k = base;; k += base) {
+          auto t = k <= bias ? t_min : k >= bias + t_max ? t_max : k - bias;
+          if (q < t) {
+            break;
+          }
+          out.push_back(digit(t + (q - t) % (base - t)));
+          q = (q - t) / (base - t);
+        }
+        out.push_back(digit(q));
+        bias = adapt(delta, handled + 1, handled == basic);
+        delta = 0;
+        ++handled;
+      }
+    }
+    ++delta;
+    ++n;
+  }
+}
+
+bool ends_in_number(std::string_view host) {
+  if (!std::empty(host) && host.back() == '.') {
+    host.remove_suffix(1);
+  }
+  auto last = host.substr(host.rfind('.') + 1);
+  if (std::empty(last)) {
+    return false;
+  }
+  if (std::all_of(std::begin(last), std::end(last), is_digit)) {
+    return true;
+  }
+  return std::size(last) >= 2 && last[0] == '0' &&
+         (last[1] == 'x' || last[1] == 'X') &&
+         std::all_of(std::begin(last) + 2, std::end(last),
+                     [](char c) { return hex_value(c) != -1; });
+}
+
+std::optional<std::uint64_t> parse_ipv4_number(std::string_view str) {
+  if (std::empty(str)) {
+    return {};
+  }
+
+  std::int32_t radix = 10;
+  if (std::size(str) >= 2 && str[0] == '0' &&
+      (str[1] == 'x' || str[1] == 'X')) {
+    radix = 16;
+    str.remove_prefix(2);
+  } else if (std::size(str) >= 2 && str[0] == '0') {
+    radix = 8;
+    str.remove_prefix(1);
+  }
+  if (std::empty(str)) {
+    return 0;
+  }
+
+  std::uint64_t value = 0;
+  for (auto c : str) {
+    auto d = hex_value(c);
+    if (d == -1 || d >= radix) {
+      return {};
+    }
+    value = value * radix + d;
+    // Anything larger fails anyway
+    if (value > 0xFFFFFFFFFF) {
+      return {};
+    }
+  }
+  return value;
+}
+
+void append_ipv4(std::string &out, std::string_view host,
+                 std::string_view url) {
+  if (!std::empty(host) && host.back() == '.') {
+    host.remove_suffix(1);
+  }
+
+  std::array<std::uint64_t, 4> parts = {};
+  std::size_t count = 0;
+  while (true) {
+    auto dot = host.find('.');
+    if (count == 4) {
+      invalid_url(url, "too many IPv4 parts");
+    }
+    auto number = parse_ipv4_number(host.substr(0, dot));
+    if (!number) {
+      invalid_url(url, "invalid IPv4 number");
+    }
+    parts[count++] = *number;
+    if (dot == std::string_view::npos) {
+      break;
+    }
+    host.remove_prefix(dot + 1);
+  }
+
+  for (std::size_t i = 0; i + 1 < count; ++i) {
+    if (parts[i] > 255) {
+      invalid_url(url, "IPv4 part out of range");
+    }
+  }
+  if (parts[count - 1] >= (std::uint64_t(1) << (8 * (5 - count)))) {
+    invalid_url(url, "IPv4 address out of range");
+  }
+
+  auto address = parts[count - 1];
+  for (std::size_t i = 0; i + 1 < count; ++i) {
+    address += parts[i] << (8 * (3 - i));
+  }
+
+  for (std::int32_t i = 3; i >= 0; --i) {
+    out.append(std::to_string((address >> (8 * i)) & 0xFF));
+    if (i != 0) {
+      out.push_back('.');
+    }
+  }
+}
+
+void append_ipv6(std::string &out, std::string_view input,
+                 std::string_view url) {
+  std::array<std::uint16_t, 8> address = {};
+  std::int32_t piece_index = 0;
+  std::int32_t compress = -1;
+  std::size_t pointer = 0;
+  auto c = [&](std::size_t offset = 0) {
+    return pointer + offset < std::size(input) ? input[pointer + offset]
+                                               : '\0';
+  };
+  auto at_end = [&] { return pointer >= std::size(input); };
+
+  if (c() == ':') {
+    if (c(1) != ':') {
+      invalid_url(url, "IPv6 address starts with a single colon");
+    }
+    pointer += 2;
+    compress = ++piece_index;
+  }
+
+  while (!at_end()) {
+    if (piece_index == 8) {
+      invalid_url(url, "too many IPv6 pieces");
+    }
+    if (c() == ':') {
+      if (compress != -1) {
+        invalid_url(url, "multiple IPv6 compressions");
+      }
+      ++pointer;
+      compress = ++piece_index;
+      continue;
+    }
+
+    std::uint32_t value = 0;
+    std::size_t length = 0;
+    while (length < 4 && !at_end() && hex_value(c()) != -1) {
+      value = value * 16 + hex_value(c());
+      ++pointer;
+      ++length;
+    }
+
+    if (c() == '.') {
+      if (length == 0 || piece_index > 6) {
+        invalid_url(url, "invalid IPv4 in IPv6");
+      }
+      pointer -= length;
+      std::int32_t numbers_seen = 0;
+      while (!at_end()) {
+        std::int32_t ipv4_piece = -1;
+        if (numbers_seen > 0) {
+          if (c() == '.' && numbers_seen < 4) {
+            ++pointer;
+          } else {
+            invalid_url(url, "invalid IPv4 in IPv6");
+          }
+        }
+        if (!is_digit(c())) {
+          invalid_url(url, "invalid IPv4 in IPv6");
+        }
+        while (is_digit(c())) {
+          auto number = c() - '0';
+          if (ipv4_piece == -1) {
+            ipv4_piece = number;
+          } else if (ipv4_piece == 0) {
+            invalid_url(url, "invalid IPv4 in IPv6");
+          } else {
+            ipv4_piece = ipv4_piece * 10 + number;
+          }
+          if (ipv4_piece > 255) {
+            invalid_url(url, "invalid IPv4 in IPv6");
+          }
+          ++pointer;
+        }
+        address[piece_index] = static_cast<std::uint16_t>(
+            address[piece_index] * 0x100 + ipv4_piece);
+        ++numbers_seen;
+        if (numbers_seen == 2 || numbers_seen == 4) {
+          ++piece_index;
+        }
+      }
+      if (numbers_seen != 4) {
+        invalid_url(url, "invalid IPv4 in IPv6");
+      }
+      break;
+    } else if (c() == ':') {
+      ++pointer;
+      if (at_end()) {
+        invalid_url(url, "IPv6 address ends with a colon");
+      }
+    } else if (!at_end()) {
+      invalid_url(url, "invalid IPv6 address");
+    }
+    address[piece_index++] = static_cast<std::uint16_t>(value);
+  }
+
+  if (compress != -1) {
+    auto swaps = piece_index - compress;
+    piece_index = 7;
+    while (piece_index != 0 && swaps > 0) {
+      std::swap(address[piece_index], address[compress + swaps - 1]);
+      --piece_index;
+      --swaps;
+    }
+  } else if (piece_index != 8) {
+    invalid_url(url, "too few IPv6 pieces");
+  }
+
+  // The first longest run of at least two zero pieces is compressed
+  std::int32_t best_start = -1;
+  std::int32_t best_length = 1;
+  for (std::int32_t i = 0; i < 8;) {
+    auto j = i;
+    while (j < 8 && address[j] == 0) {
+      ++j;
+    }
+    if (j - i > best_length) {
+      best_start = i;
+      best_length = j - i;
+    }
+    i = j == i ? i + 1 : j;
+  }
+
+  out.push_back('[');
+  for (std::int32_t i = 0; i < 8; ++i) {
+    if (i == best_start) {
+      out.append(i == 0 ? "::" : ":");
+      i += best_length - 1;
+      continue;
+    }
+    std::array<char, 4> buffer;
+    auto [ptr, ec] = std::to_chars(std::data(buffer),
+                                   std::data(buffer) + std::size(buffer),
+                                   address[i], 16);
+    out.append(std::data(buffer), ptr);
+    if (i != 7) {
+      out.push_back(':');
+    }
+  }
+  out.push_back(']');
+}
+
+void append_domain(std::string &out, std::string_view host,
+                   std::string_view url) {
+  std::string decoded;
+  if (host.find('%') != std::string_view::npos) {
+    decoded = url_decode(host);
+    host = decoded;
+  }
+
+  const auto begin = std::size(out);
+  if (std::all_of(std::begin(host), std::end(host), [](char c) {
+        return static_cast<unsigned char>(c) < 0x80;
+      })) {
+    if (std::any_of(std::begin(host), std::end(host), is_forbidden_domain)) {
+      invalid_url(url, "forbidden host code point");
+    }
+    out.append(host);
+    std::transform(std::begin(out) + begin, std::end(out),
+                   std::begin(out) + begin, to_lower);
+  } else {
+    std::string str(host);
+    if (!validate_utf8(str)) {
+      invalid_url(url, "host is not valid UTF-8");
+    }
+    std::u32string label;
+    auto flush = [&] {
+      if (std::all_of(std::begin(label), std::end(label),
+                      [](char32_t c) { return c < 0x80; })) {
+        for (auto c : label) {
+          out.push_back(to_lower(static_cast<char>(c)));
+        }
+      } else {
+        append_punycode(out, label);
+      }
+      label.clear();
+    };
+    for (auto c : utf8_to_utf32(str)) {
+      // Ideographic and fullwidth full stops are label separators as well
+      if (c == '.' || c == U'。' || c == U'．' || c == U'｡') {
+        flush();
+        out.push_back('.');
+      } else if (c < 0x80 && is_forbidden_domain(static_cast<char>(c))) {
+        invalid_url(url, "forbidden host code point");
+      } else {
+        label.push_back(c);
+      }
+    }
+    flush();
+  }
+
+  auto domain = std::string_view(out).substr(begin);
+  if (std::empty(domain)) {
+    invalid_url(url, "empty host");
+  }
+  if (ends_in_number(domain)) {
+    std::string ipv4;
+    append_ipv4(ipv4, domain, url);
+    out.resize(begin);
+    out.append(ipv4);
+  }
+}
+
+void append_host(std::string &out, std::string_view host, bool special,
+                 std::string_view url) {
+  if (!std::empty(host) && host.front() == '[') {
+    if (host.back() != ']') {
+      invalid_url(url, "unterminated IPv6 address");
+    }
+    append_ipv6(out, host.substr(1, std::size(host) - 2), url);
+  } else if (!special) {
+    if (std::any_of(std::begin(host), std::end(host), is_forbidden_host)) {
+      invalid_url(url, "forbidden host code point");
+    }
+    append_encoded(out, host, EncodeSet::C0Control);
+  } else {
+    append_domain(out, host, url);
+  }
+}
+
+void append_path(std::string &out, std::size_t path_start,
+                 std::string_view path, bool special) {
+  auto is_separator = [special](char c) {
+    return c == '/' || (special && c == '\\');
+  };
+
+  std::size_t begin = 0;
+  if (!std::empty(path) && is_separator(path.front())) {
+    begin = 1;
+  }
+
+  while (true) {
+    auto end = begin;
+    while (end < std::size(path) && !is_separator(path[end])) {
+      ++end;
+    }
+    auto segment = path.substr(begin, end - begin);
+    const bool last = end == std::size(path);
+
+    if (is_double_dot(segment)) {
+      if (auto pos = out.rfind('/');
+          pos != std::string::npos && pos >= path_start) {
+        out.resize(pos);
+      }
+      if (last) {
+        out.push_back('/');
+      }
+    } else if (is_single_dot(segment)) {
+      if (last) {
+        out.push_back('/');
+      }
+    } else {
+      out.push_back('/');
+      append_encoded(out, segment, EncodeSet::Path);
+    }
+
+    if (last) {
+      break;
+    }
+    begin = end + 1;
+  }
+}
+
+void append_form_encoded(
+    std::string &out,
+    const phmap::flat_hash_map<std::string, std::string> &params) {
+  for (const auto &[name, value] : params) {
+    if (!std::empty(out)) {
+      out.push_back('&');
+    }
+    append_encoded(out, name, EncodeSet::Form);
+    out.push_back('=');
+    append_encoded(out, value, EncodeSet::Form);
+  }
+}
+
+// Bit N is set if the byte is encoded by UrlEncodeSet N
+constexpr std::array<std::uint8_t, 256> make_escape_table() {
+  std::array<std::uint8_t, 256> table = {};
+  auto keep = [&](UrlEncodeSet set, std::string_view chars) {
+    for (auto c : chars) {
+      table[static_cast<unsigned char>(c)] &=
+          static_cast<std::uint8_t>(~(1 << static_cast<std::int32_t>(set)));
+    }
+  };
+
+  std::string_view alnum =
+      "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+  for (auto &item : table) {
+    item = 0xF;
+  }
+  for (auto set : {UrlEncodeSet::Component, UrlEncodeSet::Path,
+                   UrlEncodeSet::Query, UrlEncodeSet::Form}) {
+    keep(set, alnum);
+  }
+  keep(UrlEncodeSet::Component, "-._~");
+  keep(UrlEncodeSet::Path, "-._~!$&'()*+,;=:@/");
+  keep(UrlEncodeSet::Query, "-._~!$'()*,;:@/?");
+  keep(UrlEncodeSet::Form, "*-._");
+
+  return table;
+}
+
+constexpr auto escape_table = make_escape_table();
+
+bool need_escape(char c, UrlEncodeSet set) {
+  return escape_table[static_cast<unsigned char>(c)] &
+         (1 << static_cast<std::int32_t>(set));
+}
+
+#if defined(__AVX2__)
+using Vector = __m256i;
+
+Vector load(const char *ptr) {
+  return _mm256_loadu_si256(reinterpret_cast<const Vector *>(ptr));
+}
+
+Vector equal(Vector v, char c) {
+  return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c));
+}
+
+Vector greater(Vector v, char c) {
+  return _mm256_cmpgt_epi8(v, _mm256_set1_epi8(c));
+}
+
+Vector less(Vector v, char c) {
+  return _mm256_cmpgt_epi8(_mm256_set1_epi8(c), v);
+}
+
+Vector bit_and(Vector a, Vector b) { return _mm256_and_si256(a, b); }
+
+Vector bit_and_not(Vector a, Vector b) { return _mm256_andnot_si256(b, a); }
+
+Vector bit_or(Vector a, Vector b) { return _mm256_or_si256(a, b); }
+
+Vector zero() { return _mm256_setzero_si256(); }
+
+std::uint32_t to_mask(Vector v) {
+  return static_cast<std::uint32_t>(_mm256_movemask_epi8(v));
+}
+#elif defined(__SSE2__)
+using Vector = __m128i;
+
+Vector load(const char *ptr) {
+  return _mm_loadu_si128(reinterpret_cast<const Vector *>(ptr));
+}
+
+Vector equal(Vector v, char c) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); }
+
+Vector greater(Vector v, char c) {
+  return _mm_cmpgt_epi8(v, _mm_set1_epi8(c));
+}
+
+Vector less(Vector v, char c) { return _mm_cmplt_epi8(v, _mm_set1_epi8(c)); }
+
+Vector bit_and(Vector a, Vector b) { return _mm_and_si128(a, b); }
+
+Vector bit_and_not(Vector a, Vector b) { return _mm_andnot_si128(b, a); }
+
+Vector bit_or(Vector a, Vector b) { return _mm_or_si128(a, b); }
+
+Vector zero() { return _mm_setzero_si128(); }
+
+std::uint32_t to_mask(Vector v) {
+  return static_cast<std::uint32_t>(_mm_movemask_epi8(v));
+}
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#define KLIB_URL_SIMD
+
+constexpr std::size_t vector_size = sizeof(Vector);
+
+// The comparisons are signed, so bytes >= 0x80 are never in range
+Vector in_range(Vector v, char low, char high) {
+  return bit_and(greater(v, static_cast<char>(low - 1)),
+                 less(v, static_cast<char>(high + 1)));
+}
+
+template <char... chars>
+Vector any_of(Vector v) {
+  auto result = zero();
+  ((result = bit_or(result, equal(v, chars))), ...);
+  return result;
+}
+
+Vector alnum(Vector v) {
+  return bit_or(in_range(v, '0', '9'),
+                bit_or(in_range(v, 'A', 'Z'), in_range(v, 'a', 'z')));
+}
+
+// Must be kept in sync with make_escape_table()
+template <UrlEncodeSet set>
+Vector unescaped(Vector v) {
+  if constexpr (set == UrlEncodeSet::Component) {
+    return bit_or(alnum(v), any_of<'-', '.', '_', '~'>(v));
+  } else if constexpr (set == UrlEncodeSet::Path) {
+    return bit_and_not(in_range(v, '!', '~'),
+                       any_of<'"', '#', '%', '<', '>', '?', '[', '\\', ']',
+                              '^', '`', '{', '|', '}'>(v));
+  } else if constexpr (set == UrlEncodeSet::Query) {
+    return bit_and_not(in_range(v, '!', '~'),
+                       any_of<'"', '#', '%', '&', '+', '<', '=', '>', '[',
+                              '\\', ']', '^', '`', '{', '|', '}'>(v));
+  } else {
+    return bit_or(alnum(v), any_of<'*', '-', '.', '_'>(v));
   }
+}
+#endif
 
-  return ptr;
+// Length of the prefix that does not need to be encoded
+template <UrlEncodeSet set>
+std::size_t unescaped_prefix(std::string_view str) {
+  std::size_t i = 0;
+#ifdef KLIB_URL_SIMD
+  for (; i + vector_size <= std::size(str); i += vector_size) {
+    auto length = static_cast<std::size_t>(
+        std::countr_one(to_mask(unescaped<set>(load(std::data(str) + i)))));
+    if (length < vector_size) {
+      return i + length;
+    }
+  }
+#endif
+  while (i < std::size(str) && !need_escape(str[i], set)) {
+    ++i;
+  }
+  return i;
 }
 
-std::string url_decode(const std::string& str) {
-  std::int32_t length;
-  auto ptr = curl_easy_unescape(nullptr, str.c_str(), 0, &length);
-  SCOPE_EXIT { curl_free(ptr); };
-  if (!ptr) [[unlikely]] {
-    throw RuntimeError("curl_easy_unescape() failed");
+template <UrlEncodeSet set>
+char *encode_to(std::string_view str, char *out) {
+  while (!std::empty(str)) {
+    auto length = unescaped_prefix<set>(str);
+    out = std::copy_n(std::data(str), length, out);
+    if (length == std::size(str)) {
+      break;
+    }
+
+    auto byte = static_cast<unsigned char>(str[length]);
+    if (set == UrlEncodeSet::Form && byte == ' ') {
+      *out++ = '+';
+    } else {
+      *out++ = '%';
+      *out++ = hex_digits[byte >> 4];
+      *out++ = hex_digits[byte & 0xF];
+    }
+    str.remove_prefix(length + 1);
   }
 
-  return std::string(ptr, length);
+  return out;
 }
 
-URL::URL(const std::string& url) {
-  auto c_url = curl_url();
-  SCOPE_EXIT { curl_url_cleanup(c_url); };
-  if (!c_url) {
-    throw RuntimeError("curl_url() failed");
+// Length of the prefix that does not contain '%', or '+' if plus_as_space
+std::size_t undecoded_prefix(std::string_view str, bool plus_as_space) {
+  std::size_t i = 0;
+#ifdef KLIB_URL_SIMD
+  for (; i + vector_size <= std::size(str); i += vector_size) {
+    auto v = load(std::data(str) + i);
+    auto special = plus_as_space ? any_of<'%', '+'>(v) : equal(v, '%');
+    if (auto mask = to_mask(special); mask != 0) {
+      return i + static_cast<std::size_t>(std::countr_zero(mask));
+    }
+  }
+#endif
+  while (i < std::size(str) && str[i] != '%' &&
+         !(plus_as_space && str[i] == '+')) {
+    ++i;
   }
+  return i;
+}
 
-  auto rc = curl_url_set(c_url, CURLUPART_URL, url.c_str(), 0);
-  CHECK_CURL_URL(rc);
+// Buffers the canonical URL on the stack and feeds it to XXH3, the result is
+// the same as hashing the whole string at once
+class Hasher {
+ public:
+  void append(std::string_view str) {
+    if (size_ + std::size(str) > std::size(buffer_)) {
+      flush();
+      if (std::size(str) > std::size(buffer_)) {
+        update(str);
+        return;
+      }
+    }
+    std::copy_n(std::data(str), std::size(str), std::data(buffer_) + size_);
+    size_ += std::size(str);
+  }
 
-  {
-    char* str;
-    SCOPE_EXIT { curl_free(str); };
-    rc = curl_url_get(c_url, CURLUPART_SCHEME, &str, 0);
-    if (rc != CURLUcode::CURLUE_NO_SCHEME) {
-      CHECK_CURL_URL(rc);
-      schema_ = str;
+  void push_back(char c) {
+    if (size_ == std::size(buffer_)) {
+      flush();
     }
+    buffer_[size_++] = c;
   }
 
-  {
-    char* str;
-    SCOPE_EXIT { curl_free(str); };
-    rc = curl_url_get(c_url, CURLUPART_HOST, &str, 0);
-    if (rc != CURLUcode::CURLUE_NO_HOST) {
-      CHECK_CURL_URL(rc);
-      host_ = str;
+  std::uint64_t digest64() {
+    if (!streaming_) {
+      return XXH3_64bits(std::data(buffer_), size_);
     }
+    flush();
+    return XXH3_64bits_digest(&state_);
   }
 
-  {
-    char* str;
-    SCOPE_EXIT { curl_free(str); };
-    rc = curl_url_get(c_url, CURLUPART_PORT, &str, 0);
-    if (rc != CURLUcode::CURLUE_NO_PORT) {
-      CHECK_CURL_URL(rc);
-      std::from_chars(str, str + std::strlen(str), port_);
+  XXH128_hash_t digest128() {
+    if (!streaming_) {
+      return XXH3_128bits(std::data(buffer_), size_);
     }
+    flush();
+    return XXH3_128bits_digest(&state_);
   }
 
-  {
-    char* str;
-    SCOPE_EXIT { curl_free(str); };
-    rc = curl_url_get(c_url, CURLUPART_PATH, &str, CURLU_URLDECODE);
-    CHECK_CURL_URL(rc);
-    path_ = str;
+ private:
+  void flush() {
+    update(std::string_view(std::data(buffer_), size_));
+    size_ = 0;
   }
 
-  {
-    char* str;
-    SCOPE_EXIT { curl_free(str); };
-    rc = curl_url_get(c_url, CURLUPART_QUERY, &str, CURLU_URLDECODE);
-    if (rc != CURLUcode::CURLUE_NO_QUERY) {
-      CHECK_CURL_URL(rc);
+  void update(std::string_view str) {
+    if (!streaming_) {
+      // The 64-bit and 128-bit variants share the same state and update
+      if (XXH3_128bits_reset(&state_) == XXH_ERROR) [[unlikely]] {
+        throw RuntimeError("XXH3_128bits_reset() failed");
+      }
+      streaming_ = true;
+    }
+    if (XXH3_128bits_update(&state_, std::data(str), std::size(str)) ==
+        XXH_ERROR) [[unlikely]] {
+      throw RuntimeError("XXH3_128bits_update() failed");
+    }
+  }
+
+  std::array<char, 1024> buffer_;
+  std::size_t size_ = 0;
+  bool streaming_ = false;
+  XXH3_state_t state_;
+};
+
+bool is_unreserved(char c) {
+  return is_alpha(c) || is_digit(c) || c == '-' || c == '.' || c == '_' ||
+         c == '~';
+}
+
+// Percent-encoded unreserved characters are decoded, the hex digits of the
+// others are uppercased
+template <typename Sink>
+void append_normalized(Sink &sink, std::string_view str, bool lower) {
+  while (!std::empty(str)) {
+    auto length = lower ? 0 : std::min(str.find('%'), std::size(str));
+    sink.append(str.substr(0, length));
+    str.remove_prefix(length);
+    if (std::empty(str)) {
+      break;
+    }
 
-      std::string query_str = str;
-      std::vector<std::string> query;
-      for (const auto& item :
-           boost::split(query, query_str, boost::is_any_of("&"),
-                        boost::token_compress_on)) {
-        auto index = item.find('=');
-        query_.emplace(item.substr(0, index), item.substr(index + 1));
+    if (str[0] != '%') {
+      sink.push_back(to_lower(str[0]));
+      str.remove_prefix(1);
+    } else if (std::size(str) >= 3 && hex_value(str[1]) != -1 &&
+               hex_value(str[2]) != -1) {
+      auto byte = static_cast<unsigned char>(hex_value(str[1]) * 16 +
+                                             hex_value(str[2]));
+      if (auto c = static_cast<char>(byte); is_unreserved(c)) {
+        sink.push_back(lower ? to_lower(c) : c);
+      } else {
+        sink.push_back('%');
+        sink.push_back(hex_digits[byte >> 4]);
+        sink.push_back(hex_digits[byte & 0xF]);
       }
+      str.remove_prefix(3);
+    } else {
+      sink.push_back('%');
+      str.remove_prefix(1);
     }
   }
+}
+
+// Writes to a buffer known to be large enough
+struct BufferSink {
+  void append(std::string_view str) {
+    out = std::copy_n(std::data(str), std::size(str), out);
+  }
 
-  {
-    char* str;
-    SCOPE_EXIT { curl_free(str); };
-    rc = curl_url_get(c_url, CURLUPART_FRAGMENT, &str, 0);
-    if (rc != CURLUcode::CURLUE_NO_FRAGMENT) {
-      CHECK_CURL_URL(rc);
-      fragment_ = str;
+  void push_back(char c) { *out++ = c; }
+
+  char *out;
+};
+
+template <typename Sink>
+void append_sorted_query(Sink &sink, std::string_view query) {
+  // Most queries fit on the stack
+  std::array<std::string_view, 32> inline_params;
+  std::vector<std::string_view> heap_params;
+  std::size_t count = 0;
+
+  // Normalizing never makes the query longer
+  std::array<char, 2048> inline_buffer;
+  std::string heap_buffer;
+  if (query.find('%') != std::string_view::npos) {
+    auto begin = std::data(inline_buffer);
+    if (std::size(query) > std::size(inline_buffer)) {
+      heap_buffer.resize(std::size(query));
+      begin = std::data(heap_buffer);
     }
+    BufferSink buffer_sink = {begin};
+    append_normalized(buffer_sink, query, false);
+    query = std::string_view(begin, buffer_sink.out - begin);
   }
 
-  {
-    char* str;
-    SCOPE_EXIT { curl_free(str); };
-    rc = curl_url_get(c_url, CURLUPART_USER, &str, 0);
-    if (rc != CURLUcode::CURLUE_NO_USER) {
-      CHECK_CURL_URL(rc);
-      user_ = str;
+  for (auto rest = query; !std::empty(rest);) {
+    auto param = rest.substr(0, rest.find('&'));
+    rest.remove_prefix(std::min(std::size(param) + 1, std::size(rest)));
+    if (std::empty(param)) {
+      continue;
+    }
+
+    if (count < std::size(inline_params)) {
+      inline_params[count] = param;
+    } else {
+      if (std::empty(heap_params)) {
+        heap_params.assign(std::begin(inline_params), std::end(inline_params));
+      }
+      heap_params.push_back(param);
     }
+    ++count;
   }
 
-  {
-    char* str;
-    SCOPE_EXIT { curl_free(str); };
-    rc = curl_url_get(c_url, CURLUPART_PASSWORD, &str, 0);
-    if (rc != CURLUcode::CURLUE_NO_PASSWORD) {
-      CHECK_CURL_URL(rc);
-      password_ = str;
+  auto begin = std::empty(heap_params) ? std::data(inline_params)
+                                       : std::data(heap_params);
+  // By name, then by value
+  std::sort(begin, begin + count, [](std::string_view a, std::string_view b) {
+    auto a_name = a.substr(0, a.find('='));
+    auto b_name = b.substr(0, b.find('='));
+    return a_name != b_name ? a_name < b_name : a < b;
+  });
+  for (std::size_t i = 0; i < count; ++i) {
+    sink.push_back(i == 0 ? '?' : '&');
+    sink.append(begin[i]);
+  }
+}
+
+template <typename Sink>
+void append_canonical(Sink &sink, const URL &url) {
+  auto href = url.href();
+  auto schema = url.schema();
+  sink.append(schema);
+  sink.push_back(':');
+
+  auto has_authority = href.substr(std::size(schema)).starts_with("://");
+  if (has_authority) {
+    sink.append("//");
+    append_normalized(sink, url.user(), false);
+    if (!std::empty(url.password())) {
+      sink.push_back(':');
+      append_normalized(sink, url.password(), false);
+    }
+    if (!std::empty(url.user()) || !std::empty(url.password())) {
+      sink.push_back('@');
+    }
+    append_normalized(sink, url.host(), true);
+    if (url.port() != 0) {
+      char port[8];
+      auto end = std::to_chars(port, port + std::size(port), url.port()).ptr;
+      sink.push_back(':');
+      sink.append(std::string_view(port, end - port));
     }
   }
+
+  auto path = url.path();
+  if (!has_authority && path.starts_with("//")) {
+    sink.append("/.");
+  }
+  append_normalized(sink, path, false);
+
+  append_sorted_query(sink, url.query());
 }
 
-std::string URL::to_string() const {
-  auto c_url = curl_url();
-  SCOPE_EXIT { curl_url_cleanup(c_url); };
-  if (!c_url) {
-    throw RuntimeError("curl_url() failed");
+}  // namespace
+
+char *url_encode_to(std::string_view str, char *out, UrlEncodeSet set) {
+  switch (set) {
+    case UrlEncodeSet::Component:
+      return encode_to<UrlEncodeSet::Component>(str, out);
+    case UrlEncodeSet::Path:
+      return encode_to<UrlEncodeSet::Path>(str, out);
+    case UrlEncodeSet::Query:
+      return encode_to<UrlEncodeSet::Query>(str, out);
+    case UrlEncodeSet::Form:
+      return encode_to<UrlEncodeSet::Form>(str, out);
   }
 
-  if (!std::empty(schema_)) {
-    auto rc = curl_url_set(c_url, CURLUPART_SCHEME, schema_.c_str(), 0);
-    CHECK_CURL_URL(rc);
+  throw InvalidArgument("Invalid encode set: {}",
+                        static_cast<std::int32_t>(set));
+}
+
+std::string url_encode(std::string_view str, UrlEncodeSet set) {
+  std::string result;
+  result.resize(std::size(str) * 3);
+
+  auto begin = std::data(result);
+  result.resize(url_encode_to(str, begin, set) - begin);
+
+  return result;
+}
+
+char *url_decode_to(std::string_view str, char *out, bool plus_as_space) {
+  while (!std::empty(str)) {
+    auto length = undecoded_prefix(str, plus_as_space);
+    out = std::copy_n(std::data(str), length, out);
+    if (length == std::size(str)) {
+      break;
+    }
+    str.remove_prefix(length);
+
+    if (str[0] == '+') {
+      *out++ = ' ';
+      str.remove_prefix(1);
+    } else if (std::size(str) >= 3 && hex_value(str[1]) != -1 &&
+               hex_value(str[2]) != -1) {
+      *out++ = static_cast<char>(hex_value(str[1]) * 16 + hex_value(str[2]));
+      str.remove_prefix(3);
+    } else {
+      *out++ = '%';
+      str.remove_prefix(1);
+    }
   }
 
-  if (!std::empty(host_)) {
-    auto rc = curl_url_set(c_url, CURLUPART_HOST, host_.c_str(), 0);
-    CHECK_CURL_URL(rc);
+  return out;
+}
+
+std::string url_decode(std::string_view str, bool plus_as_space) {
+  std::string result;
+  result.resize(std::size(str));
+
+  auto begin = std::data(result);
+  result.resize(url_decode_to(str, begin, plus_as_space) - begin);
+
+  return result;
+}
+
+struct URL::Components {
+  std::string_view schema;
+  std::string_view user;
+  std::string_view password;
+  std::string_view host;
+  std::int32_t port = 0;
+  std::string_view path;
+  std::optional<std::string_view> query;
+  std::optional<std::string_view> fragment;
+  bool has_authority = false;
+};
+
+URL::URL() : buffer_("https://"), has_authority_(true) {
+  scheme_end_ = 5;
+  user_end_ = host_start_ = host_end_ = path_start_ = std::size(buffer_);
+}
+
+URL::URL(std::string_view url) { parse(url, true); }
+
+void URL::set_schema(std::string_view schema) {
+  std::string lower(schema);
+  std::transform(std::begin(lower), std::end(lower), std::begin(lower),
+                 to_lower);
+
+  auto components = this->components();
+  components.schema = lower;
+  components.has_authority = has_authority_ || special_port(lower) != -1;
+  assemble(components);
+}
+
+void URL::set_host(std::string_view host) {
+  if (host.find_first_of("/\\?#@") != std::string_view::npos ||
+      (host.find(':') != std::string_view::npos &&
+       (std::empty(host) || host.front() != '['))) [[unlikely]] {
+    throw InvalidArgument("Invalid host: {}", host);
   }
 
-  if (port_ != 0) {
-    auto port_str = std::to_string(port_);
-    auto rc = curl_url_set(c_url, CURLUPART_PORT, port_str.c_str(), 0);
-    CHECK_CURL_URL(rc);
+  auto components = this->components();
+  components.host = host;
+  components.has_authority = true;
+  assemble(components);
+}
+
+void URL::set_port(std::int32_t port) {
+  if (port < 0 || port > 65535) [[unlikely]] {
+    throw InvalidArgument("Invalid port: {}", port);
   }
 
-  if (!std::empty(path_)) {
-    auto rc =
-        curl_url_set(c_url, CURLUPART_PATH, path_.c_str(), CURLU_URLENCODE);
-    CHECK_CURL_URL(rc);
+  auto components = this->components();
+  components.port = port;
+  assemble(components);
+}
+
+void URL::set_path(std::string_view path) {
+  std::string encoded;
+  if (has_authority_ && (std::empty(path) || path.front() != '/')) {
+    encoded.push_back('/');
   }
+  append_encoded(encoded, path, EncodeSet::Path);
 
-  for (const auto& [key, value] : query_) {
-    std::string query;
-    query.append(key).append("=").append(value);
+  auto components = this->components();
+  components.path = encoded;
+  assemble(components);
+}
 
-    auto rc = curl_url_set(c_url, CURLUPART_QUERY, query.c_str(),
-                           CURLU_APPENDQUERY | CURLU_URLENCODE);
-    CHECK_CURL_URL(rc);
+std::string_view URL::query() const {
+  if (query_start_ == std::string::npos) {
+    return {};
   }
+  auto end = fragment_start_ != std::string::npos ? fragment_start_
+                                                   : std::size(buffer_);
+  return component(query_start_ + 1, end);
+}
 
-  if (!std::empty(fragment_)) {
-    auto rc = curl_url_set(c_url, CURLUPART_FRAGMENT, fragment_.c_str(), 0);
-    CHECK_CURL_URL(rc);
+void URL::set_query(std::string_view query) {
+  if (!std::empty(query) && query.front() == '?') {
+    query.remove_prefix(1);
   }
 
-  if (!std::empty(user_)) {
-    auto rc = curl_url_set(c_url, CURLUPART_USER, user_.c_str(), 0);
-    CHECK_CURL_URL(rc);
+  std::string encoded;
+  append_encoded(encoded, query, EncodeSet::Query);
+
+  auto components = this->components();
+  if (std::empty(encoded)) {
+    components.query.reset();
+  } else {
+    components.query = encoded;
   }
+  assemble(components);
+}
 
-  if (!std::empty(password_)) {
-    auto rc = curl_url_set(c_url, CURLUPART_PASSWORD, password_.c_str(), 0);
-    CHECK_CURL_URL(rc);
+std::optional<std::string> URL::query_param(std::string_view name) const {
+  auto query = this->query();
+  while (!std::empty(query)) {
+    auto item = query.substr(0, query.find('&'));
+    query.remove_prefix(std::min(std::size(item) + 1, std::size(query)));
+    if (std::empty(item)) {
+      continue;
+    }
+
+    auto index = item.find('=');
+    auto key = item.substr(0, index);
+    auto value = index == std::string_view::npos ? std::string_view()
+                                                 : item.substr(index + 1);
+    if (key.find_first_of("%+") == std::string_view::npos
+            ? key == name
+            : url_decode(key, true) == name) {
+      return url_decode(value, true);
+    }
+  }
+
+  return {};
+}
+
+phmap::flat_hash_map<std::string, std::string> URL::query_params() const {
+  phmap::flat_hash_map<std::string, std::string> result;
+
+  auto query = this->query();
+  while (!std::empty(query)) {
+    auto item = query.substr(0, query.find('&'));
+    query.remove_prefix(std::min(std::size(item) + 1, std::size(query)));
+    if (std::empty(item)) {
+      continue;
+    }
+
+    auto index = item.find('=');
+    auto value = index == std::string_view::npos ? std::string_view()
+                                                 : item.substr(index + 1);
+    result.emplace(url_decode(item.substr(0, index), true),
+                   url_decode(value, true));
+  }
+
+  return result;
+}
+
+void URL::set_query_params(
+    const phmap::flat_hash_map<std::string, std::string> &params) {
+  std::string encoded;
+  append_form_encoded(encoded, params);
+  set_query(encoded);
+}
+
+std::string_view URL::fragment() const {
+  if (fragment_start_ == std::string::npos) {
+    return {};
+  }
+  return component(fragment_start_ + 1, std::size(buffer_));
+}
+
+void URL::set_fragment(std::string_view fragment) {
+  if (!std::empty(fragment) && fragment.front() == '#') {
+    fragment.remove_prefix(1);
+  }
+
+  auto components = this->components();
+  if (std::empty(fragment)) {
+    components.fragment.reset();
+  } else {
+    components.fragment = fragment;
+  }
+  assemble(components);
+}
+
+void URL::set_user(std::string_view user) {
+  std::string encoded;
+  append_encoded(encoded, user, EncodeSet::Userinfo);
+
+  auto components = this->components();
+  components.user = encoded;
+  components.has_authority = true;
+  assemble(components);
+}
+
+std::string_view URL::password() const {
+  if (user_end_ < host_start_ && buffer_[user_end_] == ':') {
+    return component(user_end_ + 1, host_start_ - 1);
+  }
+  return {};
+}
+
+void URL::set_password(std::string_view password) {
+  std::string encoded;
+  append_encoded(encoded, password, EncodeSet::Userinfo);
+
+  auto components = this->components();
+  components.password = encoded;
+  components.has_authority = true;
+  assemble(components);
+}
+
+void URL::canonicalize() {
+  std::string url;
+  url.reserve(std::size(buffer_));
+  append_canonical(url, *this);
+  parse(url, false);
+}
+
+std::uint64_t URL::fingerprint() const {
+  Hasher hasher;
+  append_canonical(hasher, *this);
+  return hasher.digest64();
+}
+
+std::pair<std::uint64_t, std::uint64_t> URL::fingerprint128() const {
+  Hasher hasher;
+  append_canonical(hasher, *this);
+  auto hash = hasher.digest128();
+  return {hash.high64, hash.low64};
+}
+
+void URL::parse(std::string_view url, bool strict) {
+  const auto input_url = url;
+
+  // Leading and trailing C0 control or space are removed, so are all ASCII
+  // tab or newline
+  while (!std::empty(url) && static_cast<unsigned char>(url.front()) <= 0x20) {
+    url.remove_prefix(1);
+  }
+  while (!std::empty(url) && static_cast<unsigned char>(url.back()) <= 0x20) {
+    url.remove_suffix(1);
+  }
+  std::string stripped;
+  // string_view::find_first_of() calls memchr() for every character
+  if (std::any_of(std::begin(url), std::end(url), [](char c) {
+        return c == '\t' || c == '\n' || c == '\r';
+      })) {
+    stripped.reserve(std::size(url));
+    std::copy_if(std::begin(url), std::end(url), std::back_inserter(stripped),
+                 [](char c) { return c != '\t' && c != '\n' && c != '\r'; });
+    url = stripped;
+  }
+
+  std::string out;
+  out.reserve(std::size(url) + 16);
+
+  // Scheme
+  if (std::empty(url) || !is_alpha(url.front())) {
+    invalid_url(input_url, "missing scheme");
+  }
+  std::size_t index = 0;
+  while (index < std::size(url) &&
+         (is_alpha(url[index]) || is_digit(url[index]) || url[index] == '+' ||
+          url[index] == '-' || url[index] == '.')) {
+    out.push_back(to_lower(url[index]));
+    ++index;
+  }
+  if (index == std::size(url) || url[index] != ':') {
+    invalid_url(input_url, "missing scheme");
+  }
+  const auto scheme_end = std::size(out);
+  out.push_back(':');
+  url.remove_prefix(index + 1);
+
+  const auto default_port = special_port(out.substr(0, scheme_end));
+  const bool special = default_port != -1;
+  const bool file = default_port == 0;
+  auto is_separator = [special](char c) {
+    return c == '/' || (special && c == '\\');
+  };
+
+  // Authority
+  bool has_authority = false;
+  std::int32_t port = 0;
+  auto user_end = std::size(out);
+  auto host_start = std::size(out);
+  auto host_end = std::size(out);
+
+  if (special && !file && strict) {
+    while (!std::empty(url) && is_separator(url.front())) {
+      url.remove_prefix(1);
+    }
+    has_authority = true;
+  } else if (std::size(url) >= 2 && is_separator(url[0]) &&
+             is_separator(url[1])) {
+    url.remove_prefix(2);
+    has_authority = true;
+  } else if (file) {
+    has_authority = true;
+    // No host, the rest is the path
+    out.append("//");
+    user_end = host_start = host_end = std::size(out);
   }
 
-  char* str;
-  SCOPE_EXIT { curl_free(str); };
-  auto rc = curl_url_get(c_url, CURLUPART_URL, &str, 0);
-  CHECK_CURL_URL(rc);
+  if (has_authority && host_start == scheme_end + 1) {
+    out.append("//");
+    auto end = std::find_if(std::begin(url), std::end(url), [&](char c) {
+      return is_separator(c) || c == '?' || c == '#';
+    });
+    auto authority = url.substr(0, end - std::begin(url));
+    url.remove_prefix(std::size(authority));
+
+    std::string_view user;
+    std::string_view password;
+    if (auto at = authority.rfind('@'); at != std::string_view::npos) {
+      auto userinfo = authority.substr(0, at);
+      auto colon = userinfo.find(':');
+      user = userinfo.substr(0, colon);
+      if (colon != std::string_view::npos) {
+        password = userinfo.substr(colon + 1);
+      }
+      authority.remove_prefix(at + 1);
+    }
+
+    std::string_view host = authority;
+    std::string_view port_str;
+    auto colon = std::string_view::npos;
+    if (!std::empty(host) && host.front() == '[') {
+      if (auto close = host.find(']'); close != std::string_view::npos) {
+        colon = host.find(':', close);
+        if (close + 1 != std::size(host) && colon != close + 1) {
+          invalid_url(input_url, "invalid IPv6 address");
+        }
+      }
+    } else {
+      colon = host.find(':');
+    }
+    if (colon != std::string_view::npos) {
+      port_str = host.substr(colon + 1);
+      host = host.substr(0, colon);
+    }
+
+    if (file) {
+      if (!std::empty(user) || !std::empty(password) ||
+          colon != std::string_view::npos) {
+        invalid_url(input_url, "file URL with credentials or port");
+      }
+    } else if (std::empty(host) && strict &&
+               (special || !std::empty(user) || !std::empty(password) ||
+                colon != std::string_view::npos)) {
+      invalid_url(input_url, "empty host");
+    }
+
+    append_encoded(out, user, EncodeSet::Userinfo);
+    user_end = std::size(out);
+    if (!std::empty(password)) {
+      out.push_back(':');
+      append_encoded(out, password, EncodeSet::Userinfo);
+    }
+    if (user_end != std::size(out) || !std::empty(user)) {
+      out.push_back('@');
+    }
+
+    host_start = std::size(out);
+    if (!std::empty(host)) {
+      append_host(out, host, special, input_url);
+    }
+    host_end = std::size(out);
+    if (file && std::string_view(out).substr(host_start) == "localhost") {
+      out.resize(host_start);
+      host_end = host_start;
+    }
 
-  return str;
+    if (!std::empty(port_str)) {
+      std::uint32_t value = 0;
+      for (auto c : port_str) {
+        if (!is_digit(c)) {
+          invalid_url(input_url, "invalid port");
+        }
+        value = value * 10 + (c - '0');
+        if (value > 65535) {
+          invalid_url(input_url, "port out of range");
+        }
+      }
+      if (static_cast<std::int32_t>(value) != default_port) {
+        port = static_cast<std::int32_t>(value);
+        out.push_back(':');
+        out.append(std::to_string(port));
+      }
+    }
+  }
+
+  // Path
+  auto path_end = std::find_if(std::begin(url), std::end(url),
+                               [](char c) { return c == '?' || c == '#'; });
+  auto path = url.substr(0, path_end - std::begin(url));
+  url.remove_prefix(std::size(path));
+
+  auto path_start = std::size(out);
+  if (special || (!std::empty(path) && path.front() == '/')) {
+    append_path(out, path_start, path, special);
+  } else if (has_authority) {
+    // Non-special URLs may have an empty path
+  } else {
+    // Opaque path, such as mailto:user@example.com
+    append_encoded(out, path, EncodeSet::C0Control);
+  }
+  if (!has_authority && out.compare(path_start, 2, "//") == 0) {
+    out.insert(path_start, "/.");
+    path_start += 2;
+  }
+
+  // Query
+  auto query_start = std::string::npos;
+  if (!std::empty(url) && url.front() == '?') {
+    auto query = url.substr(1, url.find('#') - 1);
+    url.remove_prefix(std::size(query) + 1);
+    query_start = std::size(out);
+    out.push_back('?');
+    append_encoded(out, query,
+                   special ? EncodeSet::SpecialQuery : EncodeSet::Query);
+  }
+
+  // Fragment
+  auto fragment_start = std::string::npos;
+  if (!std::empty(url) && url.front() == '#') {
+    fragment_start = std::size(out);
+    out.push_back('#');
+    append_encoded(out, url.substr(1), EncodeSet::Fragment);
+  }
+
+  buffer_ = std::move(out);
+  has_authority_ = has_authority;
+  port_ = port;
+  scheme_end_ = scheme_end;
+  user_end_ = user_end;
+  host_start_ = host_start;
+  host_end_ = host_end;
+  path_start_ = path_start;
+  query_start_ = query_start;
+  fragment_start_ = fragment_start;
+}
+
+void URL::assemble(const Components &components) {
+  std::string url;
+  url.reserve(std::size(buffer_) + 16);
+
+  url.append(components.schema).push_back(':');
+  if (components.has_authority) {
+    url.append("//").append(components.user);
+    if (!std::empty(components.password)) {
+      url.append(":").append(components.password);
+    }
+    if (!std::empty(components.user) || !std::empty(components.password)) {
+      url.push_back('@');
+    }
+    url.append(components.host);
+    if (components.port != 0) {
+      url.append(":").append(std::to_string(components.port));
+    }
+  }
+  url.append(components.path);
+  if (components.query) {
+    url.append("?").append(*components.query);
+  }
+  if (components.fragment) {
+    url.append("#").append(*components.fragment);
+  }
+
+  parse(url, false);
+}
+
+URL::Components URL::components() const {
+  Components components;
+  components.schema = schema();
+  components.user = user();
+  components.password = password();
+  components.host = host();
+  components.port = port_;
+  components.path = path();
+  if (query_start_ != std::string::npos) {
+    components.query = query();
+  }
+  if (fragment_start_ != std::string::npos) {
+    components.fragment = fragment();
+  }
+  components.has_authority = has_authority_;
+  return components;
 }
 
 }  // namespace klib
@@ -1,12 +1,25 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <curl/curl.h>
 #include <boost/json.hpp>
 #include <catch2/catch_test_macros.hpp>
 
+#include "klib/exception.h"
 #include "klib/hash.h"
 #include "klib/http.h"
+#include "klib/http_server.h"
 #include "klib/url.h"
 #include "klib/util.h"
 
@@ -185,3 +198,520 @@ TEST_CASE("download", "[http]") {
           "0d9ade222c64e912d6957b11c923e214e2e010a18f39bec102f572e693ba2867");
   std::filesystem::remove("zstd-1.5.0.tar.gz");
 }
+
+TEST_CASE("download stream", "[http]") {
+  klib::Request request;
+
+#ifndef NDEBUG
+  request.verbose(true);
+#endif
+
+  const std::string url = httpbin_url + "/image/png";
+
+  auto response = request.get(url);
+  REQUIRE(response.ok());
+  const auto content = std::move(response).text();
+
+  std::string streamed;
+  response = request.get_stream(url, [&](std::string_view data) {
+    streamed.append(data);
+    return true;
+  });
+  REQUIRE(response.ok());
+  REQUIRE(std::empty(response.text()));
+  REQUIRE(streamed == content);
+
+  // Exceptions thrown by the callback reach the caller
+  REQUIRE_THROWS_AS(
+      request.get_stream(url,
+                         [](std::string_view) -> bool {
+                           throw std::length_error("too long");
+                         }),
+      std::length_error);
+
+  response = request.download(url, "image.png");
+  REQUIRE(response.ok());
+  REQUIRE(klib::read_file("image.png", true) == content);
+  REQUIRE(std::filesystem::remove("image.png"));
+}
+
+TEST_CASE("share cache", "[http]") {
+  const auto before = klib::Request::share_statistics();
+
+  constexpr std::int32_t thread_count = 4;
+  constexpr std::int32_t request_count = 4;
+
+  std::vector<std::thread> threads;
+  for (std::int32_t i = 0; i < thread_count; ++i) {
+    threads.emplace_back([] {
+      for (std::int32_t j = 0; j < request_count; ++j) {
+        klib::Request request;
+        request.use_share_cache(true);
+
+        auto response = request.get(httpbin_url + "/get");
+        CHECK(response.ok());
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  const auto after = klib::Request::share_statistics();
+  REQUIRE(after.transfers - before.transfers == thread_count * request_count);
+  REQUIRE(after.tls_handshakes - before.tls_handshakes <
+          thread_count * request_count);
+}
+
+TEST_CASE("conditional request", "[http]") {
+  klib::Request request;
+
+#ifndef NDEBUG
+  request.verbose(true);
+#endif
+
+  const std::string url = httpbin_url + "/etag/klib";
+
+  auto response = request.get(url);
+  REQUIRE(response.ok());
+  REQUIRE(response.headers().contains("etag"));
+
+  auto etag = response.header("ETag");
+  REQUIRE(etag.has_value());
+
+  response = request.get_if_none_match(url, *etag);
+  REQUIRE(response.status() == klib::HttpStatus::HTTP_STATUS_NOT_MODIFIED);
+  REQUIRE(std::empty(response.text()));
+}
+
+TEST_CASE("range request", "[http]") {
+  klib::Request request;
+
+#ifndef NDEBUG
+  request.verbose(true);
+#endif
+
+  const std::string url = httpbin_url + "/range/1024";
+
+  auto response = request.get(url);
+  REQUIRE(response.ok());
+  const auto content = std::move(response).text();
+  REQUIRE(std::size(content) == 1024);
+
+  response = request.get_range(url, 100, 199);
+  REQUIRE(response.status() == klib::HttpStatus::HTTP_STATUS_PARTIAL_CONTENT);
+  REQUIRE(response.text() == content.substr(100, 100));
+
+  const std::string file_name = "range.txt";
+  klib::write_file(file_name, true, content.substr(0, 500));
+  response = request.resume_download(url, file_name);
+  REQUIRE(response.status() == klib::HttpStatus::HTTP_STATUS_PARTIAL_CONTENT);
+  REQUIRE(klib::read_file(file_name, true) == content);
+  REQUIRE(std::filesystem::remove(file_name));
+
+  // Content coding is not requested for a range
+  response = request.get_range(httpbin_url + "/headers", 0);
+  REQUIRE(response.ok());
+  auto headers = boost::json::parse(response.text()).at("headers");
+  REQUIRE_FALSE(headers.as_object().contains("Accept-Encoding"));
+
+  response = request.get(httpbin_url + "/headers");
+  REQUIRE(response.ok());
+  headers = boost::json::parse(response.text()).at("headers");
+  REQUIRE(headers.as_object().contains("Accept-Encoding"));
+}
+
+TEST_CASE("segmented download", "[http]") {
+  klib::Request request;
+
+#ifndef NDEBUG
+  request.verbose(true);
+#endif
+
+  const std::string url = httpbin_url + "/range/102400";
+
+  auto response = request.get(url);
+  REQUIRE(response.ok());
+  const auto content = std::move(response).text();
+
+  const std::string file_name = "segmented.txt";
+  response = request.download_segmented(url, file_name, 4,
+                                        klib::sha256_hex(content));
+  REQUIRE(response.ok());
+  REQUIRE(klib::read_file(file_name, true) == content);
+
+  REQUIRE_THROWS(
+      request.download_segmented(url, file_name, 4, std::string(64, '0')));
+  REQUIRE(!std::filesystem::exists(file_name));
+
+  // A failed HEAD request leaves an existing file alone
+  klib::write_file(file_name, true, content);
+  REQUIRE_THROWS(
+      request.download_segmented("http://127.0.0.1:1/", file_name, 4));
+  REQUIRE(klib::read_file(file_name, true) == content);
+  REQUIRE(std::filesystem::remove(file_name));
+}
+
+TEST_CASE("POST stream", "[http]") {
+  klib::Request request;
+
+#ifndef NDEBUG
+  request.verbose(true);
+#endif
+
+  const std::string content(100000, 'a');
+
+  std::string_view rest = content;
+  auto callback = [&](char *buffer, std::size_t size) {
+    auto length = std::min(size, std::size(rest));
+    std::copy_n(std::data(rest), length, buffer);
+    rest.remove_prefix(length);
+    return length;
+  };
+
+  auto response = request.post_stream(httpbin_url + "/post", callback);
+  REQUIRE(response.ok());
+  REQUIRE(boost::json::parse(response.text()).at("data").as_string() ==
+          content);
+
+  rest = content;
+  response = request.post_stream(httpbin_url + "/post", callback,
+                                 std::size(content));
+  REQUIRE(response.ok());
+  REQUIRE(boost::json::parse(response.text()).at("data").as_string() ==
+          content);
+
+  const std::string file_name = "post.txt";
+  klib::write_file(file_name, true, content);
+  response = request.post_file(httpbin_url + "/post", file_name);
+  REQUIRE(response.ok());
+  REQUIRE(boost::json::parse(response.text()).at("data").as_string() ==
+          content);
+  REQUIRE(std::filesystem::remove(file_name));
+
+  // An exception thrown by the callback is rethrown
+  REQUIRE_THROWS_AS(request.post_stream(httpbin_url + "/post",
+                                        [](char *, std::size_t) -> std::size_t {
+                                          throw std::logic_error("error");
+                                        }),
+                    std::logic_error);
+  // read() fails on a directory
+  REQUIRE_THROWS_AS(request.post_file(httpbin_url + "/post", "."),
+                    klib::RuntimeError);
+}
+
+TEST_CASE("POST compressed", "[http]") {
+  klib::Request request;
+
+#ifndef NDEBUG
+  request.verbose(true);
+#endif
+
+  boost::json::object obj;
+  obj["data"] = std::string(4096, 'a');
+  const auto json = boost::json::serialize(obj);
+
+  for (auto [encoding, name] :
+       {std::pair{klib::ContentEncoding::Gzip, "gzip"},
+        std::pair{klib::ContentEncoding::Zstd, "zstd"},
+        std::pair{klib::ContentEncoding::Brotli, "br"}}) {
+    request.set_request_compression(encoding, 1024);
+
+    auto response = request.post(httpbin_url + "/post", json);
+    REQUIRE(response.ok());
+    auto headers = boost::json::parse(response.text()).at("headers");
+    REQUIRE(headers.at("Content-Encoding").as_string() == name);
+    REQUIRE(std::stoul(headers.at("Content-Length").as_string().c_str()) <
+            std::size(json));
+
+    response = request.post(httpbin_url + "/post", R"({"a": 1})");
+    REQUIRE(response.ok());
+    headers = boost::json::parse(response.text()).at("headers");
+    REQUIRE_FALSE(headers.as_object().contains("Content-Encoding"));
+  }
+}
+
+TEST_CASE("retry policy", "[http]") {
+  std::atomic<std::int32_t> count = 0;
+
+  klib::HttpServer server;
+  auto unavailable = [&](const klib::ServerRequest &,
+                         klib::ServerResponse &response) {
+    if (++count <= 2) {
+      response.status = klib::HttpStatus::HTTP_STATUS_SERVICE_UNAVAILABLE;
+      response.headers["Retry-After"] = "0";
+    } else {
+      response.body = "ok";
+    }
+  };
+  server.route(klib::HttpMethod::HTTP_METHOD_GET, "/unavailable", unavailable);
+  server.route(klib::HttpMethod::HTTP_METHOD_POST, "/unavailable",
+               unavailable);
+  server.route(klib::HttpMethod::HTTP_METHOD_GET, "/later",
+               [](const klib::ServerRequest &, klib::ServerResponse &response) {
+                 response.status =
+                     klib::HttpStatus::HTTP_STATUS_TOO_MANY_REQUESTS;
+                 response.headers["Retry-After"] = "3600";
+               });
+  server.start();
+
+  klib::Request request;
+  request.set_no_proxy();
+
+#ifndef NDEBUG
+  request.verbose(true);
+#endif
+
+  const auto url = "http://127.0.0.1:" + std::to_string(server.port());
+
+  auto response = request.get(url + "/unavailable");
+  REQUIRE(response.status() ==
+          klib::HttpStatus::HTTP_STATUS_SERVICE_UNAVAILABLE);
+  REQUIRE(count == 1);
+
+  klib::RetryPolicy policy;
+  policy.base_delay = std::chrono::milliseconds(10);
+  request.set_retry_policy(policy);
+
+  count = 0;
+  response = request.get(url + "/unavailable");
+  REQUIRE(response.ok());
+  REQUIRE(response.text() == "ok");
+  REQUIRE(count == 3);
+
+  count = 0;
+  response = request.post(url + "/unavailable", R"({"a": 1})");
+  REQUIRE(response.status() ==
+          klib::HttpStatus::HTTP_STATUS_SERVICE_UNAVAILABLE);
+  REQUIRE(count == 1);
+
+  auto begin = std::chrono::steady_clock::now();
+  response = request.get(url + "/later");
+  REQUIRE(response.status() == klib::HttpStatus::HTTP_STATUS_TOO_MANY_REQUESTS);
+  REQUIRE(std::chrono::steady_clock::now() - begin < std::chrono::seconds(1));
+
+  REQUIRE_THROWS(request.get("http://127.0.0.1:1/"));
+}
+
+TEST_CASE("hedged request", "[http]") {
+  std::atomic<std::int32_t> count = 0;
+
+  // The slow handler blocks its worker thread, the second request is likely
+  // to be accepted by another one
+  klib::HttpServer server("127.0.0.1", 0, 4);
+  server.route(
+      klib::HttpMethod::HTTP_METHOD_GET, "/slow",
+      [&](const klib::ServerRequest &, klib::ServerResponse &response) {
+        if (++count == 1) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        }
+        response.body = "ok";
+      });
+  server.start();
+
+  klib::Request request;
+  request.set_no_proxy();
+
+#ifndef NDEBUG
+  request.verbose(true);
+#endif
+
+  const auto url =
+      "http://127.0.0.1:" + std::to_string(server.port()) + "/slow";
+
+  auto response = request.get_hedged(url, {}, std::chrono::milliseconds(50));
+  REQUIRE(response.ok());
+  REQUIRE(response.text() == "ok");
+
+  // The delay adapts to the observed latencies
+  for (std::int32_t i = 0; i < 30; ++i) {
+    response = request.get_hedged(url);
+    REQUIRE(response.ok());
+    REQUIRE(response.text() == "ok");
+  }
+}
+
+TEST_CASE("transfer info", "[http]") {
+  klib::HttpServer server;
+  server.route(klib::HttpMethod::HTTP_METHOD_POST, "/echo",
+               [](const klib::ServerRequest &request,
+                  klib::ServerResponse &response) {
+                 response.body = request.body;
+               });
+  server.start();
+
+  klib::Request request;
+  request.set_no_proxy();
+
+#ifndef NDEBUG
+  request.verbose(true);
+#endif
+
+  auto metrics = std::make_shared<klib::HttpMetrics>();
+  request.set_metrics(metrics);
+
+  const auto url = "http://127.0.0.1:" + std::to_string(server.port());
+  const std::string content(10000, 'a');
+
+  auto response = request.post(url + "/echo", content);
+  REQUIRE(response.ok());
+  auto info = response.transfer_info();
+  REQUIRE(!info.connection_reused);
+  REQUIRE(info.http_version == klib::HttpVersion::Http11);
+  REQUIRE(info.bytes_uploaded == std::ssize(content));
+  REQUIRE(info.bytes_downloaded == std::ssize(content));
+  REQUIRE(info.retries == 0);
+  REQUIRE(info.namelookup <= info.connect);
+  REQUIRE(info.connect <= info.pretransfer);
+  REQUIRE(info.pretransfer <= info.starttransfer);
+  REQUIRE(info.starttransfer <= info.total);
+  REQUIRE(info.total.count() > 0);
+
+  for (std::int32_t i = 0; i < 9; ++i) {
+    response = request.post(url + "/echo", content);
+    REQUIRE(response.ok());
+    REQUIRE(response.transfer_info().connection_reused);
+  }
+
+  REQUIRE(metrics->requests() == 10);
+  REQUIRE(metrics->requests(klib::HttpVersion::Http11) == 10);
+  REQUIRE(metrics->reused_connections() == 9);
+  REQUIRE(metrics->bytes_downloaded() == 10 * std::ssize(content));
+
+  std::uint64_t count = 0;
+  for (const auto &bucket : metrics->histogram(klib::TimingPhase::Total)) {
+    count += bucket.count;
+  }
+  REQUIRE(count == 10);
+  auto p50 = metrics->percentile(klib::TimingPhase::Total, 50);
+  REQUIRE(p50.count() > 0);
+  REQUIRE(p50 <= metrics->percentile(klib::TimingPhase::Total, 100));
+  REQUIRE(metrics->max(klib::TimingPhase::Total) <=
+          metrics->percentile(klib::TimingPhase::Total, 100));
+  REQUIRE_THROWS(metrics->percentile(klib::TimingPhase::Total, 101));
+  REQUIRE(!std::empty(metrics->report()));
+
+  metrics->reset();
+  REQUIRE(metrics->requests() == 0);
+  REQUIRE(metrics->percentile(klib::TimingPhase::Total, 50).count() == 0);
+}
+
+TEST_CASE("HTTP/3", "[http]") {
+  klib::HttpServer server;
+  server.route(klib::HttpMethod::HTTP_METHOD_GET, "/",
+               [](const klib::ServerRequest &, klib::ServerResponse &response) {
+                 response.headers["Alt-Svc"] = R"(h3=":443"; ma=60)";
+                 response.body = "ok";
+               });
+  server.start();
+
+  klib::Request request;
+  request.set_no_proxy();
+
+#ifndef NDEBUG
+  request.verbose(true);
+#endif
+
+  // Falls back to HTTP/1.1 if HTTP/3 is not supported, Alt-Svc is ignored
+  // for cleartext origins
+  REQUIRE_NOTHROW(request.enable_http3(true));
+  const auto url = "http://127.0.0.1:" + std::to_string(server.port());
+  for (std::int32_t i = 0; i < 2; ++i) {
+    auto response = request.get(url);
+    REQUIRE(response.ok());
+    REQUIRE(response.text() == "ok");
+    REQUIRE(response.transfer_info().http_version ==
+            klib::HttpVersion::Http11);
+  }
+
+  REQUIRE_NOTHROW(request.enable_http3(false));
+  REQUIRE(request.get(url).ok());
+
+  if (klib::Request::http3_supported()) {
+    request.enable_http3(true);
+    auto response = request.get("https://cloudflare-quic.com/");
+    REQUIRE(response.ok());
+    response = request.get("https://cloudflare-quic.com/");
+    REQUIRE(response.ok());
+    REQUIRE(response.transfer_info().http_version ==
+            klib::HttpVersion::Http3);
+  }
+}
+
+TEST_CASE("rate limiter", "[http]") {
+  REQUIRE_THROWS(klib::RateLimiter(-1));
+  REQUIRE_THROWS(klib::RateLimiter(1, 0));
+  REQUIRE_THROWS(klib::RateLimiter(1, 1, -1));
+
+  klib::RateLimiter limiter(10, 2);
+  REQUIRE(limiter.try_acquire("a.com"));
+  REQUIRE(limiter.acquire("A.com").count() == 0);
+  REQUIRE(!limiter.try_acquire("a.com"));
+  REQUIRE(limiter.acquire("a.com") > std::chrono::milliseconds(50));
+  REQUIRE(limiter.try_acquire("b.com"));
+
+  limiter.set_host_rate("c.com", 0);
+  for (std::int32_t i = 0; i < 100; ++i) {
+    REQUIRE(limiter.try_acquire("c.com"));
+  }
+
+  limiter.set_host_rate("d.com", 100);
+  auto begin = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (std::int32_t i = 0; i < 4; ++i) {
+    threads.emplace_back([&] {
+      for (std::int32_t j = 0; j < 5; ++j) {
+        limiter.acquire("d.com");
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  REQUIRE(std::chrono::steady_clock::now() - begin >
+          std::chrono::milliseconds(180));
+
+  const std::string content(2 * 1024 * 1024, 'a');
+  klib::HttpServer server;
+  server.route(
+      klib::HttpMethod::HTTP_METHOD_GET, "/",
+      [](const klib::ServerRequest &, klib::ServerResponse &response) {
+        response.body = "ok";
+      });
+  server.route(klib::HttpMethod::HTTP_METHOD_GET, "/large",
+               [&](const klib::ServerRequest &,
+                   klib::ServerResponse &response) { response.body = content; });
+  server.start();
+
+  klib::Request request;
+  request.set_no_proxy();
+
+#ifndef NDEBUG
+  request.verbose(true);
+#endif
+
+  const auto url = "http://127.0.0.1:" + std::to_string(server.port());
+  request.set_rate_limiter(std::make_shared<klib::RateLimiter>(20));
+
+  begin = std::chrono::steady_clock::now();
+  for (std::int32_t i = 0; i < 5; ++i) {
+    REQUIRE(request.get(url).ok());
+  }
+  REQUIRE(std::chrono::steady_clock::now() - begin >
+          std::chrono::milliseconds(180));
+
+  request.set_rate_limiter(
+      std::make_shared<klib::RateLimiter>(0, 1, 1024 * 1024));
+  begin = std::chrono::steady_clock::now();
+  auto response = request.get(url + "/large");
+  REQUIRE(response.ok());
+  REQUIRE(response.text() == content);
+  REQUIRE(std::chrono::steady_clock::now() - begin >
+          std::chrono::milliseconds(800));
+
+  request.set_rate_limiter(nullptr);
+  begin = std::chrono::steady_clock::now();
+  REQUIRE(request.get(url + "/large").ok());
+  REQUIRE(std::chrono::steady_clock::now() - begin <
+          std::chrono::milliseconds(800));
+}
@@ -0,0 +1,395 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <curl/curl.h>
+#include <catch2/catch_test_macros.hpp>
+
+#include "klib/hash.h"
+#include "klib/http.h"
+#include "klib/http_server.h"
+#include "klib/util.h"
+
+namespace {
+
+// Sends raw bytes and reads until the server closes the connection
+std::string exchange(std::uint16_t port, std::string_view request,
+                     bool shut_down_write = false) {
+  auto fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  REQUIRE(fd != -1);
+
+  timeval timeout = {5, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+  REQUIRE(connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0);
+  REQUIRE(send(fd, std::data(request), std::size(request), MSG_NOSIGNAL) ==
+          static_cast<ssize_t>(std::size(request)));
+  if (shut_down_write) {
+    REQUIRE(shutdown(fd, SHUT_WR) == 0);
+  }
+
+  std::string response;
+  std::array<char, 4096> buffer;
+  while (true) {
+    auto size = read(fd, std::data(buffer), std::size(buffer));
+    if (size <= 0) {
+      break;
+    }
+    response.append(std::data(buffer), size);
+  }
+
+  close(fd);
+  return response;
+}
+
+// Speaks HTTP/2 over cleartext from the first byte, which klib::Request does
+// not expose
+std::pair<std::int64_t, std::string> http2_request(
+    const std::string &url, const std::string *post = nullptr,
+    const char *range = nullptr) {
+  auto curl = curl_easy_init();
+  REQUIRE(curl);
+
+  std::string body;
+  auto write = +[](char *data, std::size_t size, std::size_t nmemb,
+                   std::string *out) {
+    out->append(data, size * nmemb);
+    return size * nmemb;
+  };
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_NOPROXY, "*");
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+                   CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+  if (post) {
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post->c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                     static_cast<curl_off_t>(std::size(*post)));
+  }
+  if (range) {
+    curl_easy_setopt(curl, CURLOPT_RANGE, range);
+  }
+
+  REQUIRE(curl_easy_perform(curl) == CURLE_OK);
+
+  long version = 0;
+  curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version);
+  REQUIRE(version == CURL_HTTP_VERSION_2_0);
+  long status = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+
+  curl_easy_cleanup(curl);
+  return {status, body};
+}
+
+}  // namespace
+
+TEST_CASE("HTTP server route", "[http_server]") {
+  klib::HttpServer server;
+  server.route(klib::HttpMethod::HTTP_METHOD_GET, "/hello",
+               [](const klib::ServerRequest &request,
+                  klib::ServerResponse &response) {
+                 response.headers["Content-Type"] = "text/plain";
+                 response.headers["X-Test"] =
+                     request.header("X-Test").value_or("");
+                 response.body = "hello " + request.query;
+               });
+  server.route(klib::HttpMethod::HTTP_METHOD_POST, "/echo",
+               [](const klib::ServerRequest &request,
+                  klib::ServerResponse &response) {
+                 response.body = request.body;
+               });
+  server.route(klib::HttpMethod::HTTP_METHOD_GET, "/throw",
+               [](const klib::ServerRequest &, klib::ServerResponse &) {
+                 throw std::runtime_error("error");
+               });
+  server.route(klib::HttpMethod::HTTP_METHOD_GET, "/throw_int",
+               [](const klib::ServerRequest &, klib::ServerResponse &) {
+                 throw 42;
+               });
+  server.start();
+  REQUIRE(server.port() != 0);
+  REQUIRE_THROWS(server.route(klib::HttpMethod::HTTP_METHOD_GET, "/",
+                              [](const klib::ServerRequest &,
+                                 klib::ServerResponse &) {}));
+
+  klib::Request request;
+  request.set_no_proxy();
+
+#ifndef NDEBUG
+  request.verbose(true);
+#endif
+
+  const auto url = "http://127.0.0.1:" + std::to_string(server.port());
+
+  auto response = request.get(url + "/hello?a=1", {{"X-Test", "abc"}});
+  REQUIRE(response.ok());
+  REQUIRE(response.text() == "hello a=1");
+  REQUIRE(response.header("X-Test") == "abc");
+  REQUIRE(response.header("Content-Length") == "9");
+
+  response = request.get(url + "/none");
+  REQUIRE(response.status() == klib::HttpStatus::HTTP_STATUS_NOT_FOUND);
+
+  response = request.get(url + "/throw");
+  REQUIRE(response.status() ==
+          klib::HttpStatus::HTTP_STATUS_INTERNAL_SERVER_ERROR);
+  response = request.get(url + "/throw_int");
+  REQUIRE(response.status() ==
+          klib::HttpStatus::HTTP_STATUS_INTERNAL_SERVER_ERROR);
+
+  const std::string content(100000, 'a');
+  response = request.post(url + "/echo", content);
+  REQUIRE(response.ok());
+  REQUIRE(response.text() == content);
+
+  std::string_view rest = content;
+  response = request.post_stream(
+      url + "/echo", [&](char *buffer, std::size_t size) {
+        auto length = std::min(size, std::size(rest));
+        std::copy_n(std::data(rest), length, buffer);
+        rest.remove_prefix(length);
+        return length;
+      });
+  REQUIRE(response.ok());
+  REQUIRE(response.text() == content);
+
+  server.stop();
+}
+
+TEST_CASE("HTTP server static files", "[http_server]") {
+  const std::string dir = "http_server_static";
+  std::filesystem::create_directory(dir);
+  const auto content = klib::generate_random_bytes(102400);
+  klib::write_file(dir + "/a.bin", true, content);
+  klib::write_file(dir + "/index.html", false, "<p>klib</p>");
+
+  klib::HttpServer server;
+  server.mount("/static", dir);
+  server.start();
+
+  klib::Request request;
+  request.set_no_proxy();
+
+#ifndef NDEBUG
+  request.verbose(true);
+#endif
+
+  const auto url =
+      "http://127.0.0.1:" + std::to_string(server.port()) + "/static";
+
+  auto response = request.get(url + "/a.bin");
+  REQUIRE(response.ok());
+  REQUIRE(response.text() == content);
+  REQUIRE(response.header("Content-Type") == "application/octet-stream");
+
+  response = request.get(url + "/");
+  REQUIRE(response.ok());
+  REQUIRE(response.text() == "<p>klib</p>");
+  REQUIRE(response.header("Content-Type") == "text/html; charset=utf-8");
+
+  response = request.get(url + "/none.bin");
+  REQUIRE(response.status() == klib::HttpStatus::HTTP_STATUS_NOT_FOUND);
+
+  response = request.get_range(url + "/a.bin", 100, 199);
+  REQUIRE(response.status() == klib::HttpStatus::HTTP_STATUS_PARTIAL_CONTENT);
+  REQUIRE(response.text() == content.substr(100, 100));
+
+  const std::string file_name = "http_server_segmented.bin";
+  response = request.download_segmented(url + "/a.bin", file_name, 4,
+                                        klib::sha256_hex(content));
+  REQUIRE(response.ok());
+  REQUIRE(klib::read_file(file_name, true) == content);
+
+  server.stop();
+  REQUIRE(std::filesystem::remove(file_name));
+  REQUIRE(std::filesystem::remove_all(dir) == 3);
+}
+
+TEST_CASE("HTTP server chunked request", "[http_server]") {
+  klib::HttpServer server;
+  server.route(klib::HttpMethod::HTTP_METHOD_POST, "/echo",
+               [](const klib::ServerRequest &request,
+                  klib::ServerResponse &response) {
+                 response.body = request.body;
+               });
+  server.set_max_body_size(16);
+  server.start();
+
+  // Pipelined after the chunked one
+  auto response = exchange(server.port(),
+                           "POST /echo HTTP/1.1\r\n"
+                           "Transfer-Encoding: chunked\r\n\r\n"
+                           "5\r\nhello\r\n1;a=b\r\n \r\n5\r\nworld\r\n"
+                           "0\r\nX-Trailer: 1\r\n\r\n"
+                           "POST /echo HTTP/1.1\r\n"
+                           "Connection: close\r\n"
+                           "Content-Length: 2\r\n\r\nok");
+  REQUIRE(response.starts_with("HTTP/1.1 200 OK\r\n"));
+  REQUIRE(response.find("\r\n\r\nhello world") != std::string::npos);
+  REQUIRE(response.ends_with("\r\n\r\nok"));
+
+  // Rejected as soon as the chunk size is seen
+  response = exchange(server.port(),
+                      "POST /echo HTTP/1.1\r\n"
+                      "Transfer-Encoding: chunked\r\n\r\n"
+                      "ffffffffffffffff\r\n");
+  REQUIRE(response.starts_with("HTTP/1.1 413 Payload Too Large\r\n"));
+
+  response = exchange(server.port(),
+                      "POST /echo HTTP/1.1\r\n"
+                      "Transfer-Encoding: chunked\r\n\r\n"
+                      "8\r\n12345678\r\n8\r\n12345678\r\n1\r\n");
+  REQUIRE(response.starts_with("HTTP/1.1 413 Payload Too Large\r\n"));
+
+  response = exchange(server.port(),
+                      "POST /echo HTTP/1.1\r\n"
+                      "Transfer-Encoding: chunked\r\n\r\n"
+                      "2\r\nabc\r\n");
+  REQUIRE(response.starts_with("HTTP/1.1 400 Bad Request\r\n"));
+}
+
+TEST_CASE("HTTP server connections", "[http_server]") {
+  klib::HttpServer server;
+  server.route(klib::HttpMethod::HTTP_METHOD_GET, "/hello",
+               [](const klib::ServerRequest &, klib::ServerResponse &response) {
+                 response.body = "hello";
+               });
+  server.set_idle_timeout(1);
+  server.start();
+
+  // Both requests are answered before the connection is closed
+  auto response = exchange(server.port(),
+                           "GET /hello HTTP/1.1\r\n\r\n"
+                           "GET /hello HTTP/1.1\r\n\r\n",
+                           true);
+  REQUIRE(response.starts_with("HTTP/1.1 200 OK\r\n"));
+  REQUIRE(response.find("hello") != response.rfind("hello"));
+  REQUIRE(response.ends_with("\r\n\r\nhello"));
+
+  auto begin = std::chrono::steady_clock::now();
+  response = exchange(server.port(), "GET /hello HTTP/1.1\r\n\r\n");
+  REQUIRE(response.ends_with("\r\n\r\nhello"));
+  REQUIRE(std::chrono::steady_clock::now() - begin < std::chrono::seconds(4));
+
+  REQUIRE_THROWS(server.set_idle_timeout(0));
+}
+
+TEST_CASE("HTTP server out of descriptors", "[http_server]") {
+  klib::HttpServer server;
+  server.route(klib::HttpMethod::HTTP_METHOD_GET, "/hello",
+               [](const klib::ServerRequest &, klib::ServerResponse &response) {
+                 response.body = "hello";
+               });
+  server.start();
+
+  auto fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  REQUIRE(fd != -1);
+  timeval timeout = {5, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  rlimit limit;
+  REQUIRE(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+  auto lowered = limit;
+  lowered.rlim_cur = std::min<rlim_t>(limit.rlim_cur, 1024);
+  REQUIRE(setrlimit(RLIMIT_NOFILE, &lowered) == 0);
+
+  std::vector<int> fds;
+  while (true) {
+    auto reserved = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (reserved == -1) {
+      break;
+    }
+    fds.push_back(reserved);
+  }
+
+  // The pending connection is dropped instead of being reported forever
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(server.port());
+  inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+  REQUIRE(connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0);
+  char c;
+  auto size = read(fd, &c, 1);
+  auto error = errno;
+  close(fd);
+
+  for (auto reserved : fds) {
+    close(reserved);
+  }
+  REQUIRE(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+
+  REQUIRE((size == 0 || (size == -1 && error == ECONNRESET)));
+  auto response = exchange(server.port(), "GET /hello HTTP/1.1\r\n\r\n");
+  REQUIRE(response.ends_with("\r\n\r\nhello"));
+}
+
+TEST_CASE("HTTP server HTTP/2", "[http_server]") {
+  const std::string dir = "http_server_http2";
+  std::filesystem::create_directory(dir);
+  // Spans many DATA frames and flow control windows
+  const auto content = klib::generate_random_bytes(1024 * 1024);
+  klib::write_file(dir + "/a.bin", true, content);
+
+  klib::HttpServer server;
+  server.route(klib::HttpMethod::HTTP_METHOD_GET, "/hello",
+               [](const klib::ServerRequest &request,
+                  klib::ServerResponse &response) {
+                 response.body = "hello " + request.query;
+               });
+  server.route(klib::HttpMethod::HTTP_METHOD_POST, "/echo",
+               [](const klib::ServerRequest &request,
+                  klib::ServerResponse &response) {
+                 response.body = request.body;
+               });
+  server.mount("/static", dir);
+  server.start();
+
+  const auto url = "http://127.0.0.1:" + std::to_string(server.port());
+
+  auto [status, body] = http2_request(url + "/hello?a=1");
+  REQUIRE(status == 200);
+  REQUIRE(body == "hello a=1");
+
+  const std::string post(200000, 'a');
+  std::tie(status, body) = http2_request(url + "/echo", &post);
+  REQUIRE(status == 200);
+  REQUIRE(body == post);
+
+  std::tie(status, body) = http2_request(url + "/static/a.bin");
+  REQUIRE(status == 200);
+  REQUIRE(body == content);
+
+  std::tie(status, body) =
+      http2_request(url + "/static/a.bin", nullptr, "100-199");
+  REQUIRE(status == 206);
+  REQUIRE(body == content.substr(100, 100));
+
+  std::tie(status, body) = http2_request(url + "/none");
+  REQUIRE(status == 404);
+
+  server.stop();
+  REQUIRE(std::filesystem::remove_all(dir) == 2);
+}
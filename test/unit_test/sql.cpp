@@ -1,11 +1,22 @@
+#include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <filesystem>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <vector>
 
 #include <catch2/catch_test_macros.hpp>
 
+#include "klib/archive.h"
 #include "klib/sql.h"
 #include "klib/util.h"
 
@@ -117,3 +128,648 @@ TEST_CASE("blob", "[sql]") {
 
   std::filesystem::remove("test1.db");
 }
+
+TEST_CASE("statement cache", "[sql]") {
+  klib::SqlDatabase db("test2.db", klib::SqlDatabase::ReadWrite, "123");
+
+  REQUIRE_NOTHROW(db.drop_table_if_exists("CacheTest"));
+  REQUIRE_NOTHROW(db.exec("CREATE TABLE CacheTest(Id INT, Name TEXT);"));
+
+  const std::string insert = "INSERT INTO CacheTest(Id, Name) VALUES(?, ?);";
+  {
+    klib::SqlQuery query(db);
+    REQUIRE_NOTHROW(query.prepare(insert));
+    REQUIRE_NOTHROW(query.bind(1, 1));
+    REQUIRE_NOTHROW(query.bind(2, std::string("a")));
+    REQUIRE(query.exec() == 1);
+
+    // The same SQL text in use by two queries at the same time
+    klib::SqlQuery query2(db);
+    REQUIRE_NOTHROW(query2.prepare(insert));
+    REQUIRE_NOTHROW(query2.bind(1, 2));
+    REQUIRE(query2.exec() == 1);
+    REQUIRE_NOTHROW(query.bind(1, 3));
+    REQUIRE(query.exec() == 1);
+  }
+
+  // The cached statement is handed out without the previous bindings
+  klib::SqlQuery query(db);
+  REQUIRE_NOTHROW(query.prepare(insert));
+  REQUIRE(query.exec() == 1);
+
+  REQUIRE_NOTHROW(query.prepare("SELECT count(*) FROM CacheTest WHERE Name=?"));
+  REQUIRE_NOTHROW(query.bind(1, std::string("a")));
+  REQUIRE(query.next());
+  REQUIRE(query.get_column(0).as_int32() == 2);
+
+  // A query interrupted before completion is reset when it goes back into the
+  // cache
+  const std::string select =
+      "SELECT Id FROM CacheTest WHERE Id > 0 ORDER BY Id";
+  REQUIRE_NOTHROW(query.prepare(select));
+  REQUIRE(query.next());
+  REQUIRE(query.get_column(0).as_int32() == 1);
+  REQUIRE_NOTHROW(query.prepare(select));
+  REQUIRE(query.next());
+  REQUIRE(query.get_column(0).as_int32() == 1);
+  REQUIRE_NOTHROW(query.finalize());
+
+  for (std::size_t size : {0, 1}) {
+    db.set_statement_cache_size(size);
+    for (std::int32_t i = 0; i < 3; ++i) {
+      REQUIRE(db.table_exists("CacheTest"));
+      REQUIRE(db.table_line_count("CacheTest") == 4);
+      REQUIRE_NOTHROW(db.transaction());
+      REQUIRE_NOTHROW(db.rollback());
+    }
+  }
+
+  REQUIRE_THROWS(query.prepare("SELECT * FROM NotExists"));
+  REQUIRE_THROWS(query.prepare(""));
+  REQUIRE_NOTHROW(db.vacuum());
+
+  // A query may outlive its database, the statement is finalized on its own
+  {
+    auto other = std::make_unique<klib::SqlDatabase>(
+        "test2.db", klib::SqlDatabase::ReadWrite, "123");
+    klib::SqlQuery outliving(*other);
+    REQUIRE_NOTHROW(outliving.prepare(select));
+    REQUIRE(outliving.next());
+
+    other.reset();
+    REQUIRE_THROWS(outliving.next());
+    REQUIRE_THROWS(outliving.prepare(select));
+  }
+
+  std::filesystem::remove("test2.db");
+}
+
+TEST_CASE("column", "[sql]") {
+  using namespace std::string_literals;
+  using namespace std::string_view_literals;
+
+  klib::SqlDatabase db("test3.db", klib::SqlDatabase::ReadWrite, "123");
+
+  REQUIRE_NOTHROW(db.drop_table_if_exists("ColumnTest"));
+  REQUIRE_NOTHROW(db.exec("CREATE TABLE ColumnTest(Text TEXT, Data BLOB);"));
+
+  const auto text = "a\0b"s;
+  const std::string blob(1024, 'a');
+  klib::SqlQuery query(db);
+  REQUIRE_NOTHROW(
+      query.prepare("INSERT INTO ColumnTest(Text, Data) VALUES(?, ?);"));
+  REQUIRE_NOTHROW(query.bind(1, text));
+  REQUIRE_NOTHROW(query.bind(2, std::data(blob), std::size(blob),
+                             klib::BlobCompression::Zstd));
+  REQUIRE(query.exec() == 1);
+
+  REQUIRE_NOTHROW(query.prepare("SELECT Text, Data FROM ColumnTest"));
+  REQUIRE(query.next());
+  const auto text_column = query.get_column(0);
+  const auto copy = text_column;
+  REQUIRE(copy.as_text_view() == "a\0b"sv);
+  REQUIRE(text_column.as_text() == text);
+  REQUIRE_THROWS(text_column.as_blob_view());
+
+  const auto blob_column = query.get_column(1);
+  REQUIRE(blob_column.as_blob(klib::BlobCompression::Zstd) == blob);
+  // Stored compressed
+  REQUIRE(std::size(blob_column.as_blob_view()) < std::size(blob));
+  REQUIRE_THROWS(blob_column.as_text_view());
+  REQUIRE_THROWS(query.get_column(2));
+  REQUIRE_NOTHROW(query.finalize());
+
+  std::filesystem::remove("test3.db");
+}
+
+TEST_CASE("blob compression", "[sql]") {
+  klib::SqlDatabase db("test4.db", klib::SqlDatabase::ReadWrite, "123");
+
+  REQUIRE_NOTHROW(db.drop_table_if_exists("BlobTest"));
+  REQUIRE_NOTHROW(db.drop_table_if_exists("klib_zstd_dictionary"));
+  REQUIRE_NOTHROW(db.exec("CREATE TABLE BlobTest(Id INT, Data BLOB);"));
+
+  std::vector<std::string> samples;
+  for (std::int32_t i = 0; i < 1000; ++i) {
+    samples.push_back(R"({"id": )" + std::to_string(i) +
+                      R"(, "name": "user)" + std::to_string(i * 7) +
+                      R"(", "email": "user)" + std::to_string(i * 7) +
+                      R"(@example.com", "active": true, "tags": ["a", "b"]})");
+  }
+
+  klib::SqlQuery query(db);
+  REQUIRE_NOTHROW(query.prepare("SELECT ?"));
+  REQUIRE_THROWS(query.bind(1, std::data(samples[0]), std::size(samples[0]),
+                            klib::BlobCompression::ZstdDictionary));
+
+  std::uint32_t id = 0;
+  REQUIRE_NOTHROW(id = db.train_dictionary(samples, 4096));
+  REQUIRE(id != 0);
+
+  const std::string plain(1024, 'a');
+  REQUIRE_NOTHROW(query.prepare("INSERT INTO BlobTest(Id, Data) VALUES(?, ?)"));
+  REQUIRE_NOTHROW(query.bind(1, 1));
+  REQUIRE_NOTHROW(query.bind(2, std::data(plain), std::size(plain)));
+  REQUIRE(query.exec() == 1);
+  REQUIRE_NOTHROW(query.bind(1, 2));
+  REQUIRE_NOTHROW(query.bind(2, std::data(plain), std::size(plain),
+                             klib::BlobCompression::Zstd));
+  REQUIRE(query.exec() == 1);
+  REQUIRE_NOTHROW(query.bind(1, 3));
+  REQUIRE_NOTHROW(query.bind(2, std::data(samples[42]), std::size(samples[42]),
+                             klib::BlobCompression::ZstdDictionary));
+  REQUIRE(query.exec() == 1);
+  REQUIRE_NOTHROW(query.bind(1, 4));
+  REQUIRE_NOTHROW(query.bind_static(2, std::data(plain), std::size(plain)));
+  REQUIRE(query.exec() == 1);
+
+  const std::string select = "SELECT Data FROM BlobTest WHERE Id = ?";
+  REQUIRE_NOTHROW(query.prepare(select));
+  REQUIRE_NOTHROW(query.bind(1, 1));
+  REQUIRE(query.next());
+  REQUIRE(query.get_column(0).as_blob_view() == plain);
+  REQUIRE(query.get_column(0).as_blob() == plain);
+
+  REQUIRE_NOTHROW(query.prepare(select));
+  REQUIRE_NOTHROW(query.bind(1, 2));
+  REQUIRE(query.next());
+  REQUIRE(std::size(query.get_column(0).as_blob_view()) < std::size(plain));
+  REQUIRE(query.get_column(0).as_blob(klib::BlobCompression::Zstd) == plain);
+
+  REQUIRE_NOTHROW(query.prepare(select));
+  REQUIRE_NOTHROW(query.bind(1, 3));
+  REQUIRE(query.next());
+  const auto column = query.get_column(0);
+  REQUIRE(std::size(column.as_blob_view()) < std::size(samples[42]));
+  REQUIRE(column.as_blob(klib::BlobCompression::ZstdDictionary) ==
+          samples[42]);
+  // The dictionary ID is recorded in the frame
+  REQUIRE(column.as_blob(klib::BlobCompression::Zstd) == samples[42]);
+
+  REQUIRE_NOTHROW(query.prepare(select));
+  REQUIRE_NOTHROW(query.bind(1, 4));
+  REQUIRE(query.next());
+  REQUIRE(query.get_column(0).as_blob() == plain);
+  REQUIRE_NOTHROW(query.finalize());
+
+  REQUIRE(db.table_exists("klib_zstd_dictionary"));
+
+  std::filesystem::remove("test4.db");
+}
+
+TEST_CASE("bulk insert", "[sql]") {
+  klib::SqlDatabase db("test5.db", klib::SqlDatabase::ReadWrite, "123");
+
+  REQUIRE_NOTHROW(db.drop_table_if_exists("BulkTest"));
+  REQUIRE_NOTHROW(db.exec(
+      "CREATE TABLE BulkTest(Id INTEGER, Name TEXT, Price REAL, Note TEXT);"));
+
+  auto get_synchronous = [&] {
+    klib::SqlQuery query(db);
+    query.prepare("PRAGMA synchronous");
+    REQUIRE(query.next());
+    return query.get_column(0).as_int64();
+  };
+  auto get_journal_mode = [&] {
+    klib::SqlQuery query(db);
+    query.prepare("PRAGMA journal_mode");
+    REQUIRE(query.next());
+    return query.get_column(0).as_text();
+  };
+  const auto synchronous = get_synchronous();
+  const auto journal_mode = get_journal_mode();
+
+  using Inserter =
+      klib::BulkInserter<std::int64_t, std::string, double,
+                         std::optional<std::string>>;
+  const std::vector<std::string> columns = {"Id", "Name", "Price", "Note"};
+  REQUIRE_THROWS(Inserter(db, "BulkTest", {"Id", "Name"}));
+
+  {
+    klib::BulkInsertOptions options;
+    options.rows_per_transaction = 100;
+    options.rows_per_statement = 7;
+    Inserter inserter(db, "BulkTest", columns, options);
+    REQUIRE(get_synchronous() == 0);
+    REQUIRE(get_journal_mode() == "memory");
+
+    for (std::int64_t i = 0; i < 1000; ++i) {
+      std::optional<std::string> note;
+      if (i % 2 == 0) {
+        note = "note" + std::to_string(i);
+      }
+      inserter.insert({i, "name" + std::to_string(i), i * 0.5, note});
+    }
+    inserter.emplace(1000, "last", 1.0, std::nullopt);
+    // 1001 = 7 * 143, all written
+    REQUIRE(inserter.row_count() == 1001);
+    inserter.emplace(1001, "remaining", 2.0, "note");
+    REQUIRE(inserter.row_count() == 1001);
+    REQUIRE_NOTHROW(inserter.finish());
+    REQUIRE(inserter.row_count() == 1002);
+  }
+
+  REQUIRE(get_synchronous() == synchronous);
+  REQUIRE(get_journal_mode() == journal_mode);
+  REQUIRE(db.table_line_count("BulkTest") == 1002);
+
+  klib::SqlQuery query(db);
+  REQUIRE_NOTHROW(query.prepare(
+      "SELECT Name, Price, Note FROM BulkTest WHERE Id = 500 OR Id = 501 "
+      "ORDER BY Id"));
+  REQUIRE(query.next());
+  REQUIRE(query.get_column(0).as_text() == "name500");
+  REQUIRE(query.get_column(1).as_double() == 250.0);
+  REQUIRE(query.get_column(2).as_text() == "note500");
+  REQUIRE(query.next());
+  REQUIRE(query.get_column(2).is_null());
+  REQUIRE(!query.next());
+
+  // Rolled back during stack unwinding
+  try {
+    klib::BulkInsertOptions options;
+    options.rows_per_statement = 1;
+    klib::BulkInserter<std::int32_t> inserter(db, "BulkTest", {"Id"},
+                                              options);
+    inserter.emplace(-1);
+    inserter.emplace(-2);
+    throw std::runtime_error("error");
+  } catch (const std::runtime_error &) {
+  }
+  REQUIRE(db.table_line_count("BulkTest") == 1002);
+
+  {
+    klib::BulkInserter<std::int32_t> inserter(db, "BulkTest", {"Id"});
+    inserter.emplace(-1);
+  }
+  REQUIRE(db.table_line_count("BulkTest") == 1003);
+
+  // A failed insert rolls back, the inserter is then destroyed normally
+  REQUIRE_NOTHROW(db.drop_table_if_exists("BulkUnique"));
+  REQUIRE_NOTHROW(db.exec("CREATE TABLE BulkUnique(Id INTEGER UNIQUE);"));
+  {
+    klib::BulkInsertOptions options;
+    options.rows_per_statement = 2;
+    klib::BulkInserter<std::int32_t> inserter(db, "BulkUnique", {"Id"},
+                                              options);
+    inserter.emplace(1);
+    inserter.emplace(2);
+    inserter.emplace(3);
+    REQUIRE_THROWS(inserter.emplace(3));
+    REQUIRE(!db.in_transaction());
+    REQUIRE(inserter.row_count() == 0);
+    inserter.emplace(4);
+  }
+  REQUIRE(!db.in_transaction());
+  REQUIRE(get_synchronous() == synchronous);
+  REQUIRE(get_journal_mode() == journal_mode);
+  REQUIRE(db.table_line_count("BulkUnique") == 1);
+
+  std::filesystem::remove("test5.db");
+}
+
+TEST_CASE("database pool", "[sql]") {
+  std::filesystem::remove("test6.db");
+  REQUIRE_THROWS(klib::SqlDatabasePool("test6.db", "123", 0));
+
+  {
+    klib::SqlDatabasePool pool("test6.db", "123", 3);
+    REQUIRE(pool.reader_count() == 3);
+
+    {
+      auto writer = pool.writer();
+      REQUIRE_NOTHROW(writer->exec("CREATE TABLE PoolTest(Id INTEGER);"));
+
+      klib::SqlQuery query(*writer);
+      query.prepare("PRAGMA journal_mode");
+      REQUIRE(query.next());
+      REQUIRE(query.get_column(0).as_text() == "wal");
+    }
+
+    {
+      auto reader = pool.reader();
+      REQUIRE(reader->table_exists("PoolTest"));
+      REQUIRE_THROWS(reader->exec("INSERT INTO PoolTest(Id) VALUES(1);"));
+
+      // A moved-from lease returns nothing
+      auto moved = std::move(reader);
+      REQUIRE(moved->table_line_count("PoolTest") == 0);
+    }
+
+    constexpr std::int32_t count = 200;
+    std::atomic<bool> failed = false;
+    std::thread writer_thread([&] {
+      try {
+        for (std::int32_t i = 0; i < count; ++i) {
+          auto writer = pool.writer();
+          writer->exec("INSERT INTO PoolTest(Id) VALUES(" + std::to_string(i) +
+                       ");");
+        }
+      } catch (...) {
+        failed = true;
+      }
+    });
+
+    std::vector<std::thread> reader_threads;
+    for (std::size_t i = 0; i < 6; ++i) {
+      reader_threads.emplace_back([&] {
+        try {
+          std::int64_t last = 0;
+          while (last < count) {
+            auto reader = pool.reader();
+            auto current = reader->table_line_count("PoolTest");
+            if (current < last) {
+              failed = true;
+              return;
+            }
+            last = current;
+          }
+        } catch (...) {
+          failed = true;
+        }
+      });
+    }
+
+    writer_thread.join();
+    for (auto &thread : reader_threads) {
+      thread.join();
+    }
+    REQUIRE(!failed);
+    REQUIRE(pool.reader()->table_line_count("PoolTest") == count);
+  }
+
+  std::filesystem::remove("test6.db");
+}
+
+TEST_CASE("typed rows", "[sql]") {
+  using namespace std::string_view_literals;
+
+  klib::SqlDatabase db("test7.db", klib::SqlDatabase::ReadWrite, "123");
+
+  REQUIRE_NOTHROW(db.drop_table_if_exists("RowsTest"));
+  REQUIRE_NOTHROW(
+      db.exec("CREATE TABLE RowsTest(Id INTEGER, Name TEXT, Price REAL);"));
+
+  klib::SqlQuery query(db);
+  REQUIRE_NOTHROW(
+      query.prepare("INSERT INTO RowsTest(Id, Name, Price) VALUES(?, ?, ?)"));
+  REQUIRE_NOTHROW(query.bind_all(1, std::string("a"), 1.5));
+  REQUIRE(query.exec() == 1);
+  // Text is copied
+  REQUIRE_NOTHROW(query.bind_all(2LL, "b\0c"sv, std::nullopt));
+  REQUIRE(query.exec() == 1);
+  REQUIRE_NOTHROW(
+      query.bind_all(3U, std::optional<std::string>(), std::optional(3.5)));
+  REQUIRE(query.exec() == 1);
+
+  REQUIRE_NOTHROW(query.prepare("SELECT Id, Name, Price FROM RowsTest"));
+  std::vector<std::tuple<std::int64_t, std::string, std::optional<double>>>
+      rows;
+  for (const auto &row :
+       query.rows<std::int64_t, std::string, std::optional<double>>()) {
+    rows.push_back(row);
+  }
+  REQUIRE(std::size(rows) == 3);
+  REQUIRE(std::get<0>(rows[0]) == 1);
+  REQUIRE(std::get<1>(rows[0]) == "a");
+  REQUIRE(std::get<2>(rows[0]) == 1.5);
+  REQUIRE(std::get<1>(rows[1]) == "b\0c"sv);
+  REQUIRE(!std::get<2>(rows[1]));
+  REQUIRE(std::empty(std::get<1>(rows[2])));
+  REQUIRE(std::get<2>(rows[2]) == 3.5);
+
+  // Reset after the last row, and only the leading columns are read
+  std::int64_t sum = 0;
+  for (auto [id, name] : query.rows<std::int32_t, std::string_view>()) {
+    sum += id;
+    REQUIRE(std::size(name) <= 3);
+  }
+  REQUIRE(sum == 6);
+
+  REQUIRE_THROWS(query.rows<std::int64_t, std::string, double, double>());
+  REQUIRE_NOTHROW(query.finalize());
+
+  std::filesystem::remove("test7.db");
+}
+
+TEST_CASE("unencrypted", "[sql]") {
+  REQUIRE_THROWS(
+      klib::SqlDatabase("test8.db", klib::SqlDatabase::ReadWrite, ""));
+
+  {
+    klib::SqlDatabase db("test8.db", klib::SqlDatabase::ReadWrite);
+    REQUIRE_NOTHROW(db.exec("CREATE TABLE Plain(Id INTEGER);"));
+    REQUIRE(db.exec("INSERT INTO Plain(Id) VALUES(1);") == 1);
+  }
+
+  // Readable by a plain SQLite reader
+  REQUIRE(klib::read_file("test8.db", true).starts_with("SQLite format 3"));
+  {
+    klib::SqlDatabase db("test8.db", klib::SqlDatabase::ReadOnly);
+    REQUIRE(db.table_line_count("Plain") == 1);
+  }
+
+  std::filesystem::remove("test8.db");
+}
+
+TEST_CASE("backup", "[sql]") {
+  std::filesystem::remove("test9.db");
+  std::filesystem::remove("test9.backup.db");
+  std::filesystem::remove("test9.plain.db");
+  std::filesystem::remove("test9.snapshot.db");
+  std::filesystem::remove("test9.snapshot.db.zst");
+
+  {
+    klib::SqlDatabase db("test9.db", klib::SqlDatabase::ReadWrite, "123");
+    REQUIRE_NOTHROW(db.exec("CREATE TABLE BackupTest(Id INTEGER, Name TEXT);"));
+    klib::BulkInserter<std::int32_t, std::string> inserter(
+        db, "BackupTest", {"Id", "Name"});
+    for (std::int32_t i = 0; i < 1000; ++i) {
+      inserter.insert({i, std::string(100, 'a')});
+    }
+    inserter.finish();
+
+    std::int32_t steps = 0;
+    std::int32_t last_remaining = -1;
+    REQUIRE_NOTHROW(db.backup("test9.backup.db", 4, {},
+                              [&](std::int32_t remaining, std::int32_t) {
+                                ++steps;
+                                last_remaining = remaining;
+                                return true;
+                              }));
+    REQUIRE(steps > 1);
+    REQUIRE(last_remaining == 0);
+
+    REQUIRE_THROWS(db.backup("test9.backup.db", 1, {},
+                             [](std::int32_t, std::int32_t) { return false; }));
+    REQUIRE_NOTHROW(db.backup("test9.backup.db"));
+  }
+
+  {
+    klib::SqlDatabase db("test9.backup.db", klib::SqlDatabase::ReadWrite,
+                         "123");
+    REQUIRE(db.table_line_count("BackupTest") == 1000);
+  }
+
+  // Compressed snapshots are meant for unencrypted databases
+  {
+    klib::SqlDatabase db("test9.plain.db", klib::SqlDatabase::ReadWrite);
+    REQUIRE_NOTHROW(db.exec("CREATE TABLE BackupTest(Id INTEGER, Name TEXT);"));
+    klib::BulkInserter<std::int32_t, std::string> inserter(
+        db, "BackupTest", {"Id", "Name"});
+    for (std::int32_t i = 0; i < 1000; ++i) {
+      inserter.insert({i, std::string(100, 'a')});
+    }
+    inserter.finish();
+
+    REQUIRE_NOTHROW(db.vacuum_into("test9.snapshot.db"));
+    REQUIRE_THROWS(db.vacuum_into("test9.snapshot.db"));
+    klib::write_file("test9.snapshot.db.zst.tmp", false,
+                     std::string_view("user data"));
+    REQUIRE_NOTHROW(db.vacuum_into("test9.snapshot.db.zst", true));
+  }
+
+  {
+    klib::SqlDatabase db("test9.snapshot.db", klib::SqlDatabase::ReadOnly);
+    REQUIRE(db.table_line_count("BackupTest") == 1000);
+  }
+  REQUIRE(klib::read_file("test9.snapshot.db.zst.tmp", false) == "user data");
+  for (const auto &entry : std::filesystem::directory_iterator(".")) {
+    const auto name = entry.path().filename().string();
+    REQUIRE((!name.starts_with("test9.snapshot.db.zst.") ||
+             name == "test9.snapshot.db.zst.tmp"));
+  }
+  REQUIRE(std::filesystem::file_size("test9.snapshot.db.zst") <
+          std::filesystem::file_size("test9.snapshot.db"));
+  REQUIRE(klib::decompress_data(klib::read_file("test9.snapshot.db.zst", true))
+              .starts_with("SQLite format 3"));
+
+  std::filesystem::remove("test9.db");
+  std::filesystem::remove("test9.backup.db");
+  std::filesystem::remove("test9.plain.db");
+  std::filesystem::remove("test9.snapshot.db");
+  std::filesystem::remove("test9.snapshot.db.zst");
+  std::filesystem::remove("test9.snapshot.db.zst.tmp");
+}
+
+TEST_CASE("cipher options", "[sql]") {
+  std::filesystem::remove("test10.db");
+
+  klib::CipherOptions options;
+  options.raw_key = true;
+  options.cipher_page_size = 8192;
+  options.hmac_algorithm = klib::CipherHmac::Sha256;
+  const std::string key(32, '\x5a');
+
+  REQUIRE_THROWS(klib::SqlDatabase("test10.db", klib::SqlDatabase::ReadWrite,
+                                   std::string(16, 'a'), options));
+
+  {
+    klib::SqlDatabase db("test10.db", klib::SqlDatabase::ReadWrite, key,
+                         options);
+    REQUIRE_NOTHROW(db.exec("CREATE TABLE CipherTest(Id INTEGER);"));
+    REQUIRE(db.exec("INSERT INTO CipherTest(Id) VALUES(1);") == 1);
+    REQUIRE_NOTHROW(db.backup("test10.backup.db"));
+  }
+
+  for (const auto &name : {"test10.db", "test10.backup.db"}) {
+    klib::SqlDatabase db(name, klib::SqlDatabase::ReadOnly, key, options);
+    REQUIRE(db.table_line_count("CipherTest") == 1);
+  }
+
+  {
+    klib::CipherOptions kdf_options;
+    kdf_options.kdf_iter = 4000;
+    klib::SqlDatabasePool pool("test10.kdf.db", "123", 2,
+                               std::chrono::seconds(5), kdf_options);
+    REQUIRE_NOTHROW(
+        pool.writer()->exec("CREATE TABLE CipherTest(Id INTEGER);"));
+    REQUIRE(pool.reader()->table_exists("CipherTest"));
+  }
+
+  std::filesystem::remove("test10.db");
+  std::filesystem::remove("test10.backup.db");
+  std::filesystem::remove("test10.kdf.db");
+  std::filesystem::remove("test10.kdf.db-shm");
+  std::filesystem::remove("test10.kdf.db-wal");
+}
+
+TEST_CASE("async database", "[sql]") {
+  std::filesystem::remove("test11.db");
+
+  {
+    klib::AsyncSqlDatabase db("test11.db", "123", {}, 64);
+    REQUIRE_NOTHROW(
+        db.exec("CREATE TABLE AsyncTest(Id INTEGER PRIMARY KEY, Name TEXT);")
+            .get());
+
+    std::vector<std::future<std::int32_t>> futures;
+    for (std::int32_t i = 0; i < 1000; ++i) {
+      futures.push_back(db.exec("INSERT INTO AsyncTest(Id, Name) VALUES(?, ?)",
+                                i, "name" + std::to_string(i)));
+    }
+    // Fails alone, the other writes of the transaction are kept
+    auto duplicate =
+        db.exec("INSERT INTO AsyncTest(Id, Name) VALUES(?, ?)", 0, "a");
+    futures.push_back(db.exec("INSERT INTO AsyncTest(Id) VALUES(1000)"));
+
+    for (auto &future : futures) {
+      REQUIRE(future.get() == 1);
+    }
+    REQUIRE_THROWS(duplicate.get());
+
+    const std::string select =
+        "SELECT Id, Name FROM AsyncTest WHERE Id >= ? ORDER BY Id";
+    auto rows =
+        db.query<std::int64_t, std::optional<std::string>>(select, 999).get();
+    REQUIRE(std::size(rows) == 2);
+    REQUIRE(std::get<1>(rows[0]) == "name999");
+    REQUIRE(!std::get<1>(rows[1]));
+
+    auto count = db.run([](klib::SqlDatabase &database) {
+      return database.table_line_count("AsyncTest");
+    });
+    REQUIRE(count.get() == 1001);
+
+    auto failed = db.run([](klib::SqlDatabase &database) {
+      database.exec("SELECT * FROM NotExists");
+    });
+    REQUIRE_THROWS(failed.get());
+
+    // The transaction of the batch is gone, as after SQLITE_FULL
+    REQUIRE_THROWS(db.exec("ROLLBACK").get());
+    REQUIRE(db.exec("INSERT INTO AsyncTest(Id) VALUES(1001)").get() == 1);
+    REQUIRE(db.exec("DELETE FROM AsyncTest WHERE Id = 1001").get() == 1);
+
+    // Text views are copied, the caller's buffer may change before the write
+    {
+      std::string name = "view";
+      std::string note = "note";
+      auto inserted = db.exec("INSERT INTO AsyncTest(Id, Name) VALUES(?, ?)",
+                              1002, std::string_view(name));
+      auto updated =
+          db.exec("UPDATE AsyncTest SET Name = Name || ? WHERE Id = ?",
+                  std::optional<std::string_view>(note), 1002);
+      name.assign("xxxx");
+      note.assign("xxxx");
+      REQUIRE(inserted.get() == 1);
+      REQUIRE(updated.get() == 1);
+    }
+    auto text =
+        db.query<std::string>("SELECT Name FROM AsyncTest WHERE Id = ?", 1002)
+            .get();
+    REQUIRE(std::size(text) == 1);
+    REQUIRE(std::get<0>(text[0]) == "viewnote");
+    REQUIRE(db.exec("DELETE FROM AsyncTest WHERE Id = 1002").get() == 1);
+
+    // Queued tasks are finished by the destructor
+    static_cast<void>(db.exec("DELETE FROM AsyncTest WHERE Id = 0"));
+  }
+
+  {
+    klib::SqlDatabase db("test11.db", klib::SqlDatabase::ReadOnly, "123");
+    REQUIRE(db.table_line_count("AsyncTest") == 1000);
+  }
+
+  std::filesystem::remove("test11.db");
+}